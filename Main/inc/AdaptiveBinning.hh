@@ -0,0 +1,99 @@
+#ifndef AdaptiveBinning_hh_
+#define AdaptiveBinning_hh_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+namespace roofitter {
+
+  // Functions to merge adjacent bins of a fine uniform binning.
+  // The new edges are a subset of the fine edges (so that the data can be rebinned exactly)
+  // and always include the fixed edges (e.g. the fit range limits) so that no merged bin straddles them.
+  // A fixed edge that isn't on a fine edge is inserted anyway and splits the fine bin that it is in
+  // (see isOnFineEdge(), so that the caller can warn that such a bin can't be rebinned exactly)
+  namespace AdaptiveBinning {
+
+    inline bool isFixedEdge(double edge, const std::vector<double>& fixed_edges, double tolerance) {
+      for (const auto& i_fixed : fixed_edges) {
+	if (std::fabs(edge - i_fixed) < tolerance) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    inline double edgeTolerance(const std::vector<double>& fine_edges) {
+      return 1e-6*(fine_edges.back() - fine_edges.front()) / (fine_edges.size() - 1);
+    }
+
+    inline bool isOnFineEdge(double edge, const std::vector<double>& fine_edges) {
+      return isFixedEdge(edge, fine_edges, edgeTolerance(fine_edges));
+    }
+
+    // Adds the fixed edges that are inside the range but not already edges
+    inline void insertFixedEdges(std::vector<double>& edges, const std::vector<double>& fixed_edges, double tolerance) {
+      for (const auto& i_fixed : fixed_edges) {
+	if (i_fixed > edges.front() + tolerance && i_fixed < edges.back() - tolerance && !isFixedEdge(i_fixed, edges, tolerance)) {
+	  edges.insert(std::upper_bound(edges.begin(), edges.end(), i_fixed), i_fixed);
+	}
+      }
+    }
+
+    // Merges bins from low to high until each one has at least min_content.
+    // Anything left over at the end of a segment is merged into the previous bin
+    inline std::vector<double> mergeToMinContent(const std::vector<double>& fine_edges, const std::vector<double>& contents,
+						 double min_content, const std::vector<double>& fixed_edges) {
+      double tolerance = edgeTolerance(fine_edges);
+      std::vector<double> edges{fine_edges.front()};
+      bool last_edge_fixed = true;
+      double content = 0;
+      for (size_t i_bin = 0; i_bin < contents.size(); ++i_bin) {
+	content += contents[i_bin];
+	double high_edge = fine_edges[i_bin+1];
+	bool forced = (i_bin+1 == contents.size()) || isFixedEdge(high_edge, fixed_edges, tolerance);
+	if (content >= min_content || forced) {
+	  if (content < min_content && !last_edge_fixed) {
+	    edges.back() = high_edge;
+	  }
+	  else {
+	    edges.push_back(high_edge);
+	  }
+	  last_edge_fixed = forced;
+	  content = 0;
+	}
+      }
+      insertFixedEdges(edges, fixed_edges, tolerance);
+      return edges;
+    }
+
+    // Chooses edges so that each bin has roughly the same content (n_bins bins in total)
+    inline std::vector<double> quantileEdges(const std::vector<double>& fine_edges, const std::vector<double>& contents,
+					     int n_bins, const std::vector<double>& fixed_edges) {
+      double tolerance = edgeTolerance(fine_edges);
+      double total = 0;
+      for (const auto& i_content : contents) {
+	total += i_content;
+      }
+      std::vector<double> edges{fine_edges.front()};
+      double target = total / std::max(n_bins, 1);
+      double cumulative = 0;
+      int n_closed = 0;
+      for (size_t i_bin = 0; i_bin < contents.size(); ++i_bin) {
+	cumulative += contents[i_bin];
+	double high_edge = fine_edges[i_bin+1];
+	bool forced = (i_bin+1 == contents.size()) || isFixedEdge(high_edge, fixed_edges, tolerance);
+	if (cumulative >= (n_closed+1)*target || forced) {
+	  edges.push_back(high_edge);
+	  while (cumulative >= (n_closed+1)*target && target > 0) {
+	    ++n_closed;
+	  }
+	}
+      }
+      insertFixedEdges(edges, fixed_edges, tolerance);
+      return edges;
+    }
+  }
+}
+
+#endif
@@ -1,27 +1,56 @@
 #ifndef Analysis_hh_
 #define Analysis_hh_
 
+#include <map>
+
 #include "TFile.h"
 #include "TH1.h"
+#include "TH2.h"
 #include "TF1.h"
+#include "THnSparse.h"
+#include "TTree.h"
+#include "TRandom3.h"
+#include "TMatrixDSym.h"
 
 #include "RooWorkspace.h"
 #include "RooDataHist.h"
+#include "RooDataSet.h"
 #include "RooPlot.h"
 #include "RooAddPdf.h"
+#include "RooSimultaneous.h"
+#include "RooCategory.h"
+#include "RooAddition.h"
 #include "RooFFTConvPdf.h"
 #include "RooRealVar.h"
+#include "RooNumber.h"
+#include "RooBinning.h"
 #include "RooFitResult.h"
+#include "RooMinimizer.h"
 #include "RooHistPdf.h"
 #include "RooEffProd.h"
 
 #include "RooNumIntConfig.h"
 
+#include <cmath>
+#include <iomanip>
+#include <thread>
+#include <fcntl.h>
+
 #include "ConfigTools/inc/SimpleConfig.hh"
 
 #include "Main/inc/Configs.hh"
 #include "Main/inc/Observable.hh"
 #include "Main/inc/Component.hh"
+#include "Main/inc/TreeScan.hh"
+#include "Main/inc/TreeSkim.hh"
+#include "Main/inc/RooBinnedPoissonNLL.hh"
+#include "Main/inc/RooForkedSum.hh"
+#include "Main/inc/TemplateFit.hh"
+#include "Main/inc/AdaptiveBinning.hh"
+#include "Main/inc/ForkPool.hh"
+#include "Main/inc/Report.hh"
+#include "Main/inc/CutFlow.hh"
+#include "Main/inc/ModelGraph.hh"
 
 namespace roofitter {
 
@@ -36,28 +65,97 @@ namespace roofitter {
     fhicl::Atom<bool> invert{fhicl::Name("invert"), fhicl::Comment("Set to true if you want to invert the cut"), false};
   };
 
+  struct CategoryConfig {
+    fhicl::Atom<std::string> name{fhicl::Name("name"), fhicl::Comment("Category name (a state of the \"category\" variable)")};
+    fhicl::Sequence< fhicl::Table<CutConfig> > cuts{fhicl::Name("cuts"), fhicl::Comment("Cuts that select this category (applied on top of the analysis cuts)")};
+    fhicl::Table<PdfConfig> model{fhicl::Name("model"), fhicl::Comment("The PDF to fit in this category (parameters with the same name are shared between categories)")};
+  };
+
+  struct SystematicConfig {
+    fhicl::Atom<std::string> name{fhicl::Name("name"), fhicl::Comment("Name of this systematic")};
+    fhicl::Sequence<std::string> parameters{fhicl::Name("parameters"), fhicl::Comment("Names of the (constant) parameters to vary")};
+    fhicl::OptionalSequence<double> sigmas{fhicl::Name("sigmas"), fhicl::Comment("Shift each parameter up and down by its sigma on its own")};
+    fhicl::OptionalSequence< fhicl::Sequence<double> > grid{fhicl::Name("grid"), fhicl::Comment("A list of values for each parameter (every combination is used)")};
+    fhicl::OptionalSequence< fhicl::Sequence<double> > sets{fhicl::Name("sets"), fhicl::Comment("Sets of values for all the parameters together (e.g. for correlated parameters)")};
+  };
+
+  struct BootstrapConfig {
+    fhicl::Atom<int> nReplicas{fhicl::Name("nReplicas"), fhicl::Comment("Number of Poisson-resampled replicas of the data to fit"), 1000};
+    fhicl::Atom<int> seed{fhicl::Name("seed"), fhicl::Comment("Random seed (replica i always uses the same random numbers)"), 1};
+    fhicl::Atom<double> confidenceLevel{fhicl::Name("confidenceLevel"), fhicl::Comment("Coverage of the central percentile interval"), 0.6827};
+  };
+
+  struct ReportConfig {
+    fhicl::Sequence<std::string> formats{fhicl::Name("formats"), fhicl::Comment("Image formats to draw the report in (e.g. \"pdf\", \"png\")"), std::vector<std::string>()};
+    fhicl::Atom<std::string> prefix{fhicl::Name("prefix"), fhicl::Comment("Images are called <output file>_<prefix>_<observable>.<format>, next to the output file (default prefix is the analysis name)"), ""};
+  };
+
+  struct TemplateCacheConfig {
+    fhicl::Atom<std::string> dir{fhicl::Name("dir"), fhicl::Comment("Directory for the cached tables (shared between runs)")};
+    fhicl::Atom<int> nPoints{fhicl::Name("nPoints"), fhicl::Comment("Number of grid points to tabulate each response convolution on"), 4000};
+  };
+
+  struct CutFlowConfig {
+    fhicl::Atom<bool> histograms{fhicl::Name("histograms"), fhicl::Comment("Set to true to also histogram each observable after each cut"), false};
+  };
+
   struct AnalysisConfig {
     fhicl::Atom<std::string> name{fhicl::Name("name"), fhicl::Comment("Analysis name")};
     fhicl::Sequence< fhicl::Table<ObservableConfig> > observables{fhicl::Name("observables"), fhicl::Comment("List of observables")};
     fhicl::Sequence< fhicl::Table<ComponentConfig> > components{fhicl::Name("components"), fhicl::Comment("List of components")};
     fhicl::Sequence< fhicl::Table<CutConfig> > cuts{fhicl::Name("cuts"), fhicl::Comment("List of cuts to apply")};
     fhicl::Table<PdfConfig> model{fhicl::Name("model"), fhicl::Comment("The PDF for the full final model to fit")};
+    fhicl::OptionalSequence< fhicl::Table<CategoryConfig> > categories{fhicl::Name("categories"), fhicl::Comment("Categories for a simultaneous fit (the model should then be a SIMUL of the category models over \"category\")")};
     fhicl::Atom<bool> unfold{fhicl::Name("unfold"), fhicl::Comment("Set to tru if you want to unfold the efficiency and response effects"), false};
+    fhicl::Atom<bool> sparse{fhicl::Name("sparse"), fhicl::Comment("Set to true to store the data in a sparse histogram and fit a weighted dataset of only the populated bins (always used for more than two observables)"), false};
+    fhicl::Atom<bool> fastNLL{fhicl::Name("fastNLL"), fhicl::Comment("Set to true to fit with RooBinnedPoissonNLL instead of RooFit's own likelihood (model must be a SUM of yields*PDFs)"), false};
+    fhicl::Atom<bool> templateFit{fhicl::Name("templateFit"), fhicl::Comment("Set to true to solve for the yields on precomputed binned templates when all component shapes are fixed (otherwise RooFit's fitTo is used)"), false};
     fhicl::Atom<bool> allow_failure{fhicl::Name("allow_failure"), fhicl::Comment("If set to true, then roofitter will not throw an exception for a failed fit."), false};
     fhicl::Sequence<std::string> calculations{fhicl::Name("calculations"), fhicl::Comment("A list of supplemental calculations that you want to calculate"), std::vector<std::string>()};
+    fhicl::OptionalAtom<std::string> signalYield{fhicl::Name("signalYield"), fhicl::Comment("The yield to calculate the expected discovery and exclusion significance for when fitting the Asimov data (-a)")};
+    fhicl::OptionalTable<TemplateCacheConfig> templateCache{fhicl::Name("templateCache"), fhicl::Comment("Tabulate the response convolutions and keep the tables on disk so that later runs with the same parameters skip the FFT")};
+    fhicl::OptionalTable<CutFlowConfig> cutFlow{fhicl::Name("cutFlow"), fhicl::Comment("Count the entries passing each cut (cumulative, on its own and N-1) while filling the data")};
+    fhicl::OptionalTable<ReportConfig> report{fhicl::Name("report"), fhicl::Comment("Write binned data, model and component curves, pulls and a results table (and optionally draw them)")};
+    fhicl::OptionalTable<BootstrapConfig> bootstrap{fhicl::Name("bootstrap"), fhicl::Comment("Refit (and unfold) Poisson-resampled replicas of the data to get bootstrap intervals")};
+    fhicl::OptionalSequence< fhicl::Table<SystematicConfig> > systematics{fhicl::Name("systematics"), fhicl::Comment("Parameter variations to refit (and unfold) the same data with")};
   };
 
+  // One set of parameter values for a systematic
+  struct Variation {
+    std::string name;
+    std::vector< std::pair<std::string, double> > values;
+  };
+
+  // One fit range for each observable
+  struct FitWindow {
+    std::vector<double> mins;
+    std::vector<double> maxs;
+  };
+
+  // Owns everything that it creates (the workspace, the data histograms, the fit result and the result trees)
+  // so that analyses can be created and destroyed over and over at constant memory. It can't be copied:
+  // share it with a std::shared_ptr (see Job and AnalysisCache)
   class Analysis {
   private:
     AnalysisConfig _anaConf;
-    RooWorkspace* _ws;
+    std::unique_ptr<RooWorkspace> _ws;
 
     Observables _observables;
     Components _components;
+    std::vector<CategoryConfig> _categories;
 
-    TH1* _hist;
+    std::unique_ptr<TH1> _hist;
+    std::unique_ptr<THnSparse> _sparseHist;
+    std::map< std::string, std::unique_ptr<TH1> > _catHists;
 
-    RooFitResult* _fitResult;
+    std::unique_ptr<RooFitResult> _fitResult;
+    std::vector<std::string> _unfoldedNames;
+    std::map< std::string, std::pair<std::string, double> > _unfoldedYields; // each unfolded yield's fitted yield and efficiency correction
+    std::unique_ptr<TTree> _systTree;
+    std::unique_ptr<TTree> _bootTree;
+    std::unique_ptr<TTree> _windowTree;
+    std::unique_ptr<Report> _report;
+    std::unique_ptr<CutFlow> _cutFlow;
 
   public:
     Analysis(const AnalysisConfig& cfg) : 
@@ -67,41 +165,538 @@ namespace roofitter {
       std::cout << _anaConf.name() << std::endl;
 
       // Construct the observables
-      if (_anaConf.observables().size() > 2) {
-	throw cet::exception("Analysis Constructor") << "More than 2 observables is not currently supported";
-      }
       for (const auto& i_obs_cfg : _anaConf.observables()) {
-	Observable i_obs(i_obs_cfg, _ws);
+	Observable i_obs(i_obs_cfg, _ws.get());
 	_observables.push_back(i_obs);
       }
 
+      // Work out which names the model and the calculations need so that we only build the component PDFs that they use
+      ModelGraph graph;
+      graph.addFormula(_anaConf.model().name(), _anaConf.model().formula(), true);
+      std::vector<CategoryConfig> cat_cfgs;
+      if (_anaConf.categories(cat_cfgs)) {
+	for (const auto& i_cat_cfg : cat_cfgs) {
+	  graph.addFormula(i_cat_cfg.model().name(), i_cat_cfg.model().formula(), false);
+	}
+      }
+      for (const auto& i_calc : _anaConf.calculations()) {
+	graph.addFormula(getCalculationName(i_calc), i_calc, true);
+      }
+      std::set<std::string> used = graph.reachable();
+
       // Construct the components
+      std::unique_ptr<TemplateCache> template_cache;
+      TemplateCacheConfig template_cache_cfg;
+      if (_anaConf.templateCache(template_cache_cfg)) {
+	template_cache.reset(new TemplateCache(template_cache_cfg.dir(), template_cache_cfg.nPoints()));
+      }
       for (const auto& i_comp_cfg : _anaConf.components()) {
-	Component i_comp(i_comp_cfg, _ws, _observables);
+	Component i_comp(i_comp_cfg, _ws.get(), _observables, template_cache.get(), &used);
+	if (!i_comp.isUsed()) {
+	  std::cout << _anaConf.name() << ": component " << i_comp.getName() << " is not used by the model, so it is not built" << std::endl;
+	  continue;
+	}
 	_components.push_back(i_comp);
       }
+      if (template_cache) {
+	std::cout << _anaConf.name() << ": " << template_cache->nHits() << " templates read from cache, " << template_cache->nMisses() << " added" << std::endl;
+      }
 
-      // Construct the final model
       std::stringstream factory_cmd;
+
+      // Construct the categories and the model for each of them
+      if (_anaConf.categories(_categories)) {
+	RooCategory category("category", "category");
+	for (const auto& i_cat_cfg : _categories) {
+	  category.defineType(i_cat_cfg.name().c_str());
+	}
+	_ws->import(category);
+	for (const auto& i_cat_cfg : _categories) {
+	  factory_cmd.str("");
+	  factory_cmd << i_cat_cfg.model().formula();
+	  _ws->factory(factory_cmd.str().c_str());
+	}
+      }
+
+      // Construct the final model
       factory_cmd.str("");
       factory_cmd << _anaConf.model().formula();
       _ws->factory(factory_cmd.str().c_str());
     }
+    Analysis(const Analysis&) = delete;
+    Analysis& operator=(const Analysis&) = delete;
 
-    TCut cutcmd() { 
+    TCut cutcmd(TTree* tree) { return cutcmd(_anaConf.cuts(), tree); }
+
+    // The combined cut for tree (which may be a skim that has already evaluated some of the cuts)
+    static TCut cutcmd(const std::vector<CutConfig>& cuts, TTree* tree) {
       TCut result;
-      for (const auto& i_cut_cfg : _anaConf.cuts()) {
+      for (const auto& i_cut_cfg : cuts) {
+	std::string leaf = TreeSkim::column(tree, i_cut_cfg.leaf());
 	if (i_cut_cfg.invert()) {
-	  result += !TCut(i_cut_cfg.leaf().c_str());
+	  result += !TCut(leaf.c_str());
 	}
 	else {
-	  result += TCut(i_cut_cfg.leaf().c_str());
+	  result += TCut(leaf.c_str());
 	}
       }
       return result;
     }
 
+    // Every expression that filling the data evaluates on the tree (observable leaves and cuts), e.g. for a skim
+    std::vector<std::string> getTreeExpressions() const {
+      std::vector<std::string> exprs;
+      for (const auto& i_obs : _observables) {
+	exprs.push_back(i_obs.getLeaf());
+      }
+      for (const auto& i_cut_cfg : _anaConf.cuts()) {
+	exprs.push_back(i_cut_cfg.leaf());
+      }
+      for (const auto& i_cat_cfg : _categories) {
+	for (const auto& i_cut_cfg : i_cat_cfg.cuts()) {
+	  exprs.push_back(i_cut_cfg.leaf());
+	}
+      }
+      return exprs;
+    }
+
+    bool hasCategories() const { return !_categories.empty(); }
+
+    // Adds the analysis cuts to the scan and returns the indices of their pass flags.
+    // When recording a cut flow each cut is added on its own, otherwise they are combined into one
+    std::vector<size_t> addCuts(TreeScan& scan, TTree* tree) {
+      std::vector<size_t> i_cuts;
+      if (_cutFlow) {
+	for (const auto& i_cut_cfg : _anaConf.cuts()) {
+	  i_cuts.push_back(scan.addCut(cutcmd(std::vector<CutConfig>{i_cut_cfg}, tree).GetTitle()));
+	}
+      }
+      else {
+	i_cuts.push_back(scan.addCut(cutcmd(tree).GetTitle()));
+      }
+      return i_cuts;
+    }
+
+    // The entry's weight from the cuts added by addCuts(), or 0 if it failed any of them (the observable values come
+    // first in values). As in TTree::Draw this is the value of the combined cut, which is the cut itself if there
+    // is only one (e.g. a weight leaf) and otherwise 0 or 1 since TCut combines them with &&
+    double cutWeight(const std::vector<size_t>& i_cuts, const std::vector<double>& cut_values, const std::vector<double>& values) {
+      if (_cutFlow) {
+	if (!_cutFlow->fill(cut_values, i_cuts, values)) {
+	  return 0;
+	}
+	return i_cuts.size() == 1 ? cut_values[i_cuts.front()] : 1;
+      }
+      return cut_values[i_cuts.front()];
+    }
+
+    void setupCutFlow() {
+      CutFlowConfig cutflow_cfg;
+      if (!_anaConf.cutFlow(cutflow_cfg)) {
+	return;
+      }
+      std::vector<std::string> cut_names;
+      for (const auto& i_cut_cfg : _anaConf.cuts()) {
+	cut_names.push_back(i_cut_cfg.name());
+      }
+      _cutFlow.reset(new CutFlow(cut_names));
+      if (cutflow_cfg.histograms()) {
+	for (const auto& i_obs : _observables) {
+	  RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	  _cutFlow->addObservable(i_obs.getName(), var->getBins(), var->getMin(), var->getMax());
+	}
+      }
+    }
+
+    void printCutFlow() const {
+      if (_cutFlow) {
+	std::cout << _anaConf.name() << ": cut flow" << std::endl;
+	_cutFlow->print(std::cout);
+      }
+    }
+
+    // Dense histograms are only possible for one or two observables
+    bool isSparse() const { return _anaConf.sparse() || _observables.size() > 2; }
+
+    bool hasAdaptiveBinning() const {
+      for (const auto& i_obs : _observables) {
+	AdaptiveBinningConfig adaptive_cfg;
+	if (i_obs.getConf().adaptiveBinning(adaptive_cfg)) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    // The contents of the filled histogram (or a category's histogram) summed over all the other observables
+    std::vector<double> projectData(size_t i_dim, const TH1* hist = 0) const {
+      RooRealVar* var = _ws->var(_observables.at(i_dim).getName().c_str());
+      std::vector<double> contents(var->getBins(), 0.0);
+      if (!hist) {
+	hist = _hist.get();
+      }
+      if (_sparseHist) {
+	std::vector<int> coords(_sparseHist->GetNdimensions());
+	for (Long64_t i_bin = 0; i_bin < _sparseHist->GetNbins(); ++i_bin) {
+	  double content = _sparseHist->GetBinContent(i_bin, &coords[0]);
+	  if (coords[i_dim] >= 1 && coords[i_dim] <= (int) contents.size()) {
+	    contents[coords[i_dim]-1] += content;
+	  }
+	}
+      }
+      else {
+	for (int i_bin = 1; i_bin <= hist->GetNbinsX(); ++i_bin) {
+	  for (int j_bin = 1; j_bin <= hist->GetNbinsY(); ++j_bin) {
+	    contents[(i_dim == 0 ? i_bin : j_bin) - 1] += hist->GetBinContent(i_bin, j_bin);
+	  }
+	}
+      }
+      return contents;
+    }
+
+    // The number of events in each bin of this observable expected from the model with its initial parameters
+    std::vector<double> projectModel(size_t i_dim) const {
+      RooAbsPdf* model = _ws->pdf(_anaConf.model().name().c_str());
+      RooArgSet vars;
+      for (const auto& i_obs : _observables) {
+	vars.add(*_ws->var(i_obs.getName().c_str()));
+      }
+      RooRealVar* var = _ws->var(_observables.at(i_dim).getName().c_str());
+      double n_expected = model->expectedEvents(vars);
+      const RooAbsBinning& binning = var->getBinning();
+      std::vector<double> contents;
+      for (int i_bin = 0; i_bin < binning.numBins(); ++i_bin) {
+	var->setRange("adaptiveBin", binning.binLow(i_bin), binning.binHigh(i_bin));
+	std::unique_ptr<RooAbsReal> integral(model->createIntegral(vars, RooFit::NormSet(vars), RooFit::Range("adaptiveBin")));
+	contents.push_back(n_expected * integral->getVal());
+      }
+      return contents;
+    }
+
+    // The number of events that each component of the model (with its current parameters) puts in each bin
+    // of observable i_dim, integrated over the fit range of the other observables
+    std::vector< std::vector<double> > projectComponents(size_t i_dim, RooAbsPdf* model, std::vector<std::string>& comp_names) const {
+      RooArgSet vars;
+      for (const auto& i_obs : _observables) {
+	RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	vars.add(*var);
+	var->setRange("reportBin", i_obs.getConf().fitMin(), i_obs.getConf().fitMax());
+      }
+
+      std::vector<RooAbsPdf*> pdfs;
+      std::vector<double> yields;
+      if (RooAddPdf* add_model = dynamic_cast<RooAddPdf*>(model)) {
+	for (int i_comp = 0; i_comp < add_model->pdfList().getSize(); ++i_comp) {
+	  pdfs.push_back(static_cast<RooAbsPdf*>(add_model->pdfList().at(i_comp)));
+	  yields.push_back(static_cast<RooAbsReal*>(add_model->coefList().at(i_comp))->getVal());
+	}
+      }
+      else {
+	pdfs.push_back(model);
+	yields.push_back(model->expectedEvents(vars));
+      }
+
+      RooRealVar* var = _ws->var(_observables.at(i_dim).getName().c_str());
+      const RooAbsBinning& binning = var->getBinning();
+      std::vector< std::vector<double> > contents;
+      for (size_t i_comp = 0; i_comp < pdfs.size(); ++i_comp) {
+	comp_names.push_back(pdfs[i_comp]->GetName());
+	std::unique_ptr<RooAbsReal> fit_integral(pdfs[i_comp]->createIntegral(vars, RooFit::NormSet(vars), RooFit::Range("fit")));
+	double fit_fraction = fit_integral->getVal();
+	std::vector<double> comp_contents;
+	for (int i_bin = 0; i_bin < binning.numBins(); ++i_bin) {
+	  var->setRange("reportBin", binning.binLow(i_bin), binning.binHigh(i_bin));
+	  std::unique_ptr<RooAbsReal> integral(pdfs[i_comp]->createIntegral(vars, RooFit::NormSet(vars), RooFit::Range("reportBin")));
+	  comp_contents.push_back(fit_fraction > 0 ? yields[i_comp] * integral->getVal() / fit_fraction : 0);
+	}
+	contents.push_back(comp_contents);
+      }
+      return contents;
+    }
+
+    // Merges the bins of each observable with an adaptiveBinning config
+    // and then rebins the filled histogram with the new variable bin edges
+    void adaptBinning() {
+      std::vector< std::vector<double> > all_edges;
+      for (size_t i_dim = 0; i_dim < _observables.size(); ++i_dim) {
+	const auto& i_obs = _observables.at(i_dim);
+	RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	std::vector<double> edges = i_obs.getBinEdges(_ws.get());
+
+	AdaptiveBinningConfig adaptive_cfg;
+	if (i_obs.getConf().adaptiveBinning(adaptive_cfg)) {
+	  std::vector<double> fixed_edges{i_obs.getConf().fitMin(), i_obs.getConf().fitMax()};
+	  for (const auto& i_fixed : fixed_edges) {
+	    if (i_fixed > edges.front() && i_fixed < edges.back() && !AdaptiveBinning::isOnFineEdge(i_fixed, edges)) {
+	      std::cout << _anaConf.name() << ": warning: fit range limit " << i_fixed << " of " << i_obs.getName() << " is not a bin edge, so the bin it splits is counted on the side of its centre" << std::endl;
+	    }
+	  }
+	  std::string method = adaptive_cfg.method();
+	  if (method == "minCount") {
+	    edges = AdaptiveBinning::mergeToMinContent(edges, projectData(i_dim), adaptive_cfg.threshold(), fixed_edges);
+	  }
+	  else if (method == "minExpected") {
+	    edges = AdaptiveBinning::mergeToMinContent(edges, projectModel(i_dim), adaptive_cfg.threshold(), fixed_edges);
+	  }
+	  else if (method == "quantile") {
+	    edges = AdaptiveBinning::quantileEdges(edges, projectData(i_dim), adaptive_cfg.nBins(), fixed_edges);
+	  }
+	  else {
+	    throw cet::exception("Analysis::adaptBinning()") << "Unknown adaptive binning method \"" << method << "\" for observable \"" << i_obs.getName() << "\"";
+	  }
+	  std::cout << _anaConf.name() << ": " << i_obs.getName() << " merged from " << var->getBins() << " to " << edges.size()-1 << " bins" << std::endl;
+	  var->setBinning(RooBinning(edges.size()-1, &edges[0]));
+	}
+	all_edges.push_back(edges);
+      }
+
+      // The new edges are a subset of the old ones (apart from a fit range limit that isn't on an old edge, see above)
+      // so filling at the old bin centres is exact
+      if (_sparseHist) {
+	std::vector<int> n_bins;
+	std::vector<double> mins, maxs;
+	for (const auto& i_edges : all_edges) {
+	  n_bins.push_back(i_edges.size()-1);
+	  mins.push_back(i_edges.front());
+	  maxs.push_back(i_edges.back());
+	}
+	THnSparse* new_hist = new THnSparseD(_sparseHist->GetName(), _sparseHist->GetTitle(), n_bins.size(), &n_bins[0], &mins[0], &maxs[0]);
+	for (size_t i_dim = 0; i_dim < all_edges.size(); ++i_dim) {
+	  new_hist->GetAxis(i_dim)->Set(n_bins[i_dim], &all_edges[i_dim][0]);
+	}
+	std::vector<int> coords(n_bins.size());
+	std::vector<double> x(n_bins.size());
+	for (Long64_t i_bin = 0; i_bin < _sparseHist->GetNbins(); ++i_bin) {
+	  double content = _sparseHist->GetBinContent(i_bin, &coords[0]);
+	  for (size_t i_dim = 0; i_dim < n_bins.size(); ++i_dim) {
+	    x[i_dim] = _sparseHist->GetAxis(i_dim)->GetBinCenter(coords[i_dim]);
+	  }
+	  new_hist->Fill(&x[0], content);
+	}
+	_sparseHist.reset(new_hist);
+      }
+      else {
+	TH1* new_hist = 0;
+	if (all_edges.size() == 1) {
+	  new_hist = new TH1D("", _hist->GetTitle(), all_edges[0].size()-1, &all_edges[0][0]);
+	}
+	else {
+	  new_hist = new TH2D("", _hist->GetTitle(), all_edges[0].size()-1, &all_edges[0][0], all_edges[1].size()-1, &all_edges[1][0]);
+	}
+	new_hist->SetDirectory(0);
+	int first_j_bin = (all_edges.size() == 1) ? 1 : 0; // no y under/overflow for a TH1
+	int last_j_bin = (all_edges.size() == 1) ? 1 : _hist->GetNbinsY()+1;
+	for (int i_bin = 0; i_bin <= _hist->GetNbinsX()+1; ++i_bin) {
+	  for (int j_bin = first_j_bin; j_bin <= last_j_bin; ++j_bin) {
+	    double x = _hist->GetXaxis()->GetBinCenter(i_bin);
+	    double y = _hist->GetYaxis()->GetBinCenter(j_bin);
+	    if (all_edges.size() == 1) {
+	      new_hist->Fill(x, _hist->GetBinContent(i_bin));
+	    }
+	    else {
+	      new_hist->Fill(x, y, _hist->GetBinContent(i_bin, j_bin));
+	    }
+	  }
+	}
+	new_hist->SetName(_hist->GetName());
+	_hist.reset(new_hist);
+      }
+    }
+
+    // Evaluates the PDF on a small grid over the observables and checks that it and its normalisation are finite.
+    // A PDF that is zero at every grid point only gets a warning, since a narrow peak (e.g. cemLO) can fall between them
+    void probePdf(RooAbsPdf* pdf, const RooArgList& vars) const {
+      RooArgSet norm_set(vars);
+      double norm = pdf->getNorm(&norm_set);
+      if (!std::isfinite(norm) || norm <= 0) {
+	throw cet::exception("Analysis::probePdf()") << _anaConf.name() << ": PDF \"" << pdf->GetName() << "\" has normalisation " << norm;
+      }
+
+      const int n_grid = vars.getSize() > 2 ? 3 : 5;
+      std::vector<double> saved_vals;
+      size_t n_points = 1;
+      for (int i_var = 0; i_var < vars.getSize(); ++i_var) {
+	saved_vals.push_back(static_cast<RooRealVar*>(vars.at(i_var))->getVal());
+	n_points *= n_grid;
+      }
+      bool any_positive = false;
+      for (size_t i_point = 0; i_point < n_points; ++i_point) {
+	std::stringstream point;
+	size_t index = i_point;
+	for (int i_var = 0; i_var < vars.getSize(); ++i_var) {
+	  RooRealVar* var = static_cast<RooRealVar*>(vars.at(i_var));
+	  var->setVal(var->getMin() + (index % n_grid + 0.5) * (var->getMax() - var->getMin()) / n_grid);
+	  point << (i_var > 0 ? ", " : "") << var->GetName() << " = " << var->getVal();
+	  index /= n_grid;
+	}
+	double val = pdf->getVal(&norm_set);
+	if (!std::isfinite(val) || val < 0) {
+	  throw cet::exception("Analysis::probePdf()") << _anaConf.name() << ": PDF \"" << pdf->GetName() << "\" is " << val << " at " << point.str();
+	}
+	any_positive = any_positive || val > 0;
+      }
+      for (int i_var = 0; i_var < vars.getSize(); ++i_var) {
+	static_cast<RooRealVar*>(vars.at(i_var))->setVal(saved_vals[i_var]);
+      }
+      if (!any_positive) {
+	std::cout << _anaConf.name() << ": warning: PDF \"" << pdf->GetName() << "\" is zero at every point of the probe grid (" << n_grid << " points along each observable)" << std::endl;
+      }
+    }
+
+    // Checks everything that would otherwise only go wrong after the data have been filled:
+    //  - every component PDF and the model evaluate to something finite on a small grid, with a finite normalisation
+    //  - the efficiency corrections and smeared fractions that unfold() needs can be calculated (only if full, since
+    //    they are integrals over the whole model and unfold() calculates them again anyway)
+    //  - every calculation can be made from the unfolded results and every systematic's parameters exist
+    //  - the observable leaves and the cuts compile for this tree (if there is one)
+    // Throws on the first problem and then prints an estimate of the cost of the analysis
+    void probe(TTree* tree = 0, bool full = false) {
+      RooArgList vars;
+      for (const auto& i_obs : _observables) {
+	vars.add(*_ws->var(i_obs.getName().c_str()));
+      }
+
+      std::vector<std::string> pdf_names;
+      for (const auto& i_comp : _components) {
+	for (const auto& i_pdf_name : i_comp.getPdfNames(_observables)) {
+	  pdf_names.push_back(i_pdf_name);
+	}
+      }
+      if (hasCategories()) {
+	for (const auto& i_cat_cfg : _categories) {
+	  pdf_names.push_back(i_cat_cfg.model().name());
+	}
+      }
+      else {
+	pdf_names.push_back(_anaConf.model().name());
+      }
+      for (const auto& i_pdf_name : pdf_names) {
+	RooAbsPdf* pdf = _ws->pdf(i_pdf_name.c_str());
+	if (!pdf) {
+	  throw cet::exception("Analysis::probe()") << _anaConf.name() << ": PDF \"" << i_pdf_name << "\" is not in the RooWorkspace";
+	}
+	RooArgList pdf_vars;
+	for (int i_var = 0; i_var < vars.getSize(); ++i_var) {
+	  if (pdf->dependsOn(*vars.at(i_var))) {
+	    pdf_vars.add(*vars.at(i_var));
+	  }
+	}
+	probePdf(pdf, pdf_vars);
+      }
+
+      // The names that unfold() will create, with dummy values, so that we can check the calculations
+      std::vector< std::pair<std::string, double> > unfolded;
+      if (_anaConf.unfold()) {
+	if (hasCategories()) {
+	  throw cet::exception("Analysis::probe()") << "Unfolding is not supported for a simultaneous fit";
+	}
+	RooAddPdf* full_model = dynamic_cast<RooAddPdf*>(_ws->pdf(_anaConf.model().name().c_str()));
+	if (!full_model || full_model->coefList().getSize() < static_cast<int>(_components.size())) {
+	  throw cet::exception("Analysis::probe()") << _anaConf.name() << ": unfolding needs the model to be a SUM of a yield for each component";
+	}
+	for (size_t i_comp = 0; i_comp < _components.size(); ++i_comp) {
+	  if (full) {
+	    double eff_corr = _components[i_comp].getEffCorrection(_observables, _ws.get());
+	    double frac_smeared = _components[i_comp].getFracSmeared(_observables, _ws.get());
+	    if (!std::isfinite(eff_corr) || !std::isfinite(frac_smeared)) {
+	      throw cet::exception("Analysis::probe()") << _anaConf.name() << ": component " << _components[i_comp].getName() << " has efficiency correction " << eff_corr << " and smeared fraction " << frac_smeared;
+	    }
+	  }
+	  unfolded.push_back(std::make_pair(std::string(full_model->coefList().at(i_comp)->GetName()) + "Eff", 1.0));
+	  unfolded.push_back(std::make_pair(_components[i_comp].getName() + "FracSmeared", 0.0));
+	}
+      }
+
+      if (!_anaConf.calculations().empty()) {
+	RooWorkspace scratch(*_ws); // so that nothing is left behind in our workspace
+	for (const auto& i_unfolded : unfolded) {
+	  if (!scratch.var(i_unfolded.first.c_str())) {
+	    scratch.import(RooRealVar(i_unfolded.first.c_str(), "", i_unfolded.second));
+	  }
+	}
+	for (const auto& i_calc : _anaConf.calculations()) {
+	  if (!scratch.factory(i_calc.c_str()) || !scratch.arg(getCalculationName(i_calc).c_str())) {
+	    throw cet::exception("Analysis::probe()") << _anaConf.name() << ": calculation \"" << i_calc << "\" failed (are all the names it uses defined before it?)";
+	  }
+	}
+      }
+
+      std::vector<SystematicConfig> syst_cfgs;
+      size_t n_variations = 0;
+      if (_anaConf.systematics(syst_cfgs)) {
+	n_variations = getVariations(syst_cfgs).size();
+      }
+      std::string signal_name;
+      if (_anaConf.signalYield(signal_name) && !_ws->var(signal_name.c_str())) {
+	throw cet::exception("Analysis::probe()") << _anaConf.name() << ": signal yield \"" << signal_name << "\" is not in the RooWorkspace";
+      }
+
+      if (tree) {
+	TreeScan scan(tree);
+	for (const auto& i_obs : _observables) {
+	  scan.addExpression(TreeSkim::column(tree, i_obs.getLeaf()));
+	}
+	for (const auto& i_cut_cfg : _anaConf.cuts()) {
+	  scan.addCut(cutcmd(std::vector<CutConfig>{i_cut_cfg}, tree).GetTitle());
+	}
+	for (const auto& i_cat_cfg : _categories) {
+	  scan.addCut(cutcmd(i_cat_cfg.cuts(), tree).GetTitle());
+	}
+      }
+
+      // Cost estimate
+      size_t n_bins = 1;
+      for (int i_var = 0; i_var < vars.getSize(); ++i_var) {
+	n_bins *= static_cast<RooRealVar*>(vars.at(i_var))->getBins();
+      }
+      BootstrapConfig boot_cfg;
+      size_t n_replicas = _anaConf.bootstrap(boot_cfg) ? boot_cfg.nReplicas() : 0;
+      size_t n_windows = getFitWindows().size();
+      std::cout << _anaConf.name() << ": " << _observables.size() << " observables, " << n_bins << " bins" << (isSparse() ? " (sparse)" : "")
+		<< ", " << _components.size() << " components, " << std::max<size_t>(_categories.size(), 1) << " categories, "
+		<< 1 + n_variations + n_replicas + n_windows << " fits (" << n_variations << " systematic variations, " << n_replicas << " bootstrap replicas, " << n_windows << " fit windows)" << std::endl;
+      RooArgList all_pdfs(_ws->allPdfs());
+      bool has_conv = false;
+      for (int i_pdf = 0; i_pdf < all_pdfs.getSize(); ++i_pdf) {
+	RooFastFFTConvPdf* conv = dynamic_cast<RooFastFFTConvPdf*>(all_pdfs.at(i_pdf));
+	RooFFTConvPdf* fconv = dynamic_cast<RooFFTConvPdf*>(all_pdfs.at(i_pdf));
+	if (!conv && !fconv) {
+	  continue;
+	}
+	for (int i_var = 0; i_var < vars.getSize(); ++i_var) {
+	  RooRealVar* var = static_cast<RooRealVar*>(vars.at(i_var));
+	  if (conv && conv->dependsOn(*var)) {
+	    std::cout << "  FFT " << conv->GetName() << ": " << conv->getNBins() << " bins in " << var->GetName() << " with buffer fraction " << conv->bufferFraction()
+		      << " (" << conv->getGridSize() << " points, " << conv->getNThreads() << " threads)" << std::endl;
+	    has_conv = true;
+	  }
+	  else if (fconv && fconv->dependsOn(*var)) {
+	    std::cout << "  FFT " << fconv->GetName() << " (FCONV): " << var->getBinning("cache", kFALSE).numBins() << " bins in " << var->GetName() << " with buffer fraction " << fconv->bufferFraction() << std::endl;
+	  }
+	}
+      }
+      if (has_conv) {
+	const FFTSpectrumCache& spectra = FFTSpectrumCache::instance();
+	std::cout << "  FFT responses: " << spectra.nMisses() << " transformed, " << spectra.nHits() << " shared (so far in this process)" << std::endl;
+      }
+      for (const auto& i_pdf_name : pdf_names) {
+	const RooNumIntConfig* int_cfg = _ws->pdf(i_pdf_name.c_str())->getIntegratorConfig();
+	std::cout << "  " << i_pdf_name << ": integrator " << int_cfg->method1D().getLabel() << std::endl;
+      }
+    }
+
     void fillData(TTree* tree) {
+      setupCutFlow();
+      if (hasCategories()) {
+	fillCategoryData(tree);
+	printCutFlow();
+	return;
+      }
+      if (isSparse()) {
+	fillSparseData(tree);
+	printCutFlow();
+	return;
+      }
 
       RooArgSet vars;
       RooRealVar* x_var = 0;
@@ -114,11 +709,11 @@ namespace roofitter {
 	vars.add(*var);
 
 	if (x_leaf.empty()) {
-	  x_leaf = i_obs_conf.leaf();
+	  x_leaf = TreeSkim::column(tree, i_obs_conf.leaf());
 	  x_var = var;
 	}
 	else if (y_leaf.empty()) {
-	  y_leaf = i_obs_conf.leaf();
+	  y_leaf = TreeSkim::column(tree, i_obs_conf.leaf());
 	  y_var = var;
 	}
       }
@@ -126,11 +721,11 @@ namespace roofitter {
       std::string histname = "h_" + _anaConf.name();
       std::string draw = "";
       if (vars.getSize()==1) {
-	_hist = x_var->createHistogram(histname.c_str());
+	_hist.reset(x_var->createHistogram(histname.c_str()));
 	draw = x_leaf;
       }
       else if (vars.getSize()==2) {
-	_hist = x_var->createHistogram(histname.c_str(), RooFit::YVar(*y_var));
+	_hist.reset(x_var->createHistogram(histname.c_str(), RooFit::YVar(*y_var)));
 	draw = y_leaf+":"+x_leaf;
       }
       else {
@@ -139,19 +734,373 @@ namespace roofitter {
       draw += ">>";
       draw += _hist->GetName();
 
-      tree->Draw(draw.c_str(), cutcmd(), "goff");
+      if (_cutFlow) {
+	// TTree::Draw can only apply the combined cut, so scan the tree ourselves to count each cut in the same pass
+	TreeScan scan(tree);
+	scan.addExpression(x_leaf);
+	if (y_var) {
+	  scan.addExpression(y_leaf);
+	}
+	std::vector<size_t> i_cuts = addCuts(scan, tree);
+	scan.run([&](const std::vector<double>& values, const std::vector<double>& cut_values) {
+	    double weight = cutWeight(i_cuts, cut_values, values);
+	    if (weight != 0) {
+	      if (y_var) {
+		static_cast<TH2*>(_hist.get())->Fill(values[0], values[1], weight);
+	      }
+	      else {
+		_hist->Fill(values[0], weight);
+	      }
+	    }
+	  });
+	printCutFlow();
+      }
+      else {
+	tree->Draw(draw.c_str(), cutcmd(tree), "goff");
+      }
+      _hist->SetDirectory(0); // TTree::Draw needed to find it in the current directory but we delete it
+
+      if (hasAdaptiveBinning()) {
+	adaptBinning();
+      }
+
+      std::unique_ptr<RooAbsData> data(histData("data"));
+      _ws->import(*data);
+    }
+
+    // An empty histogram with the binning of the first one or two observables (that isn't in any directory)
+    static TH1* createHist(const std::string& histname, const std::vector<RooRealVar*>& obs_vars) {
+      TH1* hist = 0;
+      if (obs_vars.size() == 1) {
+	hist = obs_vars[0]->createHistogram(histname.c_str());
+      }
+      else {
+	hist = obs_vars[0]->createHistogram(histname.c_str(), RooFit::YVar(*obs_vars[1]));
+      }
+      hist->SetDirectory(0);
+      return hist;
+    }
+
+    // The filled histograms as data to fit: a RooDataHist (indexed by the category if there are categories)
+    // or, for sparse storage, a weighted RooDataSet with one entry (at the bin centre) for each populated bin
+    RooAbsData* histData(const std::string& name) const {
+      RooArgList vars;
+      std::vector<RooRealVar*> obs_vars;
+      std::vector<int> n_bins;
+      for (const auto& i_obs : _observables) {
+	RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	vars.add(*var);
+	obs_vars.push_back(var);
+	n_bins.push_back(var->getBins());
+      }
+
+      if (hasCategories()) {
+	std::map<std::string, TH1*> cat_hists;
+	for (const auto& i_cat_hist : _catHists) {
+	  cat_hists[i_cat_hist.first] = i_cat_hist.second.get();
+	}
+	return new RooDataHist(name.c_str(), name.c_str(), vars, *_ws->cat("category"), cat_hists);
+      }
+      if (!_sparseHist) {
+	return new RooDataHist(name.c_str(), name.c_str(), vars, RooFit::Import(*_hist));
+      }
+
+      RooRealVar weight("weight", "weight", 0, RooNumber::infinity());
+      RooArgSet data_vars(vars);
+      data_vars.add(weight);
+      RooDataSet* data = new RooDataSet(name.c_str(), name.c_str(), data_vars, RooFit::WeightVar(weight));
+
+      RooArgSet row(vars);
+      std::vector<int> coords(obs_vars.size());
+      for (Long64_t i_bin = 0; i_bin < _sparseHist->GetNbins(); ++i_bin) {
+	double content = _sparseHist->GetBinContent(i_bin, &coords[0]);
+	if (content == 0) {
+	  continue;
+	}
+	bool in_range = true;
+	for (size_t i_dim = 0; i_dim < obs_vars.size(); ++i_dim) {
+	  if (coords[i_dim] < 1 || coords[i_dim] > n_bins[i_dim]) { // underflow or overflow
+	    in_range = false;
+	    break;
+	  }
+	  obs_vars[i_dim]->setVal(_sparseHist->GetAxis(i_dim)->GetBinCenter(coords[i_dim]));
+	}
+	if (in_range) {
+	  data->add(row, content);
+	}
+      }
+      std::cout << _anaConf.name() << ": " << data->numEntries() << " populated bins stored" << std::endl;
+      return data;
+    }
+
+    // Fills one histogram per category with a single pass over the tree
+    // and then creates a RooDataHist indexed by the category
+    void fillCategoryData(TTree* tree) {
+      if (isSparse() || hasAdaptiveBinning()) {
+	throw cet::exception("Analysis::fillCategoryData()") << "Categories can only be used with one or two observables, without sparse storage or adaptive binning";
+      }
+
+      std::vector<RooRealVar*> obs_vars;
+      TreeScan scan(tree);
+      for (const auto& i_obs : _observables) {
+	RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	obs_vars.push_back(var);
+	scan.addExpression(TreeSkim::column(tree, i_obs.getLeaf()));
+      }
+      std::vector<size_t> i_ana_cuts = addCuts(scan, tree);
+
+      std::vector<size_t> cat_cuts;
+      std::vector<TH1*> cat_hists;
+      for (const auto& i_cat_cfg : _categories) {
+	cat_cuts.push_back(scan.addCut(cutcmd(i_cat_cfg.cuts(), tree).GetTitle()));
+
+	TH1* hist = createHist("h_" + _anaConf.name() + "_" + i_cat_cfg.name(), obs_vars);
+	cat_hists.push_back(hist);
+	_catHists[i_cat_cfg.name()].reset(hist);
+      }
+
+      scan.run([&](const std::vector<double>& values, const std::vector<double>& cut_values) {
+	  double weight = cutWeight(i_ana_cuts, cut_values, values);
+	  if (weight == 0) {
+	    return;
+	  }
+	  for (size_t i_cat = 0; i_cat < cat_hists.size(); ++i_cat) {
+	    if (cut_values[cat_cuts[i_cat]] != 0) {
+	      if (obs_vars.size() == 1) {
+		cat_hists[i_cat]->Fill(values[0], weight);
+	      }
+	      else {
+		static_cast<TH2*>(cat_hists[i_cat])->Fill(values[0], values[1], weight);
+	      }
+	    }
+	  }
+	});
+
+      for (const auto& i_cat_hist : _catHists) {
+	std::cout << _anaConf.name() << ": category " << i_cat_hist.first << " has " << i_cat_hist.second->GetEntries() << " entries" << std::endl;
+      }
+      std::unique_ptr<RooAbsData> data(histData("data"));
+      _ws->import(*data);
+    }
+
+    // Fills a THnSparse with one pass over the tree and then creates a weighted RooDataSet
+    // with one entry (at the bin centre) for each populated bin
+    void fillSparseData(TTree* tree) {
+
+      std::vector<RooRealVar*> obs_vars;
+      std::vector<int> n_bins;
+      std::vector<double> mins;
+      std::vector<double> maxs;
+      TreeScan scan(tree);
+      for (const auto& i_obs : _observables) {
+	RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	obs_vars.push_back(var);
+	n_bins.push_back(var->getBins());
+	mins.push_back(var->getMin());
+	maxs.push_back(var->getMax());
+	scan.addExpression(TreeSkim::column(tree, i_obs.getLeaf()));
+      }
+      std::vector<size_t> i_cuts = addCuts(scan, tree);
+
+      std::string histname = "h_" + _anaConf.name();
+      _sparseHist.reset(new THnSparseD(histname.c_str(), histname.c_str(), obs_vars.size(), &n_bins[0], &mins[0], &maxs[0]));
+      scan.run([&](const std::vector<double>& values, const std::vector<double>& cut_values) {
+	  double weight = cutWeight(i_cuts, cut_values, values);
+	  if (weight != 0) {
+	    _sparseHist->Fill(&values[0], weight);
+	  }
+	});
 
-      _ws->import(*(new RooDataHist("data", "data", vars, RooFit::Import(*_hist))));
+      if (hasAdaptiveBinning()) {
+	adaptBinning();
+      }
+
+      std::unique_ptr<RooAbsData> data(histData("data"));
+      _ws->import(*data);
     }
 
 
-    void fit() {
-      RooAbsData* data = _ws->data("data");
+    // Calls fill(bin numbers, expected events) for every bin of the observables (starting from 1 like ROOT's histograms).
+    // The expected events are the PDF at the bin centre (as RooFit evaluates binned data) times the bin volume, and each
+    // yield is the number of events in the fit range (as in projectComponents())
+    template <typename Fill>
+    void forEachExpectedBin(RooAbsPdf& pdf, const std::vector<RooRealVar*>& obs_vars, Fill fill) const {
+      RooArgSet vars;
+      for (const auto& i_var : obs_vars) {
+	vars.add(*i_var);
+      }
+
+      std::vector<RooAbsPdf*> pdfs;
+      std::vector<double> scales;
+      std::vector<double> yields;
+      if (RooAddPdf* add_pdf = dynamic_cast<RooAddPdf*>(&pdf)) {
+	for (int i_comp = 0; i_comp < add_pdf->pdfList().getSize(); ++i_comp) {
+	  pdfs.push_back(static_cast<RooAbsPdf*>(add_pdf->pdfList().at(i_comp)));
+	  yields.push_back(static_cast<RooAbsReal*>(add_pdf->coefList().at(i_comp))->getVal());
+	}
+      }
+      else {
+	pdfs.push_back(&pdf);
+	yields.push_back(pdf.expectedEvents(vars));
+      }
+      for (size_t i_comp = 0; i_comp < pdfs.size(); ++i_comp) {
+	std::unique_ptr<RooAbsReal> fit_integral(pdfs[i_comp]->createIntegral(vars, RooFit::NormSet(vars), RooFit::Range("fit")));
+	double fit_fraction = fit_integral->getVal();
+	scales.push_back(fit_fraction > 0 ? yields[i_comp] / fit_fraction : 0);
+      }
+
+      std::vector<int> bins(obs_vars.size(), 1);
+      while (true) {
+	double volume = 1;
+	for (size_t i_dim = 0; i_dim < obs_vars.size(); ++i_dim) {
+	  const RooAbsBinning& binning = obs_vars[i_dim]->getBinning();
+	  obs_vars[i_dim]->setVal(binning.binCenter(bins[i_dim]-1));
+	  volume *= binning.binWidth(bins[i_dim]-1);
+	}
+	double content = 0;
+	for (size_t i_comp = 0; i_comp < pdfs.size(); ++i_comp) {
+	  content += scales[i_comp] * pdfs[i_comp]->getVal(&vars) * volume;
+	}
+	fill(bins, content);
+
+	// move on to the next bin
+	size_t i_dim = 0;
+	while (i_dim < bins.size() && ++bins[i_dim] > obs_vars[i_dim]->getBins()) {
+	  bins[i_dim] = 1;
+	  ++i_dim;
+	}
+	if (i_dim == bins.size()) {
+	  break;
+	}
+      }
+    }
+
+    // Replaces the histograms with the number of events that the model (with its current parameters) expects in each bin
+    void fillExpectedHists() {
+      std::vector<RooRealVar*> obs_vars;
+      std::vector<int> n_bins;
+      std::vector<double> mins;
+      std::vector<double> maxs;
+      for (const auto& i_obs : _observables) {
+	RooRealVar* var = _ws->var(i_obs.getName().c_str());
+	obs_vars.push_back(var);
+	n_bins.push_back(var->getBins());
+	mins.push_back(var->getMin());
+	maxs.push_back(var->getMax());
+      }
+      _hist.reset();
+      _sparseHist.reset();
+      _catHists.clear();
+
+      std::string histname = "h_" + _anaConf.name();
+      RooAbsPdf* model = _ws->pdf(_anaConf.model().name().c_str());
+      if (hasCategories()) {
+	RooSimultaneous* sim_model = dynamic_cast<RooSimultaneous*>(model);
+	if (!sim_model) {
+	  throw cet::exception("Analysis::fillExpectedHists()") << "Model \"" << _anaConf.model().name() << "\" should be a SIMUL of the category models";
+	}
+	for (const auto& i_cat_cfg : _categories) {
+	  TH1* hist = createHist(histname + "_" + i_cat_cfg.name(), obs_vars);
+	  forEachExpectedBin(*sim_model->getPdf(i_cat_cfg.name().c_str()), obs_vars, [hist](const std::vector<int>& bins, double content) {
+	      hist->SetBinContent(hist->GetBin(bins[0], bins.size() > 1 ? bins[1] : 0), content);
+	    });
+	  _catHists[i_cat_cfg.name()].reset(hist);
+	}
+      }
+      else if (isSparse()) {
+	_sparseHist.reset(new THnSparseD(histname.c_str(), histname.c_str(), obs_vars.size(), &n_bins[0], &mins[0], &maxs[0]));
+	for (size_t i_dim = 0; i_dim < obs_vars.size(); ++i_dim) { // the binning may already have been adapted
+	  std::vector<double> edges = _observables.at(i_dim).getBinEdges(_ws.get());
+	  _sparseHist->GetAxis(i_dim)->Set(n_bins[i_dim], &edges[0]);
+	}
+	forEachExpectedBin(*model, obs_vars, [this](const std::vector<int>& bins, double content) {
+	    if (content > 0) {
+	      _sparseHist->SetBinContent(&bins[0], content);
+	    }
+	  });
+      }
+      else {
+	_hist.reset(createHist(histname, obs_vars));
+	forEachExpectedBin(*model, obs_vars, [this](const std::vector<int>& bins, double content) {
+	    _hist->SetBinContent(_hist->GetBin(bins[0], bins.size() > 1 ? bins[1] : 0), content);
+	  });
+      }
+    }
+
+    // Fills the Asimov data instead of reading the tree: every bin has the number of events that the model expects with
+    // its configured parameters, so the fit returns them and its errors are the expected errors (see runSensitivity())
+    void fillAsimovData() {
+      if (hasCategories() && (isSparse() || hasAdaptiveBinning())) {
+	throw cet::exception("Analysis::fillAsimovData()") << "Categories can only be used with one or two observables, without sparse storage or adaptive binning";
+      }
+      fillExpectedHists();
+      if (hasAdaptiveBinning()) {
+	adaptBinning();
+      }
+      std::unique_ptr<RooAbsData> data(histData("data"));
+      _ws->import(*data);
+      std::cout << _anaConf.name() << ": filled Asimov data with " << data->sumEntries() << " expected events" << std::endl;
+    }
+
+
+    // Fits the data in the workspace (or a replica of it)
+    void fit(RooAbsData* data = 0) {
+      if (!data) {
+	data = _ws->data("data");
+      }
       RooAbsPdf* model = _ws->pdf(_anaConf.model().name().c_str());
       if (!model) {
 	throw cet::exception("Analysis::fit()") << "Can't find model \"" << _anaConf.model().name() << "\" in RooWorkspace";
       }
-      _fitResult = model->fitTo(*data, RooFit::Save(), RooFit::Range("fit"), RooFit::Extended(true));
+      RooAddPdf* add_model = dynamic_cast<RooAddPdf*>(model);
+      RooSimultaneous* sim_model = dynamic_cast<RooSimultaneous*>(model);
+      if (_anaConf.fastNLL() && !add_model && !sim_model) {
+	throw cet::exception("Analysis::fit()") << "fastNLL needs model \"" << _anaConf.model().name() << "\" to be a RooAddPdf (or a RooSimultaneous of them)";
+      }
+
+      // Use our own likelihood if asked for or if the model is just fixed templates
+      // (RooFit evaluates binned data at the bin centres which is not good enough for merged bins)
+      if (!add_model && hasAdaptiveBinning()) {
+	std::cout << _anaConf.name() << ": warning: model \"" << _anaConf.model().name() << "\" is not a RooAddPdf so it is fitted with fitTo, which evaluates it at the centres of the merged bins instead of integrating over them" << std::endl;
+      }
+      std::unique_ptr<RooBinnedPoissonNLL> nll;
+      bool template_fit = false;
+      if (add_model) {
+	RooArgSet vars;
+	for (const auto& i_obs : _observables) {
+	  vars.add(*_ws->var(i_obs.getName().c_str()));
+	}
+	template_fit = _anaConf.templateFit() && RooBinnedPoissonNLL::hasFixedShapes(*add_model, vars);
+	if (_anaConf.fastNLL() || template_fit || hasAdaptiveBinning()) {
+	  nll.reset(new RooBinnedPoissonNLL("nll", "", *add_model, *data, vars, "fit"));
+	}
+      }
+
+      if (nll) {
+	if (template_fit) {
+	  solveTemplateYields(*nll);
+	}
+	RooMinimizer minimizer(*nll);
+	minimizer.migrad();
+	minimizer.hesse();
+	_fitResult.reset(minimizer.save());
+	std::cout << _anaConf.name() << ": " << nll->nEvaluations() << " NLL evaluations over " << nll->nBins() << " populated bins" << std::endl;
+      }
+      else if (sim_model && _anaConf.fastNLL()) {
+	_fitResult.reset(fitSimultaneousNLL(*sim_model, *data));
+      }
+      else if (sim_model) {
+	// one process per category (up to the number of cores) each evaluating whole category terms
+	int n_cpu = std::min<int>(_categories.size(), std::max(1u, std::thread::hardware_concurrency()));
+	_fitResult.reset(model->fitTo(*data, RooFit::Save(), RooFit::Range("fit"), RooFit::Extended(true), RooFit::NumCPU(n_cpu, 2)));
+      }
+      else if (isSparse()) {
+	// the weights are the bin counts so the errors are Poisson errors and not sum-of-weights-squared
+	_fitResult.reset(model->fitTo(*data, RooFit::Save(), RooFit::Range("fit"), RooFit::Extended(true), RooFit::SumW2Error(false)));
+      }
+      else {
+	_fitResult.reset(model->fitTo(*data, RooFit::Save(), RooFit::Range("fit"), RooFit::Extended(true)));
+      }
       _fitResult->printValue(std::cout);
 
       int status = _fitResult->status();
@@ -162,8 +1111,74 @@ namespace roofitter {
       }
     }
 
+    // Minimises the sum of a RooBinnedPoissonNLL for each category. If there is more than one core then each category's
+    // NLL is evaluated in its own forked process (see RooForkedSum), otherwise they are added up in this one
+    RooFitResult* fitSimultaneousNLL(RooSimultaneous& sim_model, RooAbsData& data) {
+      RooArgSet vars;
+      for (const auto& i_obs : _observables) {
+	vars.add(*_ws->var(i_obs.getName().c_str()));
+      }
+
+      std::vector< std::unique_ptr<RooBinnedPoissonNLL> > cat_nlls;
+      RooArgList nll_list;
+      for (const auto& i_cat_cfg : _categories) {
+	std::string cat_name = i_cat_cfg.name();
+	RooAddPdf* cat_model = dynamic_cast<RooAddPdf*>(sim_model.getPdf(cat_name.c_str()));
+	if (!cat_model) {
+	  throw cet::exception("Analysis::fitSimultaneousNLL()") << "fastNLL needs the model for category \"" << cat_name << "\" to be a RooAddPdf";
+	}
+	std::string cat_cut = "category==category::" + cat_name;
+	std::unique_ptr<RooAbsData> cat_data(data.reduce(RooFit::Cut(cat_cut.c_str())));
+	std::string nll_name = "nll_" + cat_name;
+	cat_nlls.push_back(std::unique_ptr<RooBinnedPoissonNLL>(new RooBinnedPoissonNLL(nll_name.c_str(), "", *cat_model, *cat_data, vars, "fit")));
+	nll_list.add(*cat_nlls.back());
+      }
+
+      std::unique_ptr<RooAbsReal> nll;
+      if (_categories.size() > 1 && std::thread::hardware_concurrency() > 1) {
+	nll.reset(new RooForkedSum("nll", "", nll_list));
+      }
+      else {
+	nll.reset(new RooAddition("nll", "", nll_list));
+      }
+      RooMinimizer minimizer(*nll);
+      minimizer.setErrorLevel(0.5);
+      minimizer.migrad();
+      minimizer.hesse();
+      return minimizer.save();
+    }
+
+    // All the shapes are fixed so the NLL is a convex function of the yields alone.
+    // Solve for them directly on the binned templates so that Minuit only has to
+    // confirm the minimum and calculate the errors
+    void solveTemplateYields(const RooBinnedPoissonNLL& nll) {
+      const RooArgList& coefs = nll.coefList();
+      std::vector<RooRealVar*> yield_vars;
+      std::vector<double> yields, mins, maxs;
+      for (int i_coef = 0; i_coef < coefs.getSize(); ++i_coef) {
+	RooRealVar* yield_var = dynamic_cast<RooRealVar*>(coefs.at(i_coef));
+	if (!yield_var || yield_var->isConstant()) { // yields that are functions of other parameters are left to Minuit
+	  return;
+	}
+	yield_vars.push_back(yield_var);
+	yields.push_back(yield_var->getVal());
+	mins.push_back(yield_var->getMin());
+	maxs.push_back(yield_var->getMax());
+      }
+
+      TemplateFit template_fit(nll.kernel());
+      bool converged = template_fit.solve(yields, mins, maxs);
+      std::cout << _anaConf.name() << ": template fit of " << yields.size() << " fixed-shape components " << (converged ? "converged" : "did not converge") << " after " << template_fit.nIterations() << " iterations" << std::endl;
+      for (size_t i_yield = 0; i_yield < yield_vars.size(); ++i_yield) {
+	yield_vars[i_yield]->setVal(yields[i_yield]);
+      }
+    }
+
     void unfold() {
       if (_anaConf.unfold()) {
+	if (hasCategories()) {
+	  throw cet::exception("Analysis::unfold()") << "Unfolding is not supported for a simultaneous fit";
+	}
 	// Unfold efficiency
 	// should have an efficiency function and yields of each component as function of the observable
 	RooAddPdf* full_model = (RooAddPdf*) _ws->pdf(_anaConf.model().name().c_str());
@@ -178,29 +1193,40 @@ namespace roofitter {
 	  double i_comp_yield_val = i_comp_yield->getVal();
 	  double i_comp_yield_err = i_comp_yield->getPropagatedError(*_fitResult);
 	  
-	  double effCorr = i_comp.getEffCorrection(_observables.at(0), _ws); //TODO: handle more than one dimension
+	  double effCorr = i_comp.getEffCorrection(_observables, _ws.get());
 	  double i_comp_final_yield_val = i_comp_yield_val * effCorr;
 	  double i_comp_final_yield_err = (i_comp_yield_err / i_comp_yield_val) * i_comp_final_yield_val;
 	  
 	  std::string new_yield_name = i_comp_yield->GetName();
 	  new_yield_name += "Eff";
-	  RooRealVar* i_comp_final_yield = new RooRealVar(new_yield_name.c_str(), "", i_comp_final_yield_val);
+	  RooRealVar* i_comp_final_yield = setResult(new_yield_name, i_comp_final_yield_val);
 	  i_comp_final_yield->setError(i_comp_final_yield_err);
-	  _ws->import(*i_comp_final_yield);
+	  _unfoldedYields[new_yield_name] = std::make_pair(std::string(i_comp_yield->GetName()), effCorr);
 
 	  // Calculate the fraction of the tru spectrum that has smeared out
 
-	  double frac_smeared_away = i_comp.getFracSmeared(_observables.at(0), _ws); // TODO: handle more than one dimension
+	  double frac_smeared_away = i_comp.getFracSmeared(_observables, _ws.get());
 	  std::string frac_smeared_name = i_comp.getName() + "FracSmeared";
-	  RooRealVar* frac_smeared = new RooRealVar(frac_smeared_name.c_str(), "", frac_smeared_away);
+	  setResult(frac_smeared_name, frac_smeared_away);
 	  //	  unfold_eff_yield->setError(final_yield_err);
-	  _ws->import(*frac_smeared);
 	  //	}
 	  ++i_element;
 	}
       }
     }
 
+    // Puts an unfolded result into the workspace (or updates it if it is already there from an earlier fit)
+    RooRealVar* setResult(const std::string& name, double value) {
+      RooRealVar* result = _ws->var(name.c_str());
+      if (!result) {
+	_ws->import(RooRealVar(name.c_str(), "", value));
+	result = _ws->var(name.c_str());
+	_unfoldedNames.push_back(name);
+      }
+      result->setVal(value);
+      return result;
+    }
+
     void calculate() {
       std::stringstream factory_cmd;
       for (const auto& i_calc : _anaConf.calculations()) {
@@ -210,15 +1236,692 @@ namespace roofitter {
       }
     }
 
+    // The name of the parameter or function that a calculation creates
+    // (e.g. "f_cap[0.609]" -> "f_cap", "EXPR::Rmue('NCeEff / NCap', NCeEff, NCap)" -> "Rmue")
+    static std::string getCalculationName(const std::string& calc) {
+      size_t i_start = calc.find("::");
+      if (i_start != std::string::npos) {
+	i_start += 2;
+	return calc.substr(i_start, calc.find('(', i_start) - i_start);
+      }
+      return calc.substr(0, calc.find('['));
+    }
+
+    // The floating parameters, the unfolded results and the calculations
+    std::vector<std::string> getResultNames() const {
+      std::vector<std::string> result_names;
+      const RooArgList& float_pars = _fitResult->floatParsFinal();
+      for (int i_par = 0; i_par < float_pars.getSize(); ++i_par) {
+	result_names.push_back(float_pars.at(i_par)->GetName());
+      }
+      result_names.insert(result_names.end(), _unfoldedNames.begin(), _unfoldedNames.end());
+      for (const auto& i_calc : _anaConf.calculations()) {
+	std::string calc_name = getCalculationName(i_calc);
+	if (_ws->function(calc_name.c_str())) {
+	  result_names.push_back(calc_name);
+	}
+      }
+      return result_names;
+    }
+
+    std::vector<double> getResultValues(const std::vector<std::string>& result_names) const {
+      std::vector<double> values;
+      for (const auto& i_name : result_names) {
+	values.push_back(_ws->function(i_name.c_str())->getVal());
+      }
+      return values;
+    }
+
+    std::vector<Variation> getVariations(const std::vector<SystematicConfig>& syst_cfgs) const {
+      std::vector<Variation> variations;
+      for (const auto& i_syst_cfg : syst_cfgs) {
+	std::vector<std::string> params = i_syst_cfg.parameters();
+	for (const auto& i_param : params) {
+	  if (!_ws->var(i_param.c_str())) {
+	    throw cet::exception("Analysis::getVariations()") << "Systematic \"" << i_syst_cfg.name() << "\" varies parameter \"" << i_param << "\" which is not in the RooWorkspace";
+	  }
+	}
+
+	std::vector<double> sigmas;
+	std::vector< std::vector<double> > grid;
+	std::vector< std::vector<double> > sets;
+	if (i_syst_cfg.sigmas(sigmas)) {
+	  if (sigmas.size() != params.size()) {
+	    throw cet::exception("Analysis::getVariations()") << "Systematic \"" << i_syst_cfg.name() << "\" needs one sigma for each parameter";
+	  }
+	  for (size_t i_param = 0; i_param < params.size(); ++i_param) {
+	    double nominal = _ws->var(params[i_param].c_str())->getVal();
+	    variations.push_back(Variation{i_syst_cfg.name() + "_" + params[i_param] + "Up", {{params[i_param], nominal + sigmas[i_param]}}});
+	    variations.push_back(Variation{i_syst_cfg.name() + "_" + params[i_param] + "Down", {{params[i_param], nominal - sigmas[i_param]}}});
+	  }
+	}
+	else if (i_syst_cfg.grid(grid)) {
+	  if (grid.size() != params.size()) {
+	    throw cet::exception("Analysis::getVariations()") << "Systematic \"" << i_syst_cfg.name() << "\" needs a list of values for each parameter";
+	  }
+	  std::vector<size_t> index(params.size(), 0);
+	  for (size_t i_point = 0; ; ++i_point) {
+	    Variation variation{i_syst_cfg.name() + "_" + std::to_string(i_point), {}};
+	    for (size_t i_param = 0; i_param < params.size(); ++i_param) {
+	      variation.values.push_back(std::make_pair(params[i_param], grid[i_param].at(index[i_param])));
+	    }
+	    variations.push_back(variation);
+
+	    // move on to the next combination
+	    size_t i_param = 0;
+	    while (i_param < params.size() && ++index[i_param] == grid[i_param].size()) {
+	      index[i_param] = 0;
+	      ++i_param;
+	    }
+	    if (i_param == params.size()) {
+	      break;
+	    }
+	  }
+	}
+	else if (i_syst_cfg.sets(sets)) {
+	  for (size_t i_set = 0; i_set < sets.size(); ++i_set) {
+	    if (sets[i_set].size() != params.size()) {
+	      throw cet::exception("Analysis::getVariations()") << "Systematic \"" << i_syst_cfg.name() << "\" needs a value for each parameter in every set";
+	    }
+	    Variation variation{i_syst_cfg.name() + "_" + std::to_string(i_set), {}};
+	    for (size_t i_param = 0; i_param < params.size(); ++i_param) {
+	      variation.values.push_back(std::make_pair(params[i_param], sets[i_set][i_param]));
+	    }
+	    variations.push_back(variation);
+	  }
+	}
+	else {
+	  throw cet::exception("Analysis::getVariations()") << "Systematic \"" << i_syst_cfg.name() << "\" needs one of sigmas, grid or sets";
+	}
+      }
+      return variations;
+    }
+
+    // Refits (and unfolds) the already filled data for each variation, n_workers at a time in forked processes,
+    // and fills a summary tree with the results and their shifts from the nominal fit
+    void runSystematics(size_t n_workers) {
+      std::vector<SystematicConfig> syst_cfgs;
+      if (!_anaConf.systematics(syst_cfgs)) {
+	return;
+      }
+      std::vector<Variation> variations = getVariations(syst_cfgs);
+      std::vector<std::string> result_names = getResultNames();
+      std::vector<double> nominal = getResultValues(result_names);
+
+      std::vector< std::vector<double> > results(variations.size());
+      std::vector<bool> succeeded(variations.size(), false);
+      {
+	ForkPool pool(n_workers);
+	for (size_t i_var = 0; i_var < variations.size(); ++i_var) {
+	  pool.submit([this, &variations, &result_names, i_var]() {
+	      for (const auto& i_value : variations[i_var].values) {
+		_ws->var(i_value.first.c_str())->setVal(i_value.second);
+	      }
+	      fit();
+	      unfold();
+	      return getResultValues(result_names);
+	    },
+	    [&results, &succeeded, &result_names, i_var](const std::vector<double>& values, bool ok) {
+	      succeeded[i_var] = ok && values.size() == result_names.size();
+	      results[i_var] = values;
+	    });
+	}
+      }
+
+      // One entry for the nominal fit and then one for each variation
+      std::string variation_name;
+      Bool_t ok;
+      std::vector<double> values(result_names.size());
+      std::vector<double> shifts(result_names.size());
+      _systTree.reset(new TTree("systematics", "Results for each systematic variation"));
+      _systTree->SetDirectory(0);
+      _systTree->Branch("variation", &variation_name);
+      _systTree->Branch("ok", &ok, "ok/O");
+      for (size_t i_result = 0; i_result < result_names.size(); ++i_result) {
+	_systTree->Branch(result_names[i_result].c_str(), &values[i_result], (result_names[i_result] + "/D").c_str());
+	_systTree->Branch((result_names[i_result] + "Shift").c_str(), &shifts[i_result], (result_names[i_result] + "Shift/D").c_str());
+      }
+
+      std::cout << _anaConf.name() << ": systematic shifts" << std::endl;
+      for (size_t i_var = 0; i_var <= variations.size(); ++i_var) {
+	bool is_nominal = (i_var == 0);
+	variation_name = is_nominal ? "nominal" : variations[i_var-1].name;
+	ok = is_nominal || succeeded[i_var-1];
+	std::cout << "  " << variation_name << ":";
+	for (size_t i_result = 0; i_result < result_names.size(); ++i_result) {
+	  values[i_result] = is_nominal ? nominal[i_result] : (ok ? results[i_var-1][i_result] : std::nan(""));
+	  shifts[i_result] = values[i_result] - nominal[i_result];
+	  if (!is_nominal) {
+	    std::cout << " " << result_names[i_result] << " " << std::showpos << shifts[i_result] << std::noshowpos;
+	  }
+	}
+	std::cout << (ok ? "" : " (failed)") << std::endl;
+	_systTree->Fill();
+      }
+    }
+
+    // Every combination of the observables' fitWindows (an observable without any keeps its fit range),
+    // or nothing if no observable has fitWindows
+    std::vector<FitWindow> getFitWindows() const {
+      std::vector< std::vector< std::vector<double> > > obs_windows;
+      bool any_windows = false;
+      for (const auto& i_obs : _observables) {
+	const auto& i_obs_cfg = i_obs.getConf();
+	std::vector< std::vector<double> > windows;
+	if (i_obs_cfg.fitWindows(windows)) {
+	  any_windows = true;
+	  for (const auto& i_window : windows) {
+	    if (i_window.size() != 2 || i_window[0] >= i_window[1] || i_window[0] < i_obs_cfg.min() || i_window[1] > i_obs_cfg.max()) {
+	      throw cet::exception("Analysis::getFitWindows()") << "Each fit window for observable \"" << i_obs.getName() << "\" should be [min, max] inside [" << i_obs_cfg.min() << ", " << i_obs_cfg.max() << "]";
+	    }
+	  }
+	}
+	else {
+	  windows.push_back(std::vector<double>{i_obs_cfg.fitMin(), i_obs_cfg.fitMax()});
+	}
+	obs_windows.push_back(windows);
+      }
+      std::vector<FitWindow> result;
+      if (!any_windows) {
+	return result;
+      }
+
+      std::vector<size_t> index(obs_windows.size(), 0);
+      while (true) {
+	FitWindow window;
+	for (size_t i_obs = 0; i_obs < obs_windows.size(); ++i_obs) {
+	  window.mins.push_back(obs_windows[i_obs][index[i_obs]][0]);
+	  window.maxs.push_back(obs_windows[i_obs][index[i_obs]][1]);
+	}
+	result.push_back(window);
+
+	// move on to the next combination
+	size_t i_obs = 0;
+	while (i_obs < obs_windows.size() && ++index[i_obs] == obs_windows[i_obs].size()) {
+	  index[i_obs] = 0;
+	  ++i_obs;
+	}
+	if (i_obs == obs_windows.size()) {
+	  break;
+	}
+      }
+      return result;
+    }
+
+    // Refits (and unfolds) the already filled data in each fit window, n_workers at a time in forked processes.
+    // The data are filled once over the full observable range and the component PDFs (and their FFT caches) are
+    // built before forking, so each window only costs a fit. The results, their errors and the fit status for
+    // each window are printed as a table and written to a "fitWindows" tree
+    void runFitWindows(size_t n_workers) {
+      std::vector<FitWindow> windows = getFitWindows();
+      if (windows.empty()) {
+	return;
+      }
+      std::vector<std::string> result_names = getResultNames();
+      const size_t n_results = result_names.size();
+
+      // for each window: the fit status and then the values and errors of the results
+      std::vector< std::vector<double> > window_results(windows.size());
+      {
+	ForkPool pool(n_workers);
+	for (size_t i_window = 0; i_window < windows.size(); ++i_window) {
+	  pool.submit([this, &windows, &result_names, i_window]() {
+	      for (size_t i_obs = 0; i_obs < _observables.size(); ++i_obs) {
+		_ws->var(_observables[i_obs].getName().c_str())->setRange("fit", windows[i_window].mins[i_obs], windows[i_window].maxs[i_obs]);
+	      }
+	      std::vector<double> results(1 + 2*result_names.size(), std::nan(""));
+	      _fitResult.reset(); // so that we can tell whether this window's fit got as far as a result
+	      try {
+		fit();
+		results[0] = _fitResult->status();
+		unfold();
+	      }
+	      catch (const std::exception&) {
+		results[0] = _fitResult ? _fitResult->status() : -1;
+		return results;
+	      }
+	      for (size_t i_result = 0; i_result < result_names.size(); ++i_result) {
+		RooAbsReal* result = _ws->function(result_names[i_result].c_str());
+		RooRealVar* result_var = dynamic_cast<RooRealVar*>(result);
+		results[1+i_result] = result->getVal();
+		results[1+result_names.size()+i_result] = result_var ? result_var->getError() : propagatedError(*result);
+	      }
+	      return results;
+	    },
+	    [&window_results, n_results, i_window](const std::vector<double>& values, bool ok) {
+	      if (ok && values.size() == 1 + 2*n_results) {
+		window_results[i_window] = values;
+	      }
+	    });
+	}
+      }
+
+      Int_t window;
+      Int_t status;
+      std::vector<double> mins(_observables.size());
+      std::vector<double> maxs(_observables.size());
+      std::vector<double> values(n_results);
+      std::vector<double> errors(n_results);
+      _windowTree.reset(new TTree("fitWindows", "Results in each fit window"));
+      _windowTree->SetDirectory(0);
+      _windowTree->Branch("window", &window, "window/I");
+      _windowTree->Branch("status", &status, "status/I");
+      for (size_t i_obs = 0; i_obs < _observables.size(); ++i_obs) {
+	std::string obs_name = _observables[i_obs].getName();
+	_windowTree->Branch((obs_name + "FitMin").c_str(), &mins[i_obs], (obs_name + "FitMin/D").c_str());
+	_windowTree->Branch((obs_name + "FitMax").c_str(), &maxs[i_obs], (obs_name + "FitMax/D").c_str());
+      }
+      for (size_t i_result = 0; i_result < n_results; ++i_result) {
+	_windowTree->Branch(result_names[i_result].c_str(), &values[i_result], (result_names[i_result] + "/D").c_str());
+	_windowTree->Branch((result_names[i_result] + "Err").c_str(), &errors[i_result], (result_names[i_result] + "Err/D").c_str());
+      }
+
+      std::cout << _anaConf.name() << ": fit windows" << std::endl;
+      std::cout << std::left << std::setw(8) << "window";
+      for (const auto& i_obs : _observables) {
+	std::cout << std::setw(24) << i_obs.getName();
+      }
+      std::cout << std::setw(8) << "status";
+      for (const auto& i_name : result_names) {
+	std::cout << std::setw(28) << i_name;
+      }
+      std::cout << std::right << std::endl;
+      for (size_t i_window = 0; i_window < windows.size(); ++i_window) {
+	const std::vector<double>& results = window_results[i_window];
+	window = i_window;
+	status = results.empty() ? -1 : static_cast<int>(results[0]);
+	mins = windows[i_window].mins;
+	maxs = windows[i_window].maxs;
+	std::stringstream line;
+	line << std::left << std::setw(8) << window;
+	for (size_t i_obs = 0; i_obs < _observables.size(); ++i_obs) {
+	  std::stringstream range;
+	  range << "[" << mins[i_obs] << ", " << maxs[i_obs] << "]";
+	  line << std::setw(24) << range.str();
+	}
+	line << std::setw(8) << status;
+	for (size_t i_result = 0; i_result < n_results; ++i_result) {
+	  values[i_result] = results.empty() ? std::nan("") : results[1+i_result];
+	  errors[i_result] = results.empty() ? std::nan("") : results[1+n_results+i_result];
+	  std::stringstream value;
+	  value << std::setprecision(4) << values[i_result] << " +/- " << errors[i_result];
+	  line << std::setw(28) << value.str();
+	}
+	std::cout << line.str() << std::endl;
+	_windowTree->Fill();
+      }
+    }
+
+    // A copy of the data with each bin content replaced by a Poisson random number with that mean
+    RooAbsData* resample(RooAbsData& data, TRandom& rng) const {
+      if (RooDataHist* hist = dynamic_cast<RooDataHist*>(&data)) {
+	RooDataHist* replica = new RooDataHist(*hist, "replica");
+	for (int i_bin = 0; i_bin < replica->numEntries(); ++i_bin) {
+	  replica->get(i_bin);
+	  double content = replica->weight();
+	  double new_content = rng.Poisson(content);
+	  replica->set(new_content, std::sqrt(new_content));
+	}
+	return replica;
+      }
+
+      // a weighted dataset of populated bins (sparse data)
+      RooArgSet data_vars(*data.get());
+      RooRealVar weight("weight", "weight", 0, RooNumber::infinity());
+      data_vars.add(weight);
+      RooDataSet* replica = new RooDataSet("replica", "replica", data_vars, RooFit::WeightVar(weight));
+      for (int i_entry = 0; i_entry < data.numEntries(); ++i_entry) {
+	const RooArgSet* row = data.get(i_entry);
+	double new_content = rng.Poisson(data.weight());
+	if (new_content > 0) {
+	  replica->add(*row, new_content);
+	}
+      }
+      return replica;
+    }
+
+    // Fits, unfolds and calculates nReplicas Poisson-resampled copies of the data in n_workers forked processes
+    // (each one does a block of replicas). Each result gets a "<name>Boot" variable in the workspace with the median
+    // and the percentile interval as its asymmetric error, and all the replicas are written to a "bootstrap" tree
+    void runBootstrap(size_t n_workers) {
+      BootstrapConfig boot_cfg;
+      if (!_anaConf.bootstrap(boot_cfg)) {
+	return;
+      }
+      std::vector<std::string> result_names = getResultNames();
+      const size_t n_results = result_names.size();
+      const int n_replicas = boot_cfg.nReplicas();
+      const int seed = boot_cfg.seed();
+
+      // Every replica starts its fit from the nominal fit (not from wherever the previous replica's fit ended)
+      const RooArgList& float_pars = _fitResult->floatParsFinal();
+      std::vector<std::string> par_names;
+      std::vector<double> par_values, par_errors;
+      for (int i_par = 0; i_par < float_pars.getSize(); ++i_par) {
+	const RooRealVar* par = static_cast<const RooRealVar*>(float_pars.at(i_par));
+	par_names.push_back(par->GetName());
+	par_values.push_back(par->getVal());
+	par_errors.push_back(par->getError());
+      }
+
+      std::vector< std::vector<double> > replica_values(n_replicas, std::vector<double>(n_results, std::nan("")));
+      std::vector<bool> succeeded(n_replicas, false);
+      {
+	ForkPool pool(n_workers);
+	int n_blocks = std::min<int>(std::max<int>(n_workers, 1), std::max(n_replicas, 1));
+	for (int i_block = 0; i_block < n_blocks; ++i_block) {
+	  int first_replica = (i_block * n_replicas) / n_blocks;
+	  int last_replica = ((i_block+1) * n_replicas) / n_blocks;
+	  pool.submit([this, &result_names, &par_names, &par_values, &par_errors, first_replica, last_replica, seed]() {
+	      int dev_null = open("/dev/null", O_WRONLY); // only the results matter
+	      if (dev_null >= 0) {
+		dup2(dev_null, STDOUT_FILENO);
+		close(dev_null);
+	      }
+	      RooAbsData* data = _ws->data("data");
+	      std::vector<double> block_results; // success flag and then the results for each replica
+	      for (int i_replica = first_replica; i_replica < last_replica; ++i_replica) {
+		TRandom3 rng(seed*1000003 + i_replica + 1);
+		std::unique_ptr<RooAbsData> replica(resample(*data, rng));
+		std::vector<double> values(result_names.size(), 0);
+		bool ok = true;
+		try {
+		  for (size_t i_par = 0; i_par < par_names.size(); ++i_par) {
+		    RooRealVar* par = _ws->var(par_names[i_par].c_str());
+		    par->setVal(par_values[i_par]);
+		    par->setError(par_errors[i_par]);
+		  }
+		  fit(replica.get());
+		  unfold();
+		  // the calculations are functions of the fitted and unfolded values so they don't need to be made again
+		  values = getResultValues(result_names);
+		}
+		catch (const std::exception&) {
+		  ok = false;
+		}
+		block_results.push_back(ok ? 1 : 0);
+		block_results.insert(block_results.end(), values.begin(), values.end());
+	      }
+	      return block_results;
+	    },
+	    [&replica_values, &succeeded, n_results, first_replica, last_replica](const std::vector<double>& block_results, bool ok) {
+	      if (!ok || block_results.size() != (last_replica - first_replica) * (n_results+1)) {
+		return;
+	      }
+	      for (int i_replica = first_replica; i_replica < last_replica; ++i_replica) {
+		const double* replica_results = &block_results[(i_replica - first_replica) * (n_results+1)];
+		succeeded[i_replica] = (replica_results[0] != 0);
+		if (succeeded[i_replica]) {
+		  replica_values[i_replica].assign(replica_results+1, replica_results+1+n_results);
+		}
+	      }
+	    });
+	}
+      }
+
+      // Tree of all the replicas
+      Int_t replica;
+      Bool_t ok;
+      std::vector<double> values(n_results);
+      _bootTree.reset(new TTree("bootstrap", "Results for each bootstrap replica"));
+      _bootTree->SetDirectory(0);
+      _bootTree->Branch("replica", &replica, "replica/I");
+      _bootTree->Branch("ok", &ok, "ok/O");
+      for (size_t i_result = 0; i_result < n_results; ++i_result) {
+	_bootTree->Branch(result_names[i_result].c_str(), &values[i_result], (result_names[i_result] + "/D").c_str());
+      }
+      int n_succeeded = 0;
+      for (int i_replica = 0; i_replica < n_replicas; ++i_replica) {
+	replica = i_replica;
+	ok = succeeded[i_replica];
+	values = replica_values[i_replica];
+	_bootTree->Fill();
+	n_succeeded += ok;
+      }
+
+      // Percentile intervals
+      double low_quantile = 0.5*(1 - boot_cfg.confidenceLevel());
+      double high_quantile = 0.5*(1 + boot_cfg.confidenceLevel());
+      std::cout << _anaConf.name() << ": bootstrap intervals from " << n_succeeded << " of " << n_replicas << " replicas (CL = " << boot_cfg.confidenceLevel() << ")" << std::endl;
+      if (n_succeeded == 0) {
+	return;
+      }
+      auto quantile = [](const std::vector<double>& sorted, double q) {
+	double pos = q*(sorted.size()-1);
+	size_t i_low = static_cast<size_t>(pos);
+	size_t i_high = std::min(i_low+1, sorted.size()-1);
+	return sorted[i_low] + (pos - i_low)*(sorted[i_high] - sorted[i_low]);
+      };
+      for (size_t i_result = 0; i_result < n_results; ++i_result) {
+	std::vector<double> sorted;
+	for (int i_replica = 0; i_replica < n_replicas; ++i_replica) {
+	  if (succeeded[i_replica]) {
+	    sorted.push_back(replica_values[i_replica][i_result]);
+	  }
+	}
+	std::sort(sorted.begin(), sorted.end());
+	double median = quantile(sorted, 0.5);
+	double low = quantile(sorted, low_quantile);
+	double high = quantile(sorted, high_quantile);
+	std::cout << "  " << result_names[i_result] << " = " << median << " +" << high - median << " -" << median - low << std::endl;
+
+	std::string boot_name = result_names[i_result] + "Boot";
+	RooRealVar boot_result(boot_name.c_str(), "", median);
+	boot_result.setAsymError(low - median, high - median);
+	_ws->import(boot_result);
+      }
+    }
+
+    // The error on a calculated result from the fit's correlation matrix. Each unfolded yield is its fitted yield times
+    // the efficiency correction (see unfold()), so it is moved together with that yield when the result's derivative with
+    // respect to each floating parameter is taken. The correlations between the fitted yields (e.g. the anticorrelation
+    // between the signal and background) therefore carry through to results like Rmue. The other unfolded results
+    // (e.g. the smeared fractions) don't depend on the fit and add no error
+    double propagatedError(RooAbsReal& result) const {
+      const RooArgList& float_pars = _fitResult->floatParsFinal();
+      std::vector<double> shifts(float_pars.getSize(), 0); // the change in the result for a one sigma change in each parameter
+      for (int i_par = 0; i_par < float_pars.getSize(); ++i_par) {
+	const RooRealVar* fitted = static_cast<const RooRealVar*>(float_pars.at(i_par));
+	RooRealVar* par = _ws->var(fitted->GetName());
+	if (!par) {
+	  continue;
+	}
+
+	// The parameter and the unfolded yields made from it, with their derivatives with respect to it
+	std::vector< std::pair<RooRealVar*, double> > moved(1, std::make_pair(par, 1.0));
+	for (const auto& i_unfolded : _unfoldedYields) {
+	  RooRealVar* unfolded = _ws->var(i_unfolded.first.c_str());
+	  if (unfolded && i_unfolded.second.first == fitted->GetName()) {
+	    moved.push_back(std::make_pair(unfolded, i_unfolded.second.second));
+	  }
+	}
+	bool depends = false;
+	std::vector<double> nominals;
+	for (const auto& i_moved : moved) {
+	  depends = depends || result.dependsOn(*i_moved.first);
+	  nominals.push_back(i_moved.first->getVal());
+	}
+	if (!depends) {
+	  continue;
+	}
+
+	auto result_at = [&](double n_sigma) {
+	  for (size_t i_moved = 0; i_moved < moved.size(); ++i_moved) {
+	    moved[i_moved].first->setVal(nominals[i_moved] + n_sigma*fitted->getError()*moved[i_moved].second);
+	  }
+	  return result.getVal();
+	};
+	double up = result_at(+1);
+	double down = result_at(-1);
+	result_at(0);
+	shifts[i_par] = (up - down) / 2;
+      }
+
+      const TMatrixDSym& corr = _fitResult->correlationMatrix();
+      double sum_sq = 0;
+      for (size_t i_par = 0; i_par < shifts.size(); ++i_par) {
+	for (size_t j_par = 0; j_par < shifts.size(); ++j_par) {
+	  sum_sq += shifts[i_par]*corr(i_par, j_par)*shifts[j_par];
+	}
+      }
+      return std::sqrt(std::max(sum_sq, 0.0));
+    }
+
+    // For the Asimov data (see fillAsimovData()): prints the expected error on every result and, if there is a signalYield,
+    // the expected discovery and exclusion significance from the profile likelihood ratio:
+    //  - discovery: refit with the signal fixed to zero
+    //  - exclusion: fit the background-only Asimov data with the signal floating and then fixed to its nominal value
+    // The extra fits run in forked processes so that the nominal fit is left in the workspace.
+    // The significances are put in the workspace as "<signal>DiscoverySignificance" and "<signal>ExclusionSignificance"
+    void runSensitivity(size_t n_workers) {
+      std::cout << _anaConf.name() << ": expected uncertainties" << std::endl;
+      for (const auto& i_name : getResultNames()) {
+	RooAbsReal* result = _ws->function(i_name.c_str());
+	RooRealVar* result_var = dynamic_cast<RooRealVar*>(result);
+	double error = result_var ? result_var->getError() : propagatedError(*result);
+	std::cout << "  " << i_name << " = " << result->getVal() << " +/- " << error << std::endl;
+      }
+
+      std::string signal_name;
+      if (!_anaConf.signalYield(signal_name)) {
+	return;
+      }
+      RooRealVar* signal = _ws->var(signal_name.c_str());
+      if (!signal) {
+	throw cet::exception("Analysis::runSensitivity()") << "Signal yield \"" << signal_name << "\" is not in the RooWorkspace";
+      }
+      const RooAbsArg* initial_signal = _fitResult->floatParsInit().find(signal_name.c_str());
+      double nominal_signal = initial_signal ? static_cast<const RooRealVar*>(initial_signal)->getVal() : signal->getVal();
+      double nominal_nll = _fitResult->minNll();
+
+      double discovery_nll = std::nan("");
+      double exclusion_free_nll = std::nan("");
+      double exclusion_fixed_nll = std::nan("");
+      {
+	ForkPool pool(n_workers);
+	pool.submit([this, signal]() {
+	    signal->setVal(0);
+	    signal->setConstant(true);
+	    fit();
+	    return std::vector<double>{_fitResult->minNll()};
+	  },
+	  [&discovery_nll](const std::vector<double>& values, bool ok) {
+	    if (ok && values.size() == 1) {
+	      discovery_nll = values[0];
+	    }
+	  });
+	pool.submit([this, signal, nominal_signal]() {
+	    signal->setVal(0);
+	    fillExpectedHists();
+	    std::unique_ptr<RooAbsData> bkg_data(histData("asimovBkg"));
+	    fit(bkg_data.get());
+	    double free_nll = _fitResult->minNll();
+	    signal->setVal(nominal_signal);
+	    signal->setConstant(true);
+	    fit(bkg_data.get());
+	    return std::vector<double>{free_nll, _fitResult->minNll()};
+	  },
+	  [&exclusion_free_nll, &exclusion_fixed_nll](const std::vector<double>& values, bool ok) {
+	    if (ok && values.size() == 2) {
+	      exclusion_free_nll = values[0];
+	      exclusion_fixed_nll = values[1];
+	    }
+	  });
+      }
+
+      auto significance = [](double delta_nll) { // NaN if one of the fits failed
+	return std::isnan(delta_nll) ? delta_nll : std::sqrt(std::max(0.0, 2*delta_nll));
+      };
+      double discovery_z = significance(discovery_nll - nominal_nll);
+      double exclusion_z = significance(exclusion_fixed_nll - exclusion_free_nll);
+      std::cout << _anaConf.name() << ": expected significance for " << signal_name << " = " << nominal_signal
+		<< ": discovery " << discovery_z << " sigma, exclusion " << exclusion_z << " sigma" << std::endl;
+      _ws->import(RooRealVar((signal_name + "DiscoverySignificance").c_str(), "", discovery_z));
+      _ws->import(RooRealVar((signal_name + "ExclusionSignificance").c_str(), "", exclusion_z));
+    }
+
+    // Calculates everything for the report (data, expected events for each component, pulls and results)
+    // while the workspace is here so that the report can be written and drawn without the model.
+    // The images go next to the job's output file and start with its name so that jobs running at the same time
+    // (e.g. farm tasks or service jobs) don't overwrite each other's
+    void report(const std::string& output_filename) {
+      ReportConfig report_cfg;
+      if (!_anaConf.report(report_cfg)) {
+	return;
+      }
+      _report.reset(new Report());
+      RooAbsPdf* model = _ws->pdf(_anaConf.model().name().c_str());
+      for (size_t i_dim = 0; i_dim < _observables.size(); ++i_dim) {
+	std::vector<double> edges = _observables.at(i_dim).getBinEdges(_ws.get());
+	std::string obs_name = _observables.at(i_dim).getName();
+	if (hasCategories()) {
+	  RooSimultaneous* sim_model = static_cast<RooSimultaneous*>(model);
+	  for (const auto& i_cat_hist : _catHists) {
+	    std::vector<std::string> comp_names;
+	    std::vector< std::vector<double> > comp_contents = projectComponents(i_dim, sim_model->getPdf(i_cat_hist.first.c_str()), comp_names);
+	    _report->addObservable(obs_name + "_" + i_cat_hist.first, edges, projectData(i_dim, i_cat_hist.second.get()), comp_names, comp_contents);
+	  }
+	}
+	else {
+	  std::vector<std::string> comp_names;
+	  std::vector< std::vector<double> > comp_contents = projectComponents(i_dim, model, comp_names);
+	  _report->addObservable(obs_name, edges, projectData(i_dim), comp_names, comp_contents);
+	}
+      }
+
+      for (const auto& i_name : getResultNames()) {
+	RooAbsReal* result = _ws->function(i_name.c_str());
+	RooRealVar* result_var = dynamic_cast<RooRealVar*>(result);
+	_report->addResult(i_name, result->getVal(), result_var ? result_var->getError() : 0);
+      }
+
+      std::string prefix = report_cfg.prefix().empty() ? _anaConf.name() : report_cfg.prefix();
+      std::string output_stem = output_filename.substr(0, output_filename.rfind(".root"));
+      _report->render(output_stem + "_" + prefix, report_cfg.formats());
+    }
+
     void Write() {
-      _hist->Write();
+      if (_hist) {
+	_hist->Write();
+      }
+      if (_sparseHist) {
+	_sparseHist->Write();
+      }
+      for (const auto& i_cat_hist : _catHists) {
+	i_cat_hist.second->Write();
+      }
       
       _fitResult->Write();
+      if (_systTree) {
+	_systTree->Write();
+      }
+      if (_bootTree) {
+	_bootTree->Write();
+      }
+      if (_windowTree) {
+	_windowTree->Write();
+      }
+      if (_report) {
+	_report->Write();
+      }
+      if (_cutFlow) {
+	_cutFlow->Write();
+      }
 
       _ws->Print();
       _ws->Write();
     }
 
+    // Sets a parameter in the workspace (e.g. from the command line). Returns false if this analysis doesn't have it
+    bool setParameter(const std::string& name, double value) {
+      RooRealVar* var = _ws->var(name.c_str());
+      if (!var) {
+	return false;
+      }
+      var->setVal(value);
+      return true;
+    }
+
     const AnalysisConfig& getConf() const { return _anaConf; }
   };
 }
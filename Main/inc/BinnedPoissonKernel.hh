@@ -0,0 +1,182 @@
+#ifndef BinnedPoissonKernel_hh_
+#define BinnedPoissonKernel_hh_
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+namespace roofitter {
+
+  // Allocator so that the bin arrays start on a cache line
+  template <typename T, size_t Alignment = 64>
+  struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() { }
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+    T* allocate(size_t n) {
+      void* ptr = 0;
+      if (posix_memalign(&ptr, Alignment, n*sizeof(T)) != 0) {
+	throw std::bad_alloc();
+      }
+      return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) { free(ptr); }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+  };
+  typedef std::vector<double, AlignedAllocator<double> > AlignedVector;
+
+  // The extended binned Poisson negative log-likelihood
+  //
+  //   NLL = sum_c N_c - sum_i n_i log(nu_i),   nu_i = sum_c N_c f_ci
+  //
+  // where n_i are the data counts and f_ci is the fraction of component c in bin i.
+  // Empty bins only contribute through sum_c N_c (since sum_i f_ci = 1) so only the
+  // populated bins are stored. The constant sum_i (n_i log n_i - n_i) is added so that
+  // each term is close to zero near the minimum, which helps Minuit's precision.
+  class BinnedPoissonKernel {
+  public:
+    static const size_t kLanes = 4; // independent partial sums, so that each Kahan sum doesn't wait on the previous bin
+
+  private:
+    size_t _nBins;
+    size_t _nPadded; // _nBins rounded up to a multiple of kLanes
+    size_t _nComponents;
+    double _totalCount;
+
+    AlignedVector _counts;
+    AlignedVector _countsLogCounts;
+    AlignedVector _templates; // _nComponents blocks of _nPadded fractions
+    mutable AlignedVector _predictions;
+    mutable AlignedVector _logPredictions;
+
+  public:
+    BinnedPoissonKernel() : _nBins(0), _nPadded(0), _nComponents(0), _totalCount(0) { }
+
+    BinnedPoissonKernel(const std::vector<double>& counts, size_t n_components) :
+      _nBins(counts.size()),
+      _nPadded(((counts.size() + kLanes - 1) / kLanes) * kLanes),
+      _nComponents(n_components),
+      _totalCount(0),
+      _counts(_nPadded, 0.0),
+      _countsLogCounts(_nPadded, 0.0),
+      _templates(_nPadded*n_components, 0.0),
+      _predictions(_nPadded, 1.0),
+      _logPredictions(_nPadded, 0.0)
+    {
+      for (size_t i_bin = 0; i_bin < _nBins; ++i_bin) {
+	double n = counts[i_bin];
+	_counts[i_bin] = n;
+	if (n > 0) {
+	  _countsLogCounts[i_bin] = n*std::log(n);
+	}
+	_totalCount += n;
+      }
+    }
+
+    size_t nBins() const { return _nBins; }
+    size_t nComponents() const { return _nComponents; }
+    double count(size_t i_bin) const { return _counts[i_bin]; }
+
+    // The per-bin fractions of a component (length nBins(), padding stays at zero)
+    double* fractions(size_t i_comp) { return &_templates[i_comp*_nPadded]; }
+    const double* fractions(size_t i_comp) const { return &_templates[i_comp*_nPadded]; }
+
+    // Fills _predictions with nu_i for these yields
+    const double* predict(const double* yields) const {
+      double* __restrict__ nu = _predictions.data();
+      std::fill(nu, nu+_nPadded, 0.0);
+      for (size_t i_comp = 0; i_comp < _nComponents; ++i_comp) {
+	const double yield = yields[i_comp];
+	const double* __restrict__ frac = fractions(i_comp);
+	for (size_t i_bin = 0; i_bin < _nPadded; ++i_bin) {
+	  nu[i_bin] += yield*frac[i_bin];
+	}
+      }
+      for (size_t i_bin = 0; i_bin < _nBins; ++i_bin) {
+	if (!(nu[i_bin] > 0)) { // a populated bin with nothing predicted gets a large (but finite) penalty
+	  nu[i_bin] = 1e-300;
+	}
+      }
+      for (size_t i_bin = _nBins; i_bin < _nPadded; ++i_bin) {
+	nu[i_bin] = 1.0; // so that the padding contributes 0*log(1)
+      }
+      return nu;
+    }
+
+    double nll(const double* yields) const {
+      const double* __restrict__ nu = predict(yields);
+      double* __restrict__ log_nu = _logPredictions.data();
+      for (size_t i_bin = 0; i_bin < _nPadded; ++i_bin) {
+	log_nu[i_bin] = std::log(nu[i_bin]);
+      }
+
+      // Kahan summation in kLanes independent lanes
+      const double* __restrict__ n = _counts.data();
+      const double* __restrict__ n_log_n = _countsLogCounts.data();
+      double sum[kLanes] = {0};
+      double comp[kLanes] = {0};
+#if defined(__GNUC__)
+      // with GCC's vector types each step is done on all the lanes at once (the same operations in the same order, so
+      // the result is the same as the scalar loop)
+      typedef double Lanes __attribute__((vector_size(kLanes*sizeof(double))));
+      Lanes lane_sum, lane_comp;
+      std::memcpy(&lane_sum, sum, sizeof(Lanes));
+      std::memcpy(&lane_comp, comp, sizeof(Lanes));
+      for (size_t i_bin = 0; i_bin < _nPadded; i_bin += kLanes) {
+	Lanes lane_n, lane_n_log_n, lane_log_nu;
+	std::memcpy(&lane_n, n+i_bin, sizeof(Lanes));
+	std::memcpy(&lane_n_log_n, n_log_n+i_bin, sizeof(Lanes));
+	std::memcpy(&lane_log_nu, log_nu+i_bin, sizeof(Lanes));
+	Lanes term = (lane_n_log_n - lane_n*lane_log_nu) - lane_comp;
+	Lanes total = lane_sum + term;
+	lane_comp = (total - lane_sum) - term;
+	lane_sum = total;
+      }
+      std::memcpy(sum, &lane_sum, sizeof(Lanes));
+      std::memcpy(comp, &lane_comp, sizeof(Lanes));
+#else
+      for (size_t i_bin = 0; i_bin < _nPadded; i_bin += kLanes) {
+	for (size_t i_lane = 0; i_lane < kLanes; ++i_lane) {
+	  double term = (n_log_n[i_bin+i_lane] - n[i_bin+i_lane]*log_nu[i_bin+i_lane]) - comp[i_lane];
+	  double total = sum[i_lane] + term;
+	  comp[i_lane] = (total - sum[i_lane]) - term;
+	  sum[i_lane] = total;
+	}
+      }
+#endif
+
+      // Combine the lanes and the remaining terms with Neumaier summation
+      double result = 0;
+      double correction = 0;
+      auto add = [&result, &correction](double term) {
+	double total = result + term;
+	if (std::fabs(result) >= std::fabs(term)) {
+	  correction += (result - total) + term;
+	}
+	else {
+	  correction += (term - total) + result;
+	}
+	result = total;
+      };
+      for (size_t i_lane = 0; i_lane < kLanes; ++i_lane) {
+	add(sum[i_lane]);
+	add(-comp[i_lane]);
+      }
+      for (size_t i_comp = 0; i_comp < _nComponents; ++i_comp) {
+	add(yields[i_comp]);
+      }
+      add(-_totalCount);
+      return result + correction;
+    }
+  };
+}
+
+#endif
@@ -1,11 +1,22 @@
 #ifndef Component_hh_
 #define Component_hh_
 
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
 #include "RooWorkspace.h"
+#include "RooFFTConvPdf.h"
 #include "ConfigTools/inc/SimpleConfig.hh"
 
 #include "Main/inc/Configs.hh"
 #include "Main/inc/Observable.hh"
+#include "Main/inc/RooTabulatedPdf.hh"
+#include "Main/inc/RooFastFFTConvPdf.hh"
+#include "Main/inc/RooGKSingularIntegrator1D.hh"
+#include "Main/inc/Cubature.hh"
+#include "Main/inc/TemplateCache.hh"
 
 namespace roofitter {
 
@@ -21,8 +32,13 @@ namespace roofitter {
 
     fhicl::Atom<bool> incRespModel{fhicl::Name("incRespModel"), fhicl::Comment("True/false whether to include the response model"), false};
     fhicl::Atom<std::string> respPdfName{fhicl::Name("respPdfName"), fhicl::Comment("Name to use for the PDF with response model"), ""};
+    fhicl::Atom<double> bufferFraction{fhicl::Name("bufferFraction"), fhicl::Comment("Fraction of the observable range added (half on each side) to the response convolution's grid so that it doesn't wrap around (each half must cover the response's validMin and validMax)"), 5.0};
+    fhicl::Atom<bool> fastConv{fhicl::Name("fastConv"), fhicl::Comment("True/false whether to use RooFastFFTConvPdf (shared FFT plans and response transforms) for the response convolution instead of FCONV"), false};
+    fhicl::Atom<int> fftThreads{fhicl::Name("fftThreads"), fhicl::Comment("Number of FFTW threads for each transform in the response convolution (fastConv only)"), 1};
 
     fhicl::OptionalAtom<std::string> integrator{fhicl::Name("integrator"), fhicl::Comment("Class name for a different integrator to use")};
+
+    fhicl::Atom<int> tabulate{fhicl::Name("tabulate"), fhicl::Comment("If > 0, wrap the true PDF in a RooTabulatedPdf with this many grid points (name = true PDF name + \"Tab\")"), 0};
   };
 
   struct ComponentConfig {
@@ -33,12 +49,32 @@ namespace roofitter {
   class Component {
   private:
     ComponentConfig _compConf;
+    std::map<ObsName, PdfName> _fullPdfNames; // the PDF with the most effects included for each observable
+    bool _hasProdPdf;
+    std::vector< std::shared_ptr<RooGKSingularIntegrator1D::MemoParams> > _integratorMemos; // the parameters registered for each PDF's integrals
 
   public:
     std::string getName() const { return _compConf.name(); }
 
-    Component (const ComponentConfig& cfg, RooWorkspace* ws, const Observables& observables) : _compConf(cfg) {
+    // The name of the true PDF that the efficiency and response models are applied to
+    static std::string getTruePdfName(const FullPdfConfig& pdf_cfg) {
+      if (pdf_cfg.tabulate() > 0) {
+	return pdf_cfg.pdf().name() + "Tab";
+      }
+      return pdf_cfg.pdf().name();
+    }
+
+    // The name of the product PDF over all observables (e.g. cemLL2D)
+    std::string getProdPdfName(const Observables& observables) const {
+      return getName() + std::to_string(observables.size()) + "D";
+    }
+
+    // If there is a template cache, each response convolution is wrapped in a RooTabulatedPdf whose table comes from the cache.
+    // If used is given (the names that the model and calculations refer to, see ModelGraph), each PDF is only built as far
+    // along true -> efficiency -> response as something uses it, and not at all if nothing does
+    Component (const ComponentConfig& cfg, RooWorkspace* ws, const Observables& observables, TemplateCache* template_cache = 0, const std::set<std::string>* used = 0) : _compConf(cfg), _hasProdPdf(false) {
       std::stringstream factory_cmd;
+      bool prod_used = observables.size() > 1 && (!used || used->count(getProdPdfName(observables)));
 
       for (const auto& i_pdf_cfg : _compConf.fullPdfs()) {
 	std::string i_obs_name = i_pdf_cfg.obsName();
@@ -51,6 +87,22 @@ namespace roofitter {
 	    continue;
 	  }
 	
+	  EffModelConfig i_eff_cfg;
+	  RespModelConfig i_resp_cfg;
+	  bool has_eff = i_pdf_cfg.incEffModel() && i_obs_cfg.efficiencyModel(i_eff_cfg);
+	  bool has_resp = i_pdf_cfg.incRespModel() && i_obs_cfg.responseModel(i_resp_cfg);
+
+	  // The product PDF needs everything, otherwise only build as far as the last name that is used
+	  bool need_resp = has_resp;
+	  bool need_eff = has_eff;
+	  if (used && !prod_used) {
+	    need_resp = has_resp && used->count(i_pdf_cfg.respPdfName());
+	    need_eff = has_eff && (need_resp || used->count(i_pdf_cfg.effPdfName()));
+	    if (!need_resp && !need_eff && !used->count(i_pdf_cfg.pdf().name()) && !used->count(getTruePdfName(i_pdf_cfg))) {
+	      continue;
+	    }
+	  }
+
 	  // Construct the true pdf
 	  std::string pdf = i_pdf_cfg.pdf().formula();
 	  factory_cmd.str("");
@@ -59,214 +111,263 @@ namespace roofitter {
 
 	  std::string currentPdfName = i_pdf_cfg.pdf().name();
 
+	  // Replace the true pdf with a tabulated version of itself, if requested
+	  if (i_pdf_cfg.tabulate() > 0) {
+	    std::string tab_pdf_name = getTruePdfName(i_pdf_cfg);
+	    ws->import(RooTabulatedPdf(tab_pdf_name.c_str(), "", *ws->var(i_obs_name.c_str()), *ws->pdf(currentPdfName.c_str()), i_pdf_cfg.tabulate()));
+	    currentPdfName = tab_pdf_name;
+	  }
+	  _fullPdfNames[i_obs_name] = currentPdfName;
+
 	  // Create a PDF with the efficiency model, if requested
-	  EffModelConfig i_eff_cfg;
-	  if (i_pdf_cfg.incEffModel() && i_obs_cfg.efficiencyModel(i_eff_cfg)) {
+	  if (need_eff) {
 	    
 	    FormulaConfig i_eff_formula_cfg;
 	    if (i_eff_cfg.formula(i_eff_formula_cfg)) {
-	      ws->import(*(new RooEffProd(i_pdf_cfg.effPdfName().c_str(), "", *ws->pdf(i_pdf_cfg.pdf().name().c_str()), *ws->function(i_eff_cfg.name().c_str()))));
+	      RooEffProd eff_prod(i_pdf_cfg.effPdfName().c_str(), "", *ws->pdf(currentPdfName.c_str()), *ws->function(i_eff_cfg.name().c_str()));
+	      ws->import(eff_prod);
 	    }
 	    else {
 	      throw cet::exception("Component Constructor") << "No function for efficiency model" << std::endl;
 	    }
 	    currentPdfName = i_pdf_cfg.effPdfName();
+	    _fullPdfNames[i_obs_name] = currentPdfName;
 	  }
 
 	  // Create a PDF with the response model, if requested
-	  RespModelConfig i_resp_cfg;
-	  if (i_pdf_cfg.incRespModel() && i_obs_cfg.responseModel(i_resp_cfg)) {
-	    factory_cmd.str("");
-	    factory_cmd << "FCONV::" << i_pdf_cfg.respPdfName() << "(" << i_obs_name << ", " << currentPdfName << ", " << i_resp_cfg.name() << ")";
-	    ws->factory(factory_cmd.str().c_str());
-	
-	    ((RooFFTConvPdf*) ws->pdf(i_pdf_cfg.respPdfName().c_str()))->setBufferFraction(5.0);
+	  if (need_resp) {
+	    std::string conv_pdf_name = i_pdf_cfg.respPdfName();
+	    if (template_cache) {
+	      conv_pdf_name += "Conv";
+	    }
+	    double buffer = i_pdf_cfg.bufferFraction() * (i_obs_cfg.max() - i_obs_cfg.min()) / 2;
+	    if (buffer < i_resp_cfg.validMax() || buffer < -i_resp_cfg.validMin()) {
+	      throw cet::exception("Component Constructor") << "bufferFraction " << i_pdf_cfg.bufferFraction() << " for " << i_pdf_cfg.respPdfName() << " only adds " << buffer << " on each side of " << i_obs_name
+							    << " but the response " << i_resp_cfg.name() << " is valid from " << i_resp_cfg.validMin() << " to " << i_resp_cfg.validMax();
+	    }
+	    RooAbsPdf* resp_pdf = ws->pdf(i_resp_cfg.name().c_str());
+	    if (!resp_pdf) {
+	      throw cet::exception("Component Constructor") << "No PDF for response model " << i_resp_cfg.name() << std::endl;
+	    }
+	    RooRealVar* obs_var = ws->var(i_obs_name.c_str());
+	    if (i_pdf_cfg.fastConv()) {
+	      ws->import(RooFastFFTConvPdf(conv_pdf_name.c_str(), "", *obs_var, *ws->pdf(currentPdfName.c_str()), *resp_pdf, i_pdf_cfg.bufferFraction(), i_pdf_cfg.fftThreads()));
+	    }
+	    else {
+	      factory_cmd.str("");
+	      factory_cmd << "FCONV::" << conv_pdf_name << "(" << i_obs_name << ", " << currentPdfName << ", " << i_resp_cfg.name() << ")";
+	      ws->factory(factory_cmd.str().c_str());
+	      ((RooFFTConvPdf*) ws->pdf(conv_pdf_name.c_str()))->setBufferFraction(i_pdf_cfg.bufferFraction());
+	    }
+	    if (template_cache) {
+	      ws->import(RooTabulatedPdf(i_pdf_cfg.respPdfName().c_str(), "", *obs_var, *ws->pdf(conv_pdf_name.c_str()), template_cache->nPoints()));
+	    }
+	    _fullPdfNames[i_obs_name] = i_pdf_cfg.respPdfName();
 	  }
 
 	  // Set any new integrator for all the Pdfs
 	  std::string new_integrator;
 	  if (i_pdf_cfg.integrator(new_integrator)) {
+	    RooGKSingularIntegrator1D::registerIntegrator(RooNumIntFactory::instance()); // needs to be known before we copy the default config
 	    RooNumIntConfig customConfig(*RooAbsReal::defaultIntegratorConfig());
 	    customConfig.method1D().setLabel(new_integrator.c_str());
+	    // RooGKSingularIntegrator1D memoizes each PDF's integrals on the values of that PDF's parameters
+	    auto set_integrator = [&](RooAbsPdf* pdf) {
+	      RooNumIntConfig pdfConfig(customConfig);
+	      if (new_integrator == "RooGKSingularIntegrator1D") {
+		std::unique_ptr<RooArgSet> params(pdf->getParameters(RooArgSet(*ws->var(i_obs_name.c_str()))));
+		_integratorMemos.push_back(RooGKSingularIntegrator1D::memoParameters(*params));
+		pdfConfig.getConfigSection("RooGKSingularIntegrator1D").setRealValue("memoId", _integratorMemos.back()->id());
+	      }
+	      pdf->setIntegratorConfig(pdfConfig);
+	    };
 	    
 	    if(!i_pdf_cfg.pdf().name().empty()) {
-	      ws->pdf(i_pdf_cfg.pdf().name().c_str())->setIntegratorConfig(customConfig);
+	      set_integrator(ws->pdf(i_pdf_cfg.pdf().name().c_str()));
 	    }
-	    if(!i_pdf_cfg.effPdfName().empty()) {
-	      ws->pdf(i_pdf_cfg.effPdfName().c_str())->setIntegratorConfig(customConfig);
+	    if(need_eff && !i_pdf_cfg.effPdfName().empty()) {
+	      set_integrator(ws->pdf(i_pdf_cfg.effPdfName().c_str()));
 	    }
-	    if(!i_pdf_cfg.respPdfName().empty()) {
-	      ws->pdf(i_pdf_cfg.respPdfName().c_str())->setIntegratorConfig(customConfig);
+	    if(need_resp && !i_pdf_cfg.respPdfName().empty()) {
+	      set_integrator(ws->pdf(i_pdf_cfg.respPdfName().c_str()));
+	      RooAbsPdf* conv_pdf = ws->pdf((i_pdf_cfg.respPdfName() + "Conv").c_str());
+	      if (template_cache && conv_pdf) {
+		set_integrator(conv_pdf);
+	      }
 	    }
 	  }
-	}
-      }
-
-      /*
-      // Now create 2D models from these
-      if (all_obs.size()==2) {
 
-	std::string xObs = all_obs.at(0).getName();
-	std::string xPdf = "";
- 	if(resPdfNames.find(xObs) != resPdfNames.end()) {
-	  xPdf = resPdfNames.at(xObs);
-	}
- 	else if(effPdfNames.find(xObs) != effPdfNames.end()) {
-	  xPdf = effPdfNames.at(xObs);
-	}
- 	else if(truePdfNames.find(xObs) != truePdfNames.end()) {
-	  xPdf = truePdfNames.at(xObs);
-	}
-	else {
-	  throw cet::exception("Component::constructPdfs()") << "No valid Pdf name for 2D pdf";
-	}
-
-	std::string yObs = all_obs.at(1).getName();
-	std::string yPdf = "";
- 	if(resPdfNames.find(yObs) != resPdfNames.end()) {
-	  yPdf = resPdfNames.at(yObs);
-	}
- 	else if(effPdfNames.find(yObs) != effPdfNames.end()) {
-	  yPdf = effPdfNames.at(yObs);
-	}
- 	else if(truePdfNames.find(yObs) != truePdfNames.end()) {
-	  yPdf = truePdfNames.at(yObs);
-	}
-	else {
-	  throw cet::exception("Component::constructPdfs()") << "No valid Pdf name for 2D pdf";
+	  // Now that everything is set up, fill the table of the response convolution (from the cache if we can)
+	  if (template_cache && need_resp) {
+	    std::string conv_pdf_name = i_pdf_cfg.respPdfName() + "Conv";
+	    template_cache->apply(*((RooTabulatedPdf*) ws->pdf(i_pdf_cfg.respPdfName().c_str())), *ws->pdf(conv_pdf_name.c_str()), *ws->var(i_obs_name.c_str()));
+	  }
 	}
+      }
 
+      // Now create the product of the PDFs for each observable so that we can fit in more than one dimension
+      if (prod_used) {
 	factory_cmd.str("");
-	factory_cmd << "PROD::" << name << "2D(" << xPdf << "|" << yObs << "," << yPdf << ")";
-	//	factory_cmd << "PROD::" << name << "2D(" << xPdf << "," << yPdf << ")";
-	//	std::cout << factory_cmd.str() << std::endl;
+	factory_cmd << "PROD::" << getProdPdfName(observables) << "(";
+	for (const auto& i_obs : observables) {
+	  auto i_full_pdf_name = _fullPdfNames.find(i_obs.getName());
+	  if (i_full_pdf_name == _fullPdfNames.end()) {
+	    throw cet::exception("Component Constructor") << "Component \"" << getName() << "\" has no PDF for observable \"" << i_obs.getName() << "\" and so can't be used in a " << observables.size() << "D fit";
+	  }
+	  if (&i_obs != &observables.front()) {
+	    factory_cmd << ", ";
+	  }
+	  factory_cmd << i_full_pdf_name->second;
+	}
+	factory_cmd << ")";
 	ws->factory(factory_cmd.str().c_str());
+	_hasProdPdf = true;
       }
-      
-      if (all_obs.size()>2) {
-	throw cet::exception("Component::constructPdfs()") << "Do not currently support more than two observables";
-      }
-      */
     }
 
-    // Returns the efficiency correction to apply to any yield
-    // (i.e. it is the efficiency 
-    double getEffCorrection(const Observable& obs, RooWorkspace* ws) const {
+    // False if nothing that the model or calculations use needed any of this component's PDFs
+    bool isUsed() const { return !_fullPdfNames.empty(); }
 
-      std::string resp_pdf_name = "";
-      for (const auto& i_fullPdf : _compConf.fullPdfs()) {
-	if (i_fullPdf.obsName() == obs.getName()) {
-	  resp_pdf_name = i_fullPdf.respPdfName();
-	}
+    // The PDFs that were built with the most effects included (and the product PDF, if that was built)
+    std::vector<PdfName> getPdfNames(const Observables& observables) const {
+      std::vector<PdfName> names;
+      for (const auto& i_full_pdf_name : _fullPdfNames) {
+	names.push_back(i_full_pdf_name.second);
       }
-      
-      RooAbsPdf* this_pdf = ws->pdf(resp_pdf_name.c_str());
-      RooRealVar* this_obs = ws->var(obs.getName().c_str());
-      RooFormulaVar* effFunc = (RooFormulaVar*) ws->function(obs.getEffName().c_str());
-      TF1* effFn = effFunc->asTF(*this_obs, RooArgList(), RooArgList());
-
-      double result = 0;
-      double min_obs = obs.getMin();
-      double max_obs = obs.getMax();
-      double obs_step = obs.getBinWidth();
-      for (double i_obs = min_obs; i_obs < max_obs; i_obs += obs_step) {
-	double j_obs = i_obs + obs_step;
-	    
-	this_obs->setRange("range", i_obs, j_obs);
-	    
-	double i_eff = effFn->Eval(i_obs);
-	//	std::cout << "Eff @ " << i_obs << " MeV = " << i_eff << std::endl;
-
-	RooAbsReal* pdf_integral = this_pdf->createIntegral(*this_obs, RooFit::NormSet(*this_obs), RooFit::Range("range"));
-	double i_pdf = pdf_integral->getVal();
-	//	std::cout << effPdfName << " @ " << i_obs << " MeV = " << i_pdf << std::endl;
-	double i_effCorr = i_pdf / i_eff;
-	result += i_effCorr;
+      if (_hasProdPdf) {
+	names.push_back(getProdPdfName(observables));
       }
-
-      return result;
+      return names;
     }
 
-    // Returns the fraction of the true pdf that has smeared out
-    double getFracSmeared(const Observable& obs, RooWorkspace* ws) const {
+    // The PDF with the most effects included for this observable
+    std::string getFullPdfName(const Observable& obs) const {
+      auto i_full_pdf_name = _fullPdfNames.find(obs.getName());
+      if (i_full_pdf_name == _fullPdfNames.end()) {
+	throw cet::exception("Component::getFullPdfName") << "Component \"" << getName() << "\" has no PDF for observable \"" << obs.getName() << "\"";
+      }
+      return i_full_pdf_name->second;
+    }
 
-      std::string true_pdf_name = "";
+    std::string getTruePdfName(const Observable& obs) const {
       for (const auto& i_fullPdf : _compConf.fullPdfs()) {
 	if (i_fullPdf.obsName() == obs.getName()) {
-	  true_pdf_name = i_fullPdf.pdf().name();
+	  return getTruePdfName(i_fullPdf);
 	}
       }
+      throw cet::exception("Component::getTruePdfName") << "Component \"" << getName() << "\" has no PDF for observable \"" << obs.getName() << "\"";
+    }
 
-      RooRealVar* this_obs = ws->var(obs.getName().c_str());
-      if (!this_obs) {
-	throw cet::exception("Component::getFracSmeared") << "Could not find observable \"" << obs.getName() << "\" in RooWorkspace";
-      }
-      RooAbsPdf* truePdf = ws->pdf(true_pdf_name.c_str());
-      if (!truePdf) {
-	throw cet::exception("Component::getFracSmeared") << "Could not find truePdf \"" << true_pdf_name << "\" in RooWorkspace";
+    // Evaluates a function of one observable at each of the points (and then puts the observable back)
+    static std::vector<double> evaluate(RooAbsReal* func, RooRealVar* var, const std::vector<double>& points) {
+      double saved_val = var->getVal();
+      RooArgSet norm_set(*var);
+      std::vector<double> values(points.size());
+      for (size_t i_point = 0; i_point < points.size(); ++i_point) {
+	var->setVal(points[i_point]);
+	values[i_point] = func->getVal(norm_set);
       }
-      RooAbsPdf* respPdf = ws->pdf(obs.getRespName().c_str());
-      if (!respPdf) {
-	throw cet::exception("Component::getFracSmeared") << "Could not find respPdf \"" << obs.getRespName() << "\" in RooWorkspace";
-      }
-      double min_res = obs.getRespValidMin(); double max_res = obs.getRespValidMax();
-
-      double result = 0;
-      double min_obs = obs.getMin(); double max_obs = obs.getMax();
-      double obs_step = obs.getBinWidth();
-
-      std::cout << "getFracSmeared() might take a while..." << std::endl;
-      for (double i_obs = min_obs; i_obs < max_obs; i_obs += obs_step) {
-	double j_obs = i_obs + obs_step;
-
-	std::cout << i_obs << " MeV -- " << j_obs << " MeV" << std::endl;
+      var->setVal(saved_val);
+      return values;
+    }
 
-	// How much will be smeared out the bottom
-	this_obs->setMin(min_res);
-	this_obs->setMax(max_res);	    
-	double min_res_smear = min_res;
-	double max_res_smear = min_obs-j_obs;
-	double respPdf_integral_low_val = 0;
-	if (max_res_smear > min_res_smear) {
-	  this_obs->setRange("resRange", min_res_smear, max_res_smear);
-	  RooAbsReal* respPdf_integral_low = respPdf->createIntegral(*this_obs, RooFit::NormSet(*this_obs), RooFit::Range("resRange"));
-	  respPdf_integral_low_val = respPdf_integral_low->getVal();
-	  std::cout << "Res Smear Integral Low (" << min_res_smear << " MeV -- " << max_res_smear << " MeV) = " << respPdf_integral_low_val << std::endl;
+    // Returns the efficiency correction to apply to any yield
+    // (i.e. the integral of the full PDF divided by the efficiency over the integral of the full PDF).
+    // The PDF is a product over the observables, so the integral over every cell of the grid of bins
+    // is the product of the integrals over the bins of each observable, which are done by cubature
+    double getEffCorrection(const Observables& observables, RooWorkspace* ws) const {
+      double result = 1;
+      for (const auto& i_obs : observables) {
+	RooAbsPdf* this_pdf = ws->pdf(getFullPdfName(i_obs).c_str());
+	RooRealVar* this_obs = ws->var(i_obs.getName().c_str());
+	BinCubature cubature(i_obs.getBinEdges(ws));
+	std::vector<double> pdf_values = evaluate(this_pdf, this_obs, cubature.nodes());
+
+	RooAbsReal* effFunc = i_obs.hasEffModel() ? ws->function(i_obs.getEffName().c_str()) : 0;
+	if (!effFunc) {
+	  continue; // no efficiency to correct for in this observable
+	}
+	std::vector<double> effs = evaluate(effFunc, this_obs, cubature.nodes());
+	std::vector<double> corrected(pdf_values.size(), 0.0);
+	for (size_t i_node = 0; i_node < corrected.size(); ++i_node) {
+	  if (effs[i_node] > 0) {
+	    corrected[i_node] = pdf_values[i_node] / effs[i_node];
+	  }
 	}
+	result *= cubature.integral(corrected) / cubature.integral(pdf_values);
+      }
+      return result;
+    }
 
-	// How much will be smeared out the top
-	min_res_smear = max_obs-j_obs;
-	max_res_smear = max_res;
-	double respPdf_integral_high_val = 0;
-	if (max_res_smear > min_res_smear) {
-	  this_obs->setRange("resRange", min_res_smear, max_res_smear);
-	  RooAbsReal* respPdf_integral_high = respPdf->createIntegral(*this_obs, RooFit::NormSet(*this_obs), RooFit::Range("resRange"));
-	  respPdf_integral_high_val = respPdf_integral_high->getVal();
-	  std::cout << "Res Smear Integral High (" << min_res_smear << " MeV -- " << max_res_smear << " MeV) = " << respPdf_integral_high_val << std::endl;
+    // Returns the fraction of the true pdf that has smeared out of the range of any of the observables.
+    // For each observable with a response model, the true PDF at each cubature node is multiplied by the
+    // probability that the response moves it below the minimum or above the maximum (from the CDF of the response)
+    double getFracSmeared(const Observables& observables, RooWorkspace* ws) const {
+      double frac_kept = 1;
+      for (const auto& i_obs : observables) {
+	if (!i_obs.hasRespModel()) {
+	  continue; // nothing can smear out of this observable
+	}
+	RooRealVar* this_obs = ws->var(i_obs.getName().c_str());
+	if (!this_obs) {
+	  throw cet::exception("Component::getFracSmeared") << "Could not find observable \"" << i_obs.getName() << "\" in RooWorkspace";
+	}
+	RooAbsPdf* truePdf = ws->pdf(getTruePdfName(i_obs).c_str());
+	if (!truePdf) {
+	  throw cet::exception("Component::getFracSmeared") << "Could not find truePdf \"" << getTruePdfName(i_obs) << "\" in RooWorkspace";
 	}
+	RooAbsPdf* respPdf = ws->pdf(i_obs.getRespName().c_str());
+	if (!respPdf) {
+	  throw cet::exception("Component::getFracSmeared") << "Could not find respPdf \"" << i_obs.getRespName() << "\" in RooWorkspace";
+	}
+
+	double min_obs = i_obs.getMin(); double max_obs = i_obs.getMax();
+	BinCubature cubature(i_obs.getBinEdges(ws)); // get these before we change the limits below
+	std::vector<double> truth = evaluate(truePdf, this_obs, cubature.nodes());
 
-	// Reset the limits here so that they are correct when we exit the for loop
+	// Tabulate the CDF of the response over its region of validity
+	const size_t n_resp_bins = 1000;
+	double min_res = i_obs.getRespValidMin(); double max_res = i_obs.getRespValidMax();
+	std::vector<double> resp_edges;
+	for (size_t i_edge = 0; i_edge <= n_resp_bins; ++i_edge) {
+	  resp_edges.push_back(min_res + (max_res - min_res)*i_edge/n_resp_bins);
+	}
+	std::unique_ptr<RooAbsBinning> binning(this_obs->getBinning().clone());
+	this_obs->setMin(min_res);
+	this_obs->setMax(max_res);
+	BinCubature resp_cubature(resp_edges);
+	std::vector<double> resp_bins = resp_cubature.binIntegrals(evaluate(respPdf, this_obs, resp_cubature.nodes()));
 	this_obs->setMax(max_obs);
 	this_obs->setMin(min_obs);
-	if (respPdf_integral_low_val>1e-4 || respPdf_integral_high_val>1e-4) { // only calculate the truth if we have to
-	  // How much of the truth is here?
-	  this_obs->setRange("new", i_obs, j_obs);
-	  RooAbsReal* truePdf_integral = truePdf->createIntegral(*this_obs, RooFit::NormSet(*this_obs), RooFit::Range("new"));
-	  double truePdf_integral_val = truePdf_integral->getVal();
-	  std::cout << "True PDF Integral (" << i_obs << " MeV -- " << j_obs << " MeV) = " << truePdf_integral_val << std::endl;
-	  //	if(truePdf_integral_val<1e-3) {
-	  //	  break;
-	  //	}
-	  double smeared_away = (respPdf_integral_low_val + respPdf_integral_high_val) * truePdf_integral_val;
-	  std::cout << "Fraction Smeared Away = " << smeared_away << std::endl;
-	  result += smeared_away;
+	this_obs->setBinning(*binning); // changing the limits can change a variable binning
+
+	std::vector<double> resp_cdf(1, 0.0);
+	for (const auto& i_resp_bin : resp_bins) {
+	  resp_cdf.push_back(resp_cdf.back() + i_resp_bin);
 	}
-	else {
-	  std::cout << "This region won't smear in either direction" << std::endl;
+	double resp_total = resp_cdf.back();
+	auto cdf = [&](double res) {
+	  double pos = (res - min_res) / (max_res - min_res) * n_resp_bins;
+	  if (pos <= 0) {
+	    return 0.0;
+	  }
+	  if (pos >= n_resp_bins) {
+	    return 1.0;
+	  }
+	  size_t i_bin = pos;
+	  double frac = pos - i_bin;
+	  return ((1-frac)*resp_cdf[i_bin] + frac*resp_cdf[i_bin+1]) / resp_total;
+	};
+
+	std::vector<double> truth_kept(truth.size());
+	for (size_t i_node = 0; i_node < truth.size(); ++i_node) {
+	  double x = cubature.nodes()[i_node];
+	  double smeared_away = cdf(min_obs - x) + (1 - cdf(max_obs - x));
+	  truth_kept[i_node] = truth[i_node] * (1 - smeared_away);
 	}
+	frac_kept *= cubature.integral(truth_kept) / cubature.integral(truth);
       }
-
-      return result;
+      return 1 - frac_kept;
     }
   };
   typedef std::vector<Component> Components;
@@ -6,6 +6,7 @@
 #include "fhiclcpp/types/Sequence.h"
 #include "fhiclcpp/types/OptionalAtom.h"
 #include "fhiclcpp/types/OptionalTable.h"
+#include "fhiclcpp/types/OptionalSequence.h"
 
 namespace roofitter {
 
@@ -0,0 +1,89 @@
+#ifndef Cubature_hh_
+#define Cubature_hh_
+
+#include <cmath>
+#include <vector>
+
+namespace roofitter {
+
+  // Gauss-Legendre quadrature with the same number of nodes in each bin of a set of bin edges.
+  // The tensor product of these rules over several observables integrates a product of
+  // one-dimensional functions (like a component's product PDF and the efficiencies) over every cell
+  // of the grid, and its sum over the cells is just the product of the one-dimensional sums
+  class BinCubature {
+  private:
+    size_t _order;
+    size_t _nBins;
+    std::vector<double> _nodes;
+    std::vector<double> _weights;
+
+  public:
+    BinCubature(const std::vector<double>& edges, size_t order = 4) : _order(order), _nBins(edges.size()-1) {
+      // Nodes and weights on [-1, 1] from Newton's method on the Legendre polynomial of this order
+      std::vector<double> unit_nodes(_order);
+      std::vector<double> unit_weights(_order);
+      for (size_t i_node = 0; i_node < _order; ++i_node) {
+	double z = std::cos(M_PI * (i_node + 0.75) / (_order + 0.5));
+	double deriv = 0;
+	for (int i_iter = 0; i_iter < 100; ++i_iter) {
+	  double p_n = 1, p_n_minus_1 = 0;
+	  for (size_t j = 0; j < _order; ++j) {
+	    double p_n_minus_2 = p_n_minus_1;
+	    p_n_minus_1 = p_n;
+	    p_n = ((2*j+1)*z*p_n_minus_1 - j*p_n_minus_2) / (j+1);
+	  }
+	  deriv = _order * (z*p_n - p_n_minus_1) / (z*z - 1);
+	  double step = p_n / deriv;
+	  z -= step;
+	  if (std::abs(step) < 1e-15) {
+	    break;
+	  }
+	}
+	unit_nodes[i_node] = z;
+	unit_weights[i_node] = 2 / ((1 - z*z) * deriv*deriv);
+      }
+
+      _nodes.reserve(_nBins*_order);
+      _weights.reserve(_nBins*_order);
+      for (size_t i_bin = 0; i_bin < _nBins; ++i_bin) {
+	double half_width = 0.5*(edges[i_bin+1] - edges[i_bin]);
+	double centre = 0.5*(edges[i_bin+1] + edges[i_bin]);
+	for (size_t i_node = 0; i_node < _order; ++i_node) {
+	  _nodes.push_back(centre + half_width*unit_nodes[i_node]);
+	  _weights.push_back(half_width*unit_weights[i_node]);
+	}
+      }
+    }
+
+    size_t nBins() const { return _nBins; }
+
+    // All the nodes, bin by bin: evaluate the function at these
+    const std::vector<double>& nodes() const { return _nodes; }
+
+    // The integral over each bin of the function with these values at the nodes
+    std::vector<double> binIntegrals(const std::vector<double>& values) const {
+      std::vector<double> integrals(_nBins, 0.0);
+      for (size_t i_bin = 0; i_bin < _nBins; ++i_bin) {
+	const double* weights = &_weights[i_bin*_order];
+	const double* bin_values = &values[i_bin*_order];
+	double sum = 0;
+	for (size_t i_node = 0; i_node < _order; ++i_node) {
+	  sum += weights[i_node] * bin_values[i_node];
+	}
+	integrals[i_bin] = sum;
+      }
+      return integrals;
+    }
+
+    // The integral over all the bins
+    double integral(const std::vector<double>& values) const {
+      double sum = 0;
+      for (size_t i_node = 0; i_node < _nodes.size(); ++i_node) {
+	sum += _weights[i_node] * values[i_node];
+      }
+      return sum;
+    }
+  };
+}
+
+#endif
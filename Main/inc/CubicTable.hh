@@ -0,0 +1,106 @@
+#ifndef CubicTable_hh_
+#define CubicTable_hh_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+namespace roofitter {
+
+  // Values on a regular grid of nPoints+1 points from lo to hi, interpolated with a cubic Hermite spline. The slopes are
+  // Catmull-Rom slopes limited as in Fritsch and Carlson so that the cubic is monotone between neighbouring grid points:
+  // it never overshoots the values on either side, so it is never negative if the values aren't (e.g. next to RooCeMPdf's
+  // cutoff at eMax). The cumulative integral of that same cubic is kept too, so integrals over any range inside the grid
+  // are exact for the interpolated shape (see RooTabulatedPdf and RooFastFFTConvPdf)
+  class CubicTable {
+  private:
+    double _lo;
+    double _hi;
+    double _step;
+    std::vector<double> _values;
+    std::vector<double> _slopes;
+    std::vector<double> _cdf;
+
+    void locate(double value, size_t& i_cell, double& t) const {
+      double u = (value - _lo) / _step;
+      i_cell = std::min(static_cast<size_t>(std::max(u, 0.0)), _values.size()-2);
+      t = u - i_cell;
+    }
+
+  public:
+    CubicTable() : _lo(0), _hi(0), _step(0) { }
+
+    // Needs at least two values
+    void set(double lo, double hi, const std::vector<double>& values) {
+      _lo = lo;
+      _hi = hi;
+      _values = values;
+      size_t n_points = _values.size()-1;
+      _step = (_hi - _lo) / n_points;
+
+      // Catmull-Rom slopes (one-sided at the ends)
+      _slopes.resize(n_points+1);
+      _slopes[0] = (_values[1] - _values[0]) / _step;
+      _slopes[n_points] = (_values[n_points] - _values[n_points-1]) / _step;
+      for (size_t i_point = 1; i_point < n_points; ++i_point) {
+	_slopes[i_point] = (_values[i_point+1] - _values[i_point-1]) / (2*_step);
+      }
+
+      // Fritsch-Carlson limiter (only ever shrinks a slope towards zero, so earlier cells stay monotone)
+      for (size_t i_cell = 0; i_cell < n_points; ++i_cell) {
+	double secant = (_values[i_cell+1] - _values[i_cell]) / _step;
+	if (secant == 0) {
+	  _slopes[i_cell] = 0;
+	  _slopes[i_cell+1] = 0;
+	  continue;
+	}
+	double alpha = std::max(_slopes[i_cell] / secant, 0.0);
+	double beta = std::max(_slopes[i_cell+1] / secant, 0.0);
+	double radius_sq = alpha*alpha + beta*beta;
+	if (radius_sq > 9) {
+	  double tau = 3 / std::sqrt(radius_sq);
+	  alpha *= tau;
+	  beta *= tau;
+	}
+	_slopes[i_cell] = alpha*secant;
+	_slopes[i_cell+1] = beta*secant;
+      }
+
+      _cdf.resize(n_points+1);
+      _cdf[0] = 0;
+      for (size_t i_cell = 0; i_cell < n_points; ++i_cell) {
+	_cdf[i_cell+1] = _cdf[i_cell] + 0.5*_step*(_values[i_cell] + _values[i_cell+1]) + _step*_step*(_slopes[i_cell] - _slopes[i_cell+1])/12;
+      }
+    }
+
+    const std::vector<double>& values() const { return _values; }
+
+    // The interpolated value (between the values at the grid points on either side)
+    double value(double x) const {
+      size_t i_cell;
+      double t;
+      locate(x, i_cell, t);
+      double t2 = t*t, t3 = t2*t;
+      return (2*t3 - 3*t2 + 1)*_values[i_cell] + (t3 - 2*t2 + t)*_step*_slopes[i_cell]
+	+ (-2*t3 + 3*t2)*_values[i_cell+1] + (t3 - t2)*_step*_slopes[i_cell+1];
+    }
+
+    // Integral of the interpolating cubic from lo to x
+    double cumulative(double x) const {
+      if (x <= _lo) {
+	return 0;
+      }
+      if (x >= _hi) {
+	return _cdf.back();
+      }
+      size_t i_cell;
+      double t;
+      locate(x, i_cell, t);
+      double t2 = t*t, t3 = t2*t, t4 = t3*t;
+      return _cdf[i_cell] + _step*((t - t3 + 0.5*t4)*_values[i_cell] + (0.5*t2 - 2*t3/3 + 0.25*t4)*_step*_slopes[i_cell]
+				   + (t3 - 0.5*t4)*_values[i_cell+1] + (-t3/3 + 0.25*t4)*_step*_slopes[i_cell+1]);
+    }
+  };
+}
+
+#endif
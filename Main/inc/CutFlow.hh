@@ -0,0 +1,133 @@
+#ifndef CutFlow_hh_
+#define CutFlow_hh_
+
+#include <string>
+#include <vector>
+#include <iomanip>
+#include <iostream>
+
+#include "TH1.h"
+#include "TTree.h"
+
+namespace roofitter {
+
+  // Counts how many entries pass the ordered list of cuts:
+  //  - cumulative: this cut and all the ones before it
+  //  - single: this cut on its own
+  //  - N-1: all the other cuts (i.e. failing only this one, or passing everything)
+  // and optionally histograms each observable after each cumulative cut.
+  // It is filled in the same loop over the tree as the data and costs O(number of cuts) per entry
+  class CutFlow {
+  private:
+    std::vector<std::string> _cutNames;
+    double _nTotal;
+    std::vector<double> _nCumulative;
+    std::vector<double> _nSingle;
+    std::vector<double> _nMinusOne;
+    std::vector< std::vector<TH1D*> > _hists; // [cut][observable]
+
+  public:
+    CutFlow(const std::vector<std::string>& cut_names) :
+      _cutNames(cut_names),
+      _nTotal(0),
+      _nCumulative(cut_names.size(), 0),
+      _nSingle(cut_names.size(), 0),
+      _nMinusOne(cut_names.size(), 0),
+      _hists(cut_names.size())
+    { }
+    CutFlow(const CutFlow&) = delete;
+    CutFlow& operator=(const CutFlow&) = delete;
+    ~CutFlow() {
+      for (auto& i_cut_hists : _hists) {
+	for (auto& i_hist : i_cut_hists) {
+	  delete i_hist;
+	}
+      }
+    }
+
+    // Histogram this observable (which must be in the same position in the values passed to fill()) after each cut
+    void addObservable(const std::string& name, int n_bins, double min, double max) {
+      for (size_t i_cut = 0; i_cut < _cutNames.size(); ++i_cut) {
+	std::string histname = "cutflow_" + name + "_" + std::to_string(i_cut) + "_" + _cutNames[i_cut];
+	std::string title = "after " + _cutNames[i_cut] + ";" + name;
+	TH1D* hist = new TH1D(histname.c_str(), title.c_str(), n_bins, min, max);
+	hist->SetDirectory(0);
+	_hists[i_cut].push_back(hist);
+      }
+    }
+
+    // cut_values[i_cuts[i]] is the value of cut i for the entry (which passes if it isn't zero). Returns true if it passed all of them
+    bool fill(const std::vector<double>& cut_values, const std::vector<size_t>& i_cuts, const std::vector<double>& values) {
+      ++_nTotal;
+      size_t n_failed = 0;
+      size_t first_failed = i_cuts.size();
+      for (size_t i_cut = 0; i_cut < i_cuts.size(); ++i_cut) {
+	if (cut_values[i_cuts[i_cut]] != 0) {
+	  ++_nSingle[i_cut];
+	}
+	else {
+	  if (n_failed == 0) {
+	    first_failed = i_cut;
+	  }
+	  ++n_failed;
+	}
+      }
+      for (size_t i_cut = 0; i_cut < first_failed; ++i_cut) {
+	++_nCumulative[i_cut];
+	for (size_t i_obs = 0; i_obs < _hists[i_cut].size(); ++i_obs) {
+	  _hists[i_cut][i_obs]->Fill(values[i_obs]);
+	}
+      }
+      if (n_failed == 0) {
+	for (auto& i_n_minus_one : _nMinusOne) {
+	  ++i_n_minus_one;
+	}
+      }
+      else if (n_failed == 1) {
+	++_nMinusOne[first_failed];
+      }
+      return n_failed == 0;
+    }
+
+    void print(std::ostream& os) const {
+      os << std::left << std::setw(20) << "cut" << std::right << std::setw(14) << "cumulative" << std::setw(10) << "eff" << std::setw(14) << "single" << std::setw(14) << "N-1" << std::endl;
+      os << std::left << std::setw(20) << "(none)" << std::right << std::setw(14) << _nTotal << std::endl;
+      double previous = _nTotal;
+      for (size_t i_cut = 0; i_cut < _cutNames.size(); ++i_cut) {
+	os << std::left << std::setw(20) << _cutNames[i_cut] << std::right << std::setw(14) << _nCumulative[i_cut]
+	   << std::setw(10) << std::setprecision(4) << (previous > 0 ? _nCumulative[i_cut] / previous : 0)
+	   << std::setw(14) << _nSingle[i_cut] << std::setw(14) << _nMinusOne[i_cut] << std::endl;
+	previous = _nCumulative[i_cut];
+      }
+    }
+
+    // Writes a "cutflow" tree with one entry per cut (and the histograms) to the current directory
+    void Write() const {
+      std::string cut;
+      double cumulative, single, n_minus_one, total = _nTotal;
+      TTree tree("cutflow", "Entries passing each cut");
+      tree.SetDirectory(0);
+      tree.Branch("cut", &cut);
+      tree.Branch("cumulative", &cumulative, "cumulative/D");
+      tree.Branch("single", &single, "single/D");
+      tree.Branch("nMinusOne", &n_minus_one, "nMinusOne/D");
+      tree.Branch("total", &total, "total/D");
+      for (size_t i_cut = 0; i_cut < _cutNames.size(); ++i_cut) {
+	cut = _cutNames[i_cut];
+	cumulative = _nCumulative[i_cut];
+	single = _nSingle[i_cut];
+	n_minus_one = _nMinusOne[i_cut];
+	tree.Fill();
+      }
+      tree.Write();
+
+      for (const auto& i_cut_hists : _hists) {
+	for (const auto& i_hist : i_cut_hists) {
+	  i_hist->Write();
+	}
+      }
+    }
+  };
+}
+
+#endif
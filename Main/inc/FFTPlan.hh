@@ -0,0 +1,153 @@
+#ifndef FFTPlan_hh_
+#define FFTPlan_hh_
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <memory>
+#include <vector>
+#include <complex>
+#include <algorithm>
+#include <stdexcept>
+
+#include "TVirtualFFT.h"
+#include "fftw3.h"
+
+namespace roofitter {
+
+  // Real-to-complex and complex-to-real TVirtualFFT (i.e. FFTW, as used by RooFFTConvPdf) plans of one size.
+  // Plans are shared through get(), so every convolution on the same grid size uses the same ones instead of
+  // planning its own. A TVirtualFFT transforms its own buffers, so each thread gets its own plans and transforms
+  // never wait for each other (only making a plan is serialised, since FFTW's planner isn't thread-safe).
+  // With n_threads > 1 the plans are made after fftw_plan_with_nthreads() so that FFTW splits each transform
+  // over that many threads
+  class FFTPlan {
+  private:
+    int _n;
+    int _nThreads;
+    std::unique_ptr<TVirtualFFT> _forward;
+    std::unique_ptr<TVirtualFFT> _inverse;
+
+    static std::mutex& plannerMutex() {
+      static std::mutex mutex;
+      return mutex;
+    }
+
+  public:
+    FFTPlan(size_t n, int n_threads = 1) : _n(n), _nThreads(std::max(n_threads, 1)) {
+      std::lock_guard<std::mutex> lock(plannerMutex());
+      if (_nThreads > 1) {
+	static bool threads_ok = fftw_init_threads();
+	if (!threads_ok) {
+	  throw std::runtime_error("FFTPlan: could not initialise FFTW's threads");
+	}
+	fftw_plan_with_nthreads(_nThreads);
+      }
+      _forward.reset(TVirtualFFT::FFT(1, &_n, "R2C ES K"));
+      _inverse.reset(TVirtualFFT::FFT(1, &_n, "C2R ES K"));
+      if (_nThreads > 1) {
+	fftw_plan_with_nthreads(1);
+      }
+      if (!_forward || !_inverse) {
+	throw std::runtime_error("FFTPlan: could not make a TVirtualFFT (is ROOT built with FFTW?)");
+      }
+    }
+    FFTPlan(const FFTPlan&) = delete;
+    FFTPlan& operator=(const FFTPlan&) = delete;
+
+    size_t size() const { return _n; }
+    int nThreads() const { return _nThreads; }
+
+    // The plans for this size and number of threads, shared by everything in this thread
+    static std::shared_ptr<const FFTPlan> get(size_t n, int n_threads = 1) {
+      static thread_local std::map< std::pair<size_t, int>, std::shared_ptr<const FFTPlan> > plans;
+      auto& plan = plans[std::make_pair(n, std::max(n_threads, 1))];
+      if (!plan) {
+	plan = std::make_shared<const FFTPlan>(n, n_threads);
+      }
+      return plan;
+    }
+
+    // The first n/2+1 coefficients of the transform of n real values (the rest are their complex conjugates)
+    void forward(const std::vector<double>& values, std::vector< std::complex<double> >& spectrum) const {
+      if (values.size() != size()) {
+	throw std::invalid_argument("FFTPlan::forward(): values are the wrong size");
+      }
+      _forward->SetPoints(values.data());
+      _forward->Transform();
+      spectrum.resize(_n/2 + 1);
+      for (int i_point = 0; i_point <= _n/2; ++i_point) {
+	double re = 0, im = 0;
+	_forward->GetPointComplex(i_point, re, im);
+	spectrum[i_point] = std::complex<double>(re, im);
+      }
+    }
+
+    // The n real values with this spectrum (as from forward(), and including the 1/n that FFTW leaves out)
+    void inverse(const std::vector< std::complex<double> >& spectrum, std::vector<double>& values) const {
+      if (static_cast<int>(spectrum.size()) != _n/2 + 1) {
+	throw std::invalid_argument("FFTPlan::inverse(): spectrum is the wrong size");
+      }
+      for (int i_point = 0; i_point <= _n/2; ++i_point) {
+	_inverse->SetPoint(i_point, spectrum[i_point].real(), spectrum[i_point].imag());
+      }
+      _inverse->Transform();
+      values.resize(_n);
+      for (int i_point = 0; i_point < _n; ++i_point) {
+	values[i_point] = _inverse->GetPointReal(i_point) / _n;
+      }
+    }
+  };
+
+  // Transformed response models shared by every convolution in the process (see RooFastFFTConvPdf), keyed by a description
+  // of the response, its parameter values and the grid. The oldest ones are dropped once there are more than maxSize()
+  class FFTSpectrumCache {
+  private:
+    std::mutex _mutex;
+    std::map< std::string, std::vector< std::complex<double> > > _spectra;
+    std::deque<std::string> _order; // oldest first
+    std::atomic<size_t> _nHits;
+    std::atomic<size_t> _nMisses;
+
+    FFTSpectrumCache() : _nHits(0), _nMisses(0) { }
+
+  public:
+    static FFTSpectrumCache& instance() {
+      static FFTSpectrumCache cache;
+      return cache;
+    }
+
+    static size_t maxSize() { return 64; }
+
+    bool find(const std::string& key, std::vector< std::complex<double> >& spectrum) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto i_spectrum = _spectra.find(key);
+      if (i_spectrum == _spectra.end()) {
+	++_nMisses;
+	return false;
+      }
+      ++_nHits;
+      spectrum = i_spectrum->second;
+      return true;
+    }
+
+    void store(const std::string& key, const std::vector< std::complex<double> >& spectrum) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_spectra.insert(std::make_pair(key, spectrum)).second) {
+	_order.push_back(key);
+      }
+      if (_order.size() > maxSize()) {
+	_spectra.erase(_order.front());
+	_order.pop_front();
+      }
+    }
+
+    size_t nHits() const { return _nHits.load(); }
+    size_t nMisses() const { return _nMisses.load(); }
+  };
+}
+
+#endif
@@ -0,0 +1,457 @@
+#ifndef Farm_hh_
+#define Farm_hh_
+
+#include <map>
+#include <set>
+#include <ctime>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "TFile.h"
+#include "TKey.h"
+#include "TClass.h"
+#include "TDirectory.h"
+#include "TTree.h"
+
+#include "Main/inc/Job.hh"
+#include "Main/inc/ForkPool.hh"
+#include "Main/inc/FileQueue.hh"
+
+namespace roofitter {
+
+  // A campaign runs every combination of config file, input file and variation as a separate task.
+  // The tasks are queued as files in a farm directory:
+  //   todo/<task>.task     waiting to be claimed
+  //   running/<task>.task  claimed by a worker (which touches it every few seconds)
+  //   done/<task>.task     finished, with its output in out/<task>.root
+  //   failed/<task>.task   failed (the coordinator retries it or gives up)
+  //   log/<task>.log       the output of every attempt
+  // Workers claim tasks by renaming them from todo/ to running/ so any number of them can share the directory
+  // (including ones started on other nodes with "roofitter -j <dir>"). The coordinator requeues failed tasks,
+  // and tasks whose worker has stopped touching them, and then merges the outputs into one file
+
+  struct FarmVariationConfig {
+    fhicl::Atom<std::string> name{fhicl::Name("name"), fhicl::Comment("Variation name (used for its directories in the merged output)")};
+    fhicl::Sequence<std::string> parameters{fhicl::Name("parameters"), fhicl::Comment("Parameters to set before filling and fitting, as \"name=value\" (like -p)"), std::vector<std::string>()};
+  };
+
+  struct FarmConfig {
+    fhicl::Atom<std::string> dir{fhicl::Name("dir"), fhicl::Comment("Farm directory for the task queue (must be on a shared filesystem for remote workers)")};
+    fhicl::Sequence<std::string> configs{fhicl::Name("configs"), fhicl::Comment("Configuration files to run")};
+    fhicl::Sequence<std::string> inputs{fhicl::Name("inputs"), fhicl::Comment("Input files to run each configuration on (default is the one in the configuration)"), std::vector<std::string>()};
+    fhicl::Atom<std::string> treename{fhicl::Name("treename"), fhicl::Comment("Input tree name (default is the one in the configuration)"), ""};
+    fhicl::OptionalSequence< fhicl::Table<FarmVariationConfig> > variations{fhicl::Name("variations"), fhicl::Comment("Variations to run each configuration and input with (default is just the nominal)")};
+    fhicl::Atom<std::string> output{fhicl::Name("output"), fhicl::Comment("Merged output file")};
+    fhicl::Atom<bool> asimov{fhicl::Name("asimov"), fhicl::Comment("Fit the expected (Asimov) data of each configuration instead of the inputs (like -a)"), false};
+    fhicl::Atom<int> maxRetries{fhicl::Name("maxRetries"), fhicl::Comment("Number of times to retry a failed task"), 2};
+    fhicl::Atom<int> timeout{fhicl::Name("timeout"), fhicl::Comment("Seconds after which a running task is killed (0 for no limit)"), 0};
+    fhicl::Atom<int> staleAfter{fhicl::Name("staleAfter"), fhicl::Comment("Seconds without a heartbeat after which a task's worker is assumed dead and the task is requeued"), 300};
+  };
+
+  struct FarmTask {
+    std::string id;
+    std::string label; // subdirectory in the merged output (empty if the campaign has only one task per analysis)
+    std::string contents; // the task file
+    int attempts;
+    bool done;
+    bool given_up;
+  };
+
+  inline std::string farmPath(const std::string& dir, const std::string& state, const std::string& id) {
+    return dir + "/" + state + "/" + id + (state == "log" ? ".log" : state == "out" ? ".root" : ".task");
+  }
+
+  // "Main/fcl/example.fcl" -> "example"
+  inline std::string fileStem(const std::string& filename) {
+    std::string stem = filename.substr(filename.find_last_of('/') + 1);
+    return stem.substr(0, stem.find_last_of('.'));
+  }
+
+  // Copies everything in the source directory (only the highest cycle of each key) into the target directory
+  inline void copyDirectory(TDirectory* source, TDirectory* target) {
+    std::set<std::string> copied;
+    TIter next(source->GetListOfKeys());
+    while (TKey* key = (TKey*) next()) {
+      if (!copied.insert(key->GetName()).second) {
+	continue; // keys are sorted with the highest cycle first
+      }
+      TClass* cl = TClass::GetClass(key->GetClassName());
+      if (cl && cl->InheritsFrom(TDirectory::Class())) {
+	copyDirectory(source->GetDirectory(key->GetName()), target->mkdir(key->GetName()));
+      }
+      else if (cl && cl->InheritsFrom(TTree::Class())) {
+	TTree* tree = (TTree*) key->ReadObj();
+	target->cd();
+	TTree* clone = tree->CloneTree(-1, "fast");
+	clone->Write();
+	delete clone; // so that it isn't written again when the file is
+      }
+      else {
+	TObject* obj = key->ReadObj();
+	target->cd();
+	obj->Write(key->GetName());
+	delete obj;
+      }
+    }
+  }
+
+  // Runs tasks from a farm directory until the coordinator says the campaign has finished
+  class FarmWorker {
+  private:
+    struct Running {
+      pid_t pid;
+      time_t start;
+      int timeout;
+      std::string output; // written under a name unique to this worker and renamed when it succeeds
+    };
+
+    std::string _dir;
+    std::string _name; // host.pid
+    ForkPool _pool;
+    AnalysisCache _cache;
+    std::map<std::string, Running> _running;
+    time_t _lastHeartbeat;
+
+    void finished(const std::string& id, bool ok) {
+      std::string output = _running[id].output;
+      _running.erase(id);
+      if (ok && std::rename(output.c_str(), farmPath(_dir, "out", id).c_str()) != 0) {
+	ok = false;
+      }
+      if (!ok) {
+	std::remove(output.c_str());
+      }
+      // If this fails then the coordinator has already given the task to someone else
+      std::rename(farmPath(_dir, "running", id).c_str(), farmPath(_dir, ok ? "done" : "failed", id).c_str());
+      std::cout << "roofitter farm worker " << _name << ": task " << id << (ok ? " done" : " failed") << std::endl;
+    }
+
+    // Task files contain "timeout <seconds>" on the first line followed by the usual arguments
+    void start(const std::string& id) {
+      std::string running = farmPath(_dir, "running", id);
+      if (std::rename(farmPath(_dir, "todo", id).c_str(), running.c_str()) != 0) {
+	return; // another worker got there first
+      }
+      utime(running.c_str(), nullptr); // rename keeps the time it was queued, which the coordinator would take as a stale heartbeat
+      std::string log = farmPath(_dir, "log", id);
+
+      Running task;
+      task.pid = 0;
+      task.start = std::time(0);
+      task.timeout = 0;
+      task.output = _dir + "/out/" + id + "." + _name + ".root";
+
+      std::stringstream contents(readFile(running));
+      std::string keyword;
+      contents >> keyword >> task.timeout;
+      std::string arguments;
+      std::getline(contents, arguments, '\0');
+
+      Job job;
+      try {
+	if (keyword != "timeout") {
+	  throw cet::exception("FarmWorker::start()") << "Task file " << running << " does not start with a timeout";
+	}
+	InputArgs args;
+	ProcessArgs(splitArguments(arguments), args);
+	args.output_filename = task.output;
+	job = prepareJob(args, &_cache);
+      }
+      catch (const std::exception& e) {
+	std::ofstream log_file(log, std::ios::app);
+	log_file << e.what() << std::endl;
+	_running[id] = task;
+	finished(id, false);
+	return;
+      }
+
+      std::cout << "roofitter farm worker " << _name << ": starting task " << id << std::endl;
+      _running[id] = task;
+      _running[id].pid = _pool.submit([job, log]() mutable {
+	  setpgid(0, 0); // so that a timeout also kills any processes that the task starts (e.g. for systematics)
+	  int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	  if (fd >= 0) {
+	    dup2(fd, STDOUT_FILENO);
+	    dup2(fd, STDERR_FILENO);
+	    close(fd);
+	  }
+	  runJob(job);
+	  std::cout << "Done" << std::endl;
+	  return std::vector<double>();
+	},
+	[this, id](const std::vector<double>&, bool ok) { finished(id, ok); });
+    }
+
+    // Lets the coordinator know that our tasks are still alive and kills any that have run for too long
+    void heartbeat() {
+      time_t now = std::time(0);
+      if (now - _lastHeartbeat >= 10) {
+	for (const auto& i_task : _running) {
+	  utime(farmPath(_dir, "running", i_task.first).c_str(), nullptr);
+	}
+	_lastHeartbeat = now;
+      }
+      for (const auto& i_task : _running) {
+	if (i_task.second.timeout > 0 && now - i_task.second.start > i_task.second.timeout) {
+	  std::cout << "roofitter farm worker " << _name << ": task " << i_task.first << " timed out" << std::endl;
+	  kill(-i_task.second.pid, SIGKILL); // the pool then reports it as failed
+	}
+      }
+    }
+
+  public:
+    FarmWorker(const std::string& dir, size_t n_workers) : _dir(dir), _pool(n_workers), _lastHeartbeat(0) {
+      char hostname[256] = "";
+      gethostname(hostname, sizeof(hostname)-1);
+      _name = std::string(hostname) + "." + std::to_string(getpid());
+    }
+
+    void run() {
+      std::cout << "roofitter farm worker " << _name << ": running tasks from " << _dir << " with " << _pool.nWorkers() << " workers" << std::endl;
+      while (true) {
+	if (_pool.nRunning() < _pool.nWorkers()) {
+	  for (const auto& i_task : listFiles(_dir + "/todo", ".task")) {
+	    start(i_task);
+	    if (_pool.nRunning() >= _pool.nWorkers()) {
+	      break;
+	    }
+	  }
+	}
+
+	if (_pool.nRunning() == 0 && fileExists(_dir + "/finished")) {
+	  break;
+	}
+
+	heartbeat();
+	if (_pool.nRunning() > 0) {
+	  _pool.poll(500);
+	}
+	else {
+	  usleep(500000);
+	}
+      }
+      std::cout << "roofitter farm worker " << _name << ": campaign finished" << std::endl;
+    }
+  };
+
+  // Expands a campaign into tasks, runs a local worker, retries failed tasks and merges the outputs
+  class FarmCoordinator {
+  private:
+    std::string _dir;
+    std::string _outputFilename;
+    int _maxRetries;
+    int _staleAfter;
+    std::vector<FarmTask> _tasks;
+
+    void queue(const FarmConfig& cfg) {
+      std::vector<std::string> inputs = cfg.inputs();
+      if (inputs.empty()) {
+	inputs.push_back(""); // the input in each config file
+      }
+      std::vector<FarmVariationConfig> variations;
+      if (!cfg.variations(variations)) {
+	variations.resize(1);
+      }
+
+      for (const auto& i_config : cfg.configs()) {
+	for (const auto& i_input : inputs) {
+	  for (const auto& i_variation : variations) {
+	    std::stringstream contents;
+	    contents << "timeout " << cfg.timeout() << std::endl;
+	    contents << "-c " << i_config;
+	    if (!i_input.empty()) {
+	      contents << " -i " << i_input;
+	    }
+	    if (!cfg.treename().empty()) {
+	      contents << " -t " << cfg.treename();
+	    }
+	    for (const auto& i_param : i_variation.parameters()) {
+	      contents << " -p " << i_param;
+	    }
+	    if (cfg.asimov()) {
+	      contents << " -a";
+	    }
+	    contents << std::endl;
+
+	    std::vector<std::string> label_parts;
+	    if (cfg.configs().size() > 1) {
+	      label_parts.push_back(fileStem(i_config));
+	    }
+	    if (inputs.size() > 1) {
+	      label_parts.push_back(fileStem(i_input));
+	    }
+	    if (variations.size() > 1) {
+	      label_parts.push_back(i_variation.name());
+	    }
+
+	    std::stringstream id;
+	    id << "t" << std::setfill('0') << std::setw(5) << _tasks.size();
+	    FarmTask task;
+	    task.id = id.str();
+	    for (size_t i_part = 0; i_part < label_parts.size(); ++i_part) {
+	      task.label += (i_part > 0 ? "_" : "") + label_parts[i_part];
+	    }
+	    task.contents = contents.str();
+	    task.attempts = 0;
+	    task.done = false;
+	    task.given_up = false;
+	    _tasks.push_back(task);
+	  }
+	}
+      }
+
+      // Tasks that finished in a previous run of the same campaign are not run again
+      for (auto& i_task : _tasks) {
+	std::string done = farmPath(_dir, "done", i_task.id);
+	if (fileExists(done) && fileExists(farmPath(_dir, "out", i_task.id)) && readFile(done) == i_task.contents) {
+	  i_task.done = true;
+	  continue;
+	}
+	for (const auto& i_state : {"done", "running", "failed"}) {
+	  std::remove(farmPath(_dir, i_state, i_task.id).c_str());
+	}
+	std::remove(farmPath(_dir, "out", i_task.id).c_str());
+	std::remove(farmPath(_dir, "log", i_task.id).c_str());
+	writeFileAtomically(farmPath(_dir, "todo", i_task.id), i_task.contents);
+      }
+    }
+
+    // Returns true when every task has either succeeded or been given up on
+    bool check() {
+      time_t now = std::time(0);
+      bool all_settled = true;
+      for (auto& i_task : _tasks) {
+	if (i_task.done || i_task.given_up) {
+	  continue;
+	}
+	all_settled = false;
+	if (fileExists(farmPath(_dir, "done", i_task.id))) {
+	  i_task.done = true;
+	  continue;
+	}
+
+	std::string running = farmPath(_dir, "running", i_task.id);
+	time_t last_heartbeat = modificationTime(running);
+	if (last_heartbeat > 0 && now - last_heartbeat > _staleAfter) {
+	  std::cout << "roofitter farm: task " << i_task.id << " has had no heartbeat for " << now - last_heartbeat << " s" << std::endl;
+	  std::rename(running.c_str(), farmPath(_dir, "failed", i_task.id).c_str());
+	}
+
+	std::string failed = farmPath(_dir, "failed", i_task.id);
+	if (fileExists(failed)) {
+	  ++i_task.attempts;
+	  if (i_task.attempts <= _maxRetries) {
+	    std::cout << "roofitter farm: retrying task " << i_task.id << " (attempt " << i_task.attempts+1 << ")" << std::endl;
+	    std::string todo = farmPath(_dir, "todo", i_task.id);
+	    std::rename(failed.c_str(), todo.c_str());
+	    utime(todo.c_str(), nullptr); // so that the heartbeat starts from now (see FarmWorker::start())
+	  }
+	  else {
+	    std::cout << "roofitter farm: giving up on task " << i_task.id << " (see " << farmPath(_dir, "log", i_task.id) << ")" << std::endl;
+	    i_task.given_up = true;
+	  }
+	}
+      }
+      return all_settled;
+    }
+
+    // One directory per analysis, as roofitter writes for a single job, with a subdirectory per task if there is more than one
+    void merge() {
+      TFile* outfile = new TFile(_outputFilename.c_str(), "RECREATE");
+      for (const auto& i_task : _tasks) {
+	if (!i_task.done) {
+	  continue;
+	}
+	TFile* task_file = new TFile(farmPath(_dir, "out", i_task.id).c_str(), "READ");
+	if (task_file->IsZombie()) {
+	  throw cet::exception("FarmCoordinator::merge()") << "Output of task " << i_task.id << " is a zombie";
+	}
+	TIter next(task_file->GetListOfKeys());
+	while (TKey* key = (TKey*) next()) {
+	  TDirectory* ana_dir = outfile->GetDirectory(key->GetName());
+	  if (!ana_dir) {
+	    ana_dir = outfile->mkdir(key->GetName());
+	  }
+	  TDirectory* target = i_task.label.empty() ? ana_dir : ana_dir->mkdir(i_task.label.c_str());
+	  copyDirectory(task_file->GetDirectory(key->GetName()), target);
+	}
+	task_file->Close();
+	delete task_file;
+	outfile->cd();
+      }
+      outfile->Write();
+      outfile->Close();
+      delete outfile;
+    }
+
+  public:
+    FarmCoordinator(const FarmConfig& cfg) :
+      _dir(cfg.dir()),
+      _outputFilename(cfg.output()),
+      _maxRetries(cfg.maxRetries()),
+      _staleAfter(cfg.staleAfter())
+    {
+      makeDirectory(_dir);
+      for (const auto& i_subdir : {"todo", "running", "done", "failed", "out", "log"}) {
+	makeDirectory(_dir + "/" + i_subdir);
+      }
+      std::remove((_dir + "/finished").c_str());
+      queue(cfg);
+    }
+
+    // Runs a worker with n_workers processes in this node (none if n_workers is 0) until every task has finished
+    // and returns the number of tasks that failed
+    size_t run(size_t n_workers) {
+      std::cout << "roofitter farm: " << _tasks.size() << " tasks in " << _dir << std::endl;
+      ForkPool local(1);
+      if (n_workers > 0) {
+	std::string dir = _dir;
+	local.submit([dir, n_workers]() {
+	    FarmWorker worker(dir, n_workers);
+	    worker.run();
+	    return std::vector<double>();
+	  }, ForkPool::Callback());
+      }
+      else {
+	std::cout << "roofitter farm: waiting for workers (roofitter -j " << _dir << ")" << std::endl;
+      }
+
+      while (!check()) {
+	if (local.nRunning() > 0) {
+	  local.poll(1000);
+	}
+	else {
+	  usleep(1000000);
+	}
+      }
+      writeFileAtomically(_dir + "/finished", "");
+      local.wait();
+
+      size_t n_failed = 0;
+      for (const auto& i_task : _tasks) {
+	if (!i_task.done) {
+	  ++n_failed;
+	}
+      }
+      std::cout << "roofitter farm: " << _tasks.size() - n_failed << " tasks done, " << n_failed << " failed. Merging into " << _outputFilename << std::endl;
+      merge();
+      return n_failed;
+    }
+  };
+
+  inline fhicl::Table<FarmConfig> retrieveFarmConfiguration(const std::string& cfg_filename) {
+    fhicl::ParameterSet pset = loadParameterSet(cfg_filename);
+    std::set<std::string> ignorable_keys {};
+    fhicl::Table<FarmConfig> const result { pset, ignorable_keys };
+    return result;
+  }
+}
+
+#endif
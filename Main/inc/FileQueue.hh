@@ -0,0 +1,110 @@
+#ifndef FileQueue_hh_
+#define FileQueue_hh_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cetlib_except/exception.h"
+
+namespace roofitter {
+
+  // Small helpers for queues of jobs kept as files in a directory (see Service and Farm).
+  // A job moves between states with rename(), which is atomic so only one process can ever claim it
+
+  inline bool endsWith(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  inline bool fileExists(const std::string& filename) {
+    return access(filename.c_str(), F_OK) == 0;
+  }
+
+  // The names (without the suffix) of the files in dir that end with suffix, in sorted order
+  inline std::vector<std::string> listFiles(const std::string& dirname, const std::string& suffix) {
+    std::vector<std::string> names;
+    DIR* dir = opendir(dirname.c_str());
+    if (!dir) {
+      throw cet::exception("roofitter::listFiles()") << "Can't open directory " << dirname;
+    }
+    while (dirent* entry = readdir(dir)) {
+      std::string filename = entry->d_name;
+      if (endsWith(filename, suffix)) {
+	names.push_back(filename.substr(0, filename.size()-suffix.size()));
+      }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+  }
+
+  inline void makeDirectory(const std::string& dirname) {
+    if (mkdir(dirname.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw cet::exception("roofitter::makeDirectory()") << "Can't create directory " << dirname;
+    }
+  }
+
+  inline std::string readFile(const std::string& filename) {
+    std::ifstream file(filename);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+  }
+
+  // Writes to a temporary file first so that nobody watching the directory sees a half-written file
+  inline void writeFileAtomically(const std::string& filename, const std::string& contents) {
+    std::string tmp_filename = filename + ".tmp" + std::to_string(getpid());
+    {
+      std::ofstream file(tmp_filename);
+      file << contents;
+      if (!file) {
+	throw cet::exception("roofitter::writeFileAtomically()") << "Can't write " << tmp_filename;
+      }
+    }
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      throw cet::exception("roofitter::writeFileAtomically()") << "Can't rename " << tmp_filename << " to " << filename;
+    }
+  }
+
+  // Returns 0 if the file doesn't exist
+  inline time_t modificationTime(const std::string& filename) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) {
+      return 0;
+    }
+    return info.st_mtime;
+  }
+
+  // FNV-1a (for naming files after their contents, see TemplateCache and TreeSkim)
+  inline uint64_t hashString(const std::string& str) {
+    uint64_t result = 14695981039346656037ULL;
+    for (const auto& i_char : str) {
+      result ^= static_cast<unsigned char>(i_char);
+      result *= 1099511628211ULL;
+    }
+    return result;
+  }
+
+  // Splits the contents of a job file up like a shell would (without quoting) and adds argv[0]
+  inline std::vector<std::string> splitArguments(const std::string& contents) {
+    std::vector<std::string> tokens{"roofitter"};
+    std::stringstream stream(contents);
+    std::string token;
+    while (stream >> token) {
+      tokens.push_back(token);
+    }
+    return tokens;
+  }
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef ForkPool_hh_
+#define ForkPool_hh_
+
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <functional>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "cetlib_except/exception.h"
+
+namespace roofitter {
+
+  // Runs tasks in forked child processes, at most nWorkers() at a time.
+  // RooFit is not thread-safe, but a forked child gets its own copy of everything that
+  // has already been constructed (workspaces, filled data, loaded dictionaries) for free.
+  // A task returns a vector of doubles which is sent back to the parent over a pipe and
+  // handed to the task's callback (along with whether the child succeeded) in the parent
+  class ForkPool {
+  public:
+    typedef std::function<std::vector<double>()> Task;
+    typedef std::function<void(const std::vector<double>&, bool)> Callback;
+
+  private:
+    struct Worker {
+      pid_t pid;
+      int fd;
+      std::vector<char> buffer;
+      Callback callback;
+    };
+
+    size_t _nWorkers;
+    std::vector<Worker> _running;
+
+    static void writeAll(int fd, const void* data, size_t n_bytes) {
+      const char* ptr = static_cast<const char*>(data);
+      while (n_bytes > 0) {
+	ssize_t n_written = write(fd, ptr, n_bytes);
+	if (n_written < 0) {
+	  if (errno == EINTR) {
+	    continue;
+	  }
+	  return;
+	}
+	ptr += n_written;
+	n_bytes -= n_written;
+      }
+    }
+
+    // Waits for the child and decodes what it sent: the number of results followed by the results
+    static bool finish(Worker& worker, std::vector<double>& results) {
+      close(worker.fd);
+      int status = 0;
+      while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) { }
+      bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+      results.clear();
+      uint64_t n_results = 0;
+      if (worker.buffer.size() >= sizeof(n_results)) {
+	std::copy(worker.buffer.begin(), worker.buffer.begin()+sizeof(n_results), reinterpret_cast<char*>(&n_results));
+	if (worker.buffer.size() == sizeof(n_results) + n_results*sizeof(double)) {
+	  results.resize(n_results);
+	  std::copy(worker.buffer.begin()+sizeof(n_results), worker.buffer.end(), reinterpret_cast<char*>(results.data()));
+	}
+	else {
+	  ok = false;
+	}
+      }
+      else {
+	ok = false;
+      }
+      return ok;
+    }
+
+  public:
+    ForkPool(size_t n_workers) : _nWorkers(std::max<size_t>(n_workers, 1)) { }
+    ForkPool(const ForkPool&) = delete;
+    ForkPool& operator=(const ForkPool&) = delete;
+    ~ForkPool() { wait(); }
+
+    size_t nWorkers() const { return _nWorkers; }
+    size_t nRunning() const { return _running.size(); }
+
+    // Starts the task in a new child process (waiting for a free worker first) and returns its pid
+    pid_t submit(Task task, Callback callback) {
+      while (_running.size() >= _nWorkers) {
+	poll(-1);
+      }
+
+      int fds[2];
+      if (pipe(fds) != 0) {
+	throw cet::exception("ForkPool::submit()") << "Could not create a pipe for a worker";
+      }
+      std::cout.flush(); // so that the child does not print the parent's buffered output again
+      std::cerr.flush();
+      fflush(stdout);
+      fflush(stderr);
+
+      pid_t pid = fork();
+      if (pid < 0) {
+	close(fds[0]);
+	close(fds[1]);
+	throw cet::exception("ForkPool::submit()") << "Could not fork a worker";
+      }
+      if (pid == 0) {
+	close(fds[0]);
+	for (const auto& i_worker : _running) {
+	  close(i_worker.fd);
+	}
+	int exit_code = 0;
+	std::vector<double> results;
+	try {
+	  results = task();
+	}
+	catch (const std::exception& e) {
+	  std::cerr << e.what() << std::endl;
+	  exit_code = 1;
+	}
+	catch (...) {
+	  exit_code = 1;
+	}
+	uint64_t n_results = results.size();
+	writeAll(fds[1], &n_results, sizeof(n_results));
+	writeAll(fds[1], results.data(), n_results*sizeof(double));
+	close(fds[1]);
+	std::cout.flush();
+	std::cerr.flush();
+	fflush(stdout);
+	fflush(stderr);
+	_exit(exit_code); // don't run the parent's exit handlers (e.g. closing its ROOT files)
+      }
+
+      close(fds[1]);
+      Worker worker;
+      worker.pid = pid;
+      worker.fd = fds[0];
+      worker.callback = callback;
+      _running.push_back(worker);
+      return pid;
+    }
+
+    // Reads whatever the workers have sent for up to timeout_ms (-1 waits until there is something)
+    // and calls the callbacks of any that have finished. Returns the number that finished
+    size_t poll(int timeout_ms) {
+      if (_running.empty()) {
+	return 0;
+      }
+      std::vector<pollfd> pfds(_running.size());
+      for (size_t i_worker = 0; i_worker < _running.size(); ++i_worker) {
+	pfds[i_worker].fd = _running[i_worker].fd;
+	pfds[i_worker].events = POLLIN;
+	pfds[i_worker].revents = 0;
+      }
+      if (::poll(pfds.data(), pfds.size(), timeout_ms) <= 0) {
+	return 0;
+      }
+
+      std::vector<bool> done(_running.size(), false);
+      char chunk[65536];
+      for (size_t i_worker = 0; i_worker < _running.size(); ++i_worker) {
+	if (!(pfds[i_worker].revents & (POLLIN | POLLHUP | POLLERR))) {
+	  continue;
+	}
+	ssize_t n_read = read(_running[i_worker].fd, chunk, sizeof(chunk));
+	if (n_read > 0) {
+	  _running[i_worker].buffer.insert(_running[i_worker].buffer.end(), chunk, chunk+n_read);
+	}
+	else if (n_read == 0 || (errno != EINTR && errno != EAGAIN)) {
+	  done[i_worker] = true;
+	}
+      }
+
+      // Remove the finished workers before calling any callbacks since they might submit more tasks
+      std::vector<Worker> finished;
+      std::vector<Worker> still_running;
+      for (size_t i_worker = 0; i_worker < _running.size(); ++i_worker) {
+	if (done[i_worker]) {
+	  finished.push_back(_running[i_worker]);
+	}
+	else {
+	  still_running.push_back(_running[i_worker]);
+	}
+      }
+      _running.swap(still_running);
+      for (auto& i_worker : finished) {
+	std::vector<double> results;
+	bool ok = finish(i_worker, results);
+	if (i_worker.callback) {
+	  i_worker.callback(results, ok);
+	}
+      }
+      return finished.size();
+    }
+
+    // Waits for all the running tasks to finish
+    void wait() {
+      while (!_running.empty()) {
+	poll(-1);
+      }
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,403 @@
+#ifndef Job_hh_
+#define Job_hh_
+
+#include <map>
+#include <memory>
+#include <thread>
+
+#include <getopt.h>
+
+#include "cetlib_except/exception.h"
+
+#include "fhiclcpp/intermediate_table.h"
+#include "fhiclcpp/parse.h"
+#include "fhiclcpp/ParameterSet.h"
+#include "fhiclcpp/make_ParameterSet.h"
+
+#include "fhiclcpp/types/Atom.h"
+#include "fhiclcpp/types/Table.h"
+#include "fhiclcpp/types/OptionalTable.h"
+#include "fhiclcpp/types/Sequence.h"
+
+#include "cetlib/filepath_maker.h"
+
+#include "TFile.h"
+#include "TTree.h"
+
+#include "Main/inc/Configs.hh"
+#include "Main/inc/Analysis.hh"
+#include "Main/inc/MemoryStats.hh"
+#include "Main/inc/TreeSkim.hh"
+
+namespace roofitter {
+
+  struct InputArgs {
+    InputArgs() : cfg_filename(""), need_help(false), debug_cfg(false), debug_cfg_filename(""), spool_dir(""), n_workers(std::thread::hardware_concurrency()), farm_cfg_filename(""), farm_dir(""), dry_run(false), asimov(false), skim_dir("") { }
+
+    std::string cfg_filename;
+    bool need_help;
+    bool debug_cfg;
+    std::string debug_cfg_filename;
+    std::string input_filename;
+    std::string input_treename;
+    std::string output_filename;
+    std::string spool_dir;
+    unsigned int n_workers;
+    std::vector<std::string> parameters; // "name=value"
+    std::string farm_cfg_filename;
+    std::string farm_dir;
+    bool dry_run;
+    bool asimov;
+    std::string skim_dir;
+  };
+
+  struct InputConfig {
+    fhicl::Atom<std::string> filename{fhicl::Name("filename"), fhicl::Comment("Input file name")};
+    fhicl::Atom<std::string> treename{fhicl::Name("treename"), fhicl::Comment("Input tree name")};
+  };
+
+  struct SkimConfig {
+    fhicl::Atom<std::string> dir{fhicl::Name("dir"), fhicl::Comment("Directory to keep the skims of the input tree in")};
+    fhicl::Atom<std::string> preselection{fhicl::Name("preselection"), fhicl::Comment("Only keep the entries that pass this (loose) cut in the skim (every analysis must cut at least this hard)"), ""};
+  };
+
+  struct OutputConfig {
+    fhicl::Atom<std::string> filename{fhicl::Name("filename"), fhicl::Comment("Output file name")};
+  };
+
+  struct Config {
+    fhicl::Table<InputConfig> input{fhicl::Name("input"), fhicl::Comment("Configuration of input file")};
+    fhicl::Table<OutputConfig> output{fhicl::Name("output"), fhicl::Comment("Configuration of output file")};
+    fhicl::OptionalTable<SkimConfig> skim{fhicl::Name("skim"), fhicl::Comment("Fill the data from a slim copy of the input tree with only the columns that the analyses use")};
+    fhicl::Sequence< fhicl::Table<AnalysisConfig> > analyses{fhicl::Name("analyses"), fhicl::Comment("List of analyses")};
+  };
+
+
+  inline fhicl::Table<Config> retrieveConfiguration( fhicl::ParameterSet const & pset ) {
+    std::set<std::string> ignorable_keys {}; // keys that should be ignored by the validation system (can be empty)
+
+    fhicl::Table<Config> const result { pset, ignorable_keys }; // performs validation and value setting
+
+    return result;
+  }
+
+  inline void ProcessArgs(int argc, char** argv, InputArgs& args) {
+    const char* const short_opts = "c:i:t:o:d:s:w:p:f:j:nak:h";
+
+    const option long_opts[] = {
+      {"config", required_argument, nullptr, 'c'},
+      {"input", required_argument, nullptr, 'i'},
+      {"tree", required_argument, nullptr, 't'},
+      {"output", required_argument, nullptr, 'o'},
+      {"debug-config", required_argument, nullptr, 'd'},
+      {"service", required_argument, nullptr, 's'},
+      {"workers", required_argument, nullptr, 'w'},
+      {"parameter", required_argument, nullptr, 'p'},
+      {"farm", required_argument, nullptr, 'f'},
+      {"farm-worker", required_argument, nullptr, 'j'},
+      {"dry-run", no_argument, nullptr, 'n'},
+      {"asimov", no_argument, nullptr, 'a'},
+      {"skim", required_argument, nullptr, 'k'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, no_argument, nullptr, 0}
+    };
+
+    optind = 0; // so that we can parse more than one set of arguments (e.g. from service job files)
+    while (true) {
+      const auto opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
+
+      if (-1 == opt)
+	break;
+
+      switch (opt) {
+
+      case 'c':
+	args.cfg_filename = std::string(optarg);
+	break;
+
+      case 'i':
+	args.input_filename = std::string(optarg);
+	break;
+
+      case 't':
+	args.input_treename = std::string(optarg);
+	break;
+
+      case 'o':
+	args.output_filename = std::string(optarg);
+	break;
+
+      case 'd':
+	args.debug_cfg = true;
+	args.debug_cfg_filename = std::string(optarg);
+	break;
+
+      case 's':
+	args.spool_dir = std::string(optarg);
+	break;
+
+      case 'w':
+	args.n_workers = std::stoi(optarg);
+	break;
+
+      case 'p':
+	args.parameters.push_back(std::string(optarg));
+	break;
+
+      case 'f':
+	args.farm_cfg_filename = std::string(optarg);
+	break;
+
+      case 'j':
+	args.farm_dir = std::string(optarg);
+	break;
+
+      case 'n':
+	args.dry_run = true;
+	break;
+
+      case 'a':
+	args.asimov = true;
+	break;
+
+      case 'k':
+	args.skim_dir = std::string(optarg);
+	break;
+
+      case 'h': // -h or --help
+      case '?': // Unrecognized option
+      default:
+	args.need_help = true;
+	break;
+      }
+    }
+  }
+
+  // Parses arguments that came from somewhere other than the command line (e.g. a job file)
+  inline void ProcessArgs(std::vector<std::string> tokens, InputArgs& args) {
+    std::vector<char*> argv;
+    for (auto& i_token : tokens) {
+      argv.push_back(&i_token[0]);
+    }
+    argv.push_back(nullptr);
+    ProcessArgs(argv.size()-1, &argv[0], args);
+  }
+
+  inline fhicl::ParameterSet loadParameterSet(const std::string& cfg_filename) {
+    // This defines the path to be used to resolve fcl #include directives
+    // The argument is the name of an environment variable
+    // This policy says that the the top level file may be in the local directory,
+    // but all other #include files must be relative to the path defined in the env variable.
+    // There are other policy choices that will exclude the local directory for the top file.
+    cet::filepath_lookup_after1 policy("FHICL_FILE_PATH");
+
+    // This is boilerplate: you need to make an intermediate object
+    // The intermediate object is editable; this is how art adds the command line arguments as overrides
+    fhicl::intermediate_table tbl;
+    fhicl::parse_document(cfg_filename, policy, tbl);
+
+    // Then turn that object into a fhicl table:
+    fhicl::ParameterSet pset;
+    fhicl::make_ParameterSet(tbl, pset);
+    return pset;
+  }
+
+  // Keeps a constructed (but not filled or fitted) Analysis for every analysis configuration
+  // seen so far so that the PDFs only have to be built once. The analyses that are returned are
+  // the cached ones themselves and so should only be filled and fitted in a forked child process
+  class AnalysisCache {
+  private:
+    std::map< std::string, std::shared_ptr<Analysis> > _analyses;
+
+  public:
+    std::shared_ptr<Analysis> get(const fhicl::ParameterSet& ana_pset, const AnalysisConfig& cfg) {
+      std::string key = ana_pset.to_string();
+      auto i_cached = _analyses.find(key);
+      if (i_cached == _analyses.end()) {
+	i_cached = _analyses.insert(std::make_pair(key, std::make_shared<Analysis>(cfg))).first;
+      }
+      else {
+	std::cout << cfg.name() << " (cached)" << std::endl;
+      }
+      return i_cached->second;
+    }
+
+    size_t size() const { return _analyses.size(); }
+  };
+
+  // Everything needed to run the analyses from one config file
+  struct Job {
+    Job() : n_workers(1), asimov(false), skim_dir(""), skim_preselection("") { }
+
+    std::string input_filename;
+    std::string input_treename;
+    std::string output_filename;
+    std::vector< std::shared_ptr<Analysis> > analyses;
+    size_t n_workers; // for anything that runs in parallel (e.g. systematics)
+    std::vector< std::pair<std::string, double> > parameters; // set before filling and fitting
+    bool asimov; // fit the expected data from the model instead of the input tree
+    std::string skim_dir; // fill the data from a skim of the input tree kept here (if not empty)
+    std::string skim_preselection;
+  };
+
+  // Reads the configuration and constructs the analyses (taking them from the cache if there is one)
+  inline Job prepareJob(const InputArgs& args, AnalysisCache* cache = 0) {
+    fhicl::ParameterSet pset = loadParameterSet(args.cfg_filename);
+    auto config = retrieveConfiguration(pset);
+    /*    if (args.debug_cfg) {
+      std::ofstream fileout(args.debug_cfg_filename);
+      config.print(fileout);
+      std::cout << "Config written to " << args.debug_cfg_filename << std::endl;
+      return 0;
+      }*/
+
+    Job job;
+    job.n_workers = args.n_workers;
+    job.asimov = args.asimov;
+    for (const auto& i_param : args.parameters) {
+      size_t i_equals = i_param.find('=');
+      if (i_equals == std::string::npos || i_equals == 0) {
+	throw cet::exception("roofitter::prepareJob()") << "Parameter \"" << i_param << "\" should be name=value";
+      }
+      job.parameters.push_back(std::make_pair(i_param.substr(0, i_equals), std::stod(i_param.substr(i_equals+1))));
+    }
+    job.input_filename = config().input().filename();
+    if (!args.input_filename.empty()) { // override cfg file with
+      job.input_filename = args.input_filename;
+    }
+    if (job.input_filename.empty()) {
+      throw cet::exception("roofitter::prepareJob()") << "No filename specified";
+    }
+
+    job.input_treename = config().input().treename();
+    if (!args.input_treename.empty()) { // override cfg tree with
+      job.input_treename = args.input_treename;
+    }
+    if (job.input_treename.empty()) {
+      throw cet::exception("roofitter::prepareJob()") << "No treename specified";
+    }
+
+    job.output_filename = config().output().filename();
+    if (!args.output_filename.empty()) { // override cfg file with
+      job.output_filename = args.output_filename;
+    }
+    if (job.output_filename.empty()) {
+      throw cet::exception("roofitter::prepareJob()") << "No outfilename specified";
+    }
+
+    SkimConfig skim_cfg;
+    if (config().skim(skim_cfg)) {
+      job.skim_dir = skim_cfg.dir();
+      job.skim_preselection = skim_cfg.preselection();
+    }
+    if (!args.skim_dir.empty()) { // override cfg skim dir with
+      job.skim_dir = args.skim_dir;
+    }
+
+    std::vector<AnalysisConfig> analysis_cfgs = config().analyses();
+    std::vector<fhicl::ParameterSet> analysis_psets = pset.get< std::vector<fhicl::ParameterSet> >("analyses");
+    for (size_t i_ana = 0; i_ana < analysis_cfgs.size(); ++i_ana) {
+      if (cache) {
+	job.analyses.push_back(cache->get(analysis_psets.at(i_ana), analysis_cfgs.at(i_ana)));
+      }
+      else {
+	job.analyses.push_back(std::make_shared<Analysis>(analysis_cfgs.at(i_ana)));
+      }
+    }
+    return job;
+  }
+
+  // The tree belongs to the file, so keep that until the tree isn't needed any more
+  inline TTree* openInputTree(const Job& job, std::unique_ptr<TFile>& file) {
+    file.reset(new TFile(job.input_filename.c_str(), "READ"));
+    if (file->IsZombie()) {
+      throw cet::exception("roofitter::openInputTree()") << "Input file " << job.input_filename << " is a zombie";
+    }
+    TTree* tree = (TTree*) file->Get(job.input_treename.c_str());
+    if (!tree) {
+      throw cet::exception("roofitter::openInputTree()") << "Input tree " << job.input_treename << " is not in file";
+    }
+    return tree;
+  }
+
+  // Swaps the input tree (and file) for a skim with the columns that the job's analyses need (made first if there isn't a matching one)
+  inline TTree* skimInputTree(const Job& job, TTree* tree, std::unique_ptr<TFile>& file) {
+    std::vector<std::string> exprs;
+    for (const auto& i_ana : job.analyses) {
+      std::vector<std::string> ana_exprs = i_ana->getTreeExpressions();
+      exprs.insert(exprs.end(), ana_exprs.begin(), ana_exprs.end());
+    }
+    TreeSkim skim(job.skim_dir, job.skim_preselection);
+    return skim.open(job.input_filename, tree, exprs, file);
+  }
+
+  inline void applyParameters(Job& job) {
+    for (const auto& i_param : job.parameters) {
+      bool found = false;
+      for (auto& i_ana : job.analyses) {
+	found = i_ana->setParameter(i_param.first, i_param.second) || found;
+      }
+      if (!found) {
+	throw cet::exception("roofitter::applyParameters()") << "Parameter " << i_param.first << " is not in any analysis";
+      }
+    }
+  }
+
+  // Checks that every analysis can be filled, fitted, unfolded and calculated without filling any data (see Analysis::probe()).
+  // The full probe (for a dry run) also calculates what unfold() needs, which a real run would only do twice
+  inline void probeJob(Job& job, TTree* tree, bool full = false) {
+    applyParameters(job);
+    for (auto& i_ana : job.analyses) {
+      i_ana->probe(tree, full);
+    }
+  }
+
+  // Fills, fits, unfolds and calculates each analysis and then writes them all to the output file
+  // (in Asimov mode the data are the model's expectation and the input tree isn't opened).
+  // The allocations and memory used by each stage are printed as it goes
+  inline void runJob(Job& job) {
+    std::unique_ptr<TFile> input_file;
+    TTree* tree = job.asimov ? 0 : openInputTree(job, input_file);
+    probeJob(job, tree); // fail before spending any time on the tree
+    if (tree && !job.skim_dir.empty()) {
+      tree = skimInputTree(job, tree, input_file);
+    }
+
+    for (auto& i_ana : job.analyses) {
+      MemoryMonitor memory(i_ana->getConf().name());
+      if (job.asimov) {
+	i_ana->fillAsimovData();
+      }
+      else {
+	i_ana->fillData(tree);
+      }
+      memory.stage("fill");
+      i_ana->fit();
+      i_ana->unfold();
+      i_ana->calculate();
+      if (job.asimov) {
+	i_ana->runSensitivity(job.n_workers);
+      }
+      memory.stage("fit");
+      i_ana->runSystematics(job.n_workers);
+      i_ana->runBootstrap(job.n_workers);
+      i_ana->runFitWindows(job.n_workers);
+      memory.stage("variations");
+      i_ana->report(job.output_filename);
+      memory.stage("report");
+    }
+
+    TFile outfile(job.output_filename.c_str(), "RECREATE");
+    for (auto& i_ana : job.analyses) {
+      TDirectory* outdir = outfile.mkdir(i_ana->getConf().name().c_str());
+      outdir->cd();
+      i_ana->Write();
+      outfile.cd();
+    }
+    outfile.Write();
+    outfile.Close();
+    std::cout << "Peak RSS " << peakRSS() << " MB" << std::endl;
+  }
+}
+
+#endif
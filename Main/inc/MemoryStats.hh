@@ -0,0 +1,82 @@
+#ifndef MemoryStats_hh_
+#define MemoryStats_hh_
+
+#include <atomic>
+#include <string>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+namespace roofitter {
+
+  // Counts of the heap allocations made by this process. These are only updated if the program replaces
+  // the global operator new and delete with ones that call countAllocation() and countFree() (as roofitter_main.cc does)
+  struct AllocationCounts {
+    size_t n_allocations;
+    size_t n_frees;
+    size_t n_bytes;
+  };
+
+  // allocations, frees and bytes allocated (zero-initialised before anything can allocate)
+  inline std::atomic<size_t>* allocationCounters() {
+    static std::atomic<size_t> counters[3];
+    return counters;
+  }
+
+  inline void countAllocation(size_t n_bytes) {
+    allocationCounters()[0].fetch_add(1, std::memory_order_relaxed);
+    allocationCounters()[2].fetch_add(n_bytes, std::memory_order_relaxed);
+  }
+
+  inline void countFree() {
+    allocationCounters()[1].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline AllocationCounts allocationCounts() {
+    return AllocationCounts{allocationCounters()[0].load(), allocationCounters()[1].load(), allocationCounters()[2].load()};
+  }
+
+  // The highest resident set size of this process so far in MB (getrusage gives kB on Linux)
+  inline double peakRSS() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+      return 0;
+    }
+    return usage.ru_maxrss / 1024.0;
+  }
+
+  // The current resident set size of this process in MB (0 if there is no /proc)
+  inline double currentRSS() {
+    std::ifstream statm("/proc/self/statm");
+    long n_pages = 0, n_resident_pages = 0;
+    if (!(statm >> n_pages >> n_resident_pages)) {
+      return 0;
+    }
+    return n_resident_pages * (sysconf(_SC_PAGESIZE) / 1048576.0);
+  }
+
+  // Prints the number of allocations (and how many of them are still live) made by this process in each stage of an analysis,
+  // and the memory in use after it. Work done in forked processes (e.g. systematics) is not counted
+  class MemoryMonitor {
+  private:
+    std::string _name;
+    AllocationCounts _last;
+
+  public:
+    MemoryMonitor(const std::string& name) : _name(name), _last(allocationCounts()) { }
+
+    void stage(const std::string& stage_name) {
+      AllocationCounts now = allocationCounts();
+      long n_live = static_cast<long>(now.n_allocations - _last.n_allocations) - static_cast<long>(now.n_frees - _last.n_frees);
+      std::cout << _name << ": memory after " << std::left << std::setw(12) << stage_name << std::right
+		<< now.n_allocations - _last.n_allocations << " allocations (" << (now.n_bytes - _last.n_bytes) / 1048576.0 << " MB, "
+		<< n_live << " still live), RSS " << currentRSS() << " MB, peak RSS " << peakRSS() << " MB" << std::endl;
+      _last = now;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef ModelGraph_hh_
+#define ModelGraph_hh_
+
+#include <map>
+#include <set>
+#include <deque>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace roofitter {
+
+  // Which workspace objects the model (and any calculations) actually refer to.
+  // Each formula is broken into the identifiers it uses, and the names reachable from the roots
+  // (the model and the calculations) are everything that needs to be built. Names that aren't
+  // defined by another formula (e.g. component PDFs, yields) are leaves
+  class ModelGraph {
+  private:
+    std::map<std::string, std::vector<std::string> > _dependencies;
+    std::vector<std::string> _roots;
+
+  public:
+    // All the identifiers in a RooFit factory expression (e.g. "SUM::model(Ncem*cem1D, Ndio*dio1D)")
+    static std::vector<std::string> identifiers(const std::string& formula) {
+      static const std::regex identifier("[A-Za-z_][A-Za-z0-9_]*");
+      std::vector<std::string> result;
+      for (std::sregex_iterator i_match(formula.begin(), formula.end(), identifier), end; i_match != end; ++i_match) {
+	result.push_back(i_match->str());
+      }
+      return result;
+    }
+
+    void addFormula(const std::string& name, const std::string& formula, bool root) {
+      auto& deps = _dependencies[name];
+      for (const auto& i_identifier : identifiers(formula)) {
+	if (i_identifier != name) {
+	  deps.push_back(i_identifier);
+	}
+      }
+      if (root) {
+	_roots.push_back(name);
+      }
+    }
+
+    // Every name reachable from the roots (including the roots themselves)
+    std::set<std::string> reachable() const {
+      std::set<std::string> result(_roots.begin(), _roots.end());
+      std::deque<std::string> to_visit(_roots.begin(), _roots.end());
+      while (!to_visit.empty()) {
+	auto i_deps = _dependencies.find(to_visit.front());
+	to_visit.pop_front();
+	if (i_deps == _dependencies.end()) {
+	  continue;
+	}
+	for (const auto& i_dep : i_deps->second) {
+	  if (result.insert(i_dep).second) {
+	    to_visit.push_back(i_dep);
+	  }
+	}
+      }
+      return result;
+    }
+  };
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include "ConfigTools/inc/SimpleConfig.hh"
 #include "fhiclcpp/types/OptionalAtom.h"
 #include "fhiclcpp/types/OptionalTable.h"
+#include "fhiclcpp/types/OptionalSequence.h"
 
 #include "Main/inc/Configs.hh"
 
@@ -22,6 +23,12 @@ namespace roofitter {
     fhicl::Atom<double> validMax{fhicl::Name("validMax"), fhicl::Comment("Maximum of region of validity")};
   };
 
+  struct AdaptiveBinningConfig {
+    fhicl::Atom<std::string> method{fhicl::Name("method"), fhicl::Comment("How to merge bins: \"minCount\" (data counts), \"minExpected\" (counts expected from the initial model) or \"quantile\"")};
+    fhicl::Atom<double> threshold{fhicl::Name("threshold"), fhicl::Comment("Minimum (expected) count in each merged bin for the minCount and minExpected methods"), 5};
+    fhicl::Atom<int> nBins{fhicl::Name("nBins"), fhicl::Comment("Number of bins for the quantile method"), 20};
+  };
+
   struct ObservableConfig {
     fhicl::Atom<std::string> name{fhicl::Name("name"), fhicl::Comment("Observable name")};
     fhicl::Atom<double> min{fhicl::Name("min"), fhicl::Comment("Minimum value of observable")};
@@ -29,10 +36,12 @@ namespace roofitter {
     fhicl::Atom<std::string> leaf{fhicl::Name("leaf"), fhicl::Comment("Leaf name for this observable")};
     fhicl::Atom<double> fitMin{fhicl::Name("fitMin"), fhicl::Comment("Fit range min")};
     fhicl::Atom<double> fitMax{fhicl::Name("fitMax"), fhicl::Comment("Fit range max")};
+    fhicl::OptionalSequence< fhicl::Sequence<double> > fitWindows{fhicl::Name("fitWindows"), fhicl::Comment("Other fit ranges ([min, max]) to refit the same data in after the nominal fit (every combination is used if more than one observable has them)")};
     fhicl::Atom<double> binWidth{fhicl::Name("binWidth"), fhicl::Comment("Width of bin for histogram")};
 
     fhicl::OptionalTable<EffModelConfig> efficiencyModel{fhicl::Name("efficiencyModel"), fhicl::Comment("Efficiency model config for this observable")};
     fhicl::OptionalTable<RespModelConfig> responseModel{fhicl::Name("responseModel"), fhicl::Comment("Response model config for this observable")};
+    fhicl::OptionalTable<AdaptiveBinningConfig> adaptiveBinning{fhicl::Name("adaptiveBinning"), fhicl::Comment("Merge the binWidth bins after filling the data")};
   };
 
   class Observable {
@@ -50,6 +59,20 @@ namespace roofitter {
     double getMax() const { return _obsConf.max(); }
     double getBinWidth() const { return _obsConf.binWidth(); }
 
+    // The bin edges of the observable in the workspace (these can be variable if adaptiveBinning was used)
+    std::vector<double> getBinEdges(RooWorkspace* ws) const {
+      const RooAbsBinning& binning = ws->var(_obsConf.name().c_str())->getBinning();
+      std::vector<double> edges;
+      for (int i_bin = 0; i_bin < binning.numBins(); ++i_bin) {
+	edges.push_back(binning.binLow(i_bin));
+      }
+      edges.push_back(binning.binHigh(binning.numBins()-1));
+      return edges;
+    }
+
+    bool hasEffModel() const { EffModelConfig eff_cfg; return _obsConf.efficiencyModel(eff_cfg); }
+    bool hasRespModel() const { RespModelConfig resp_cfg; return _obsConf.responseModel(resp_cfg); }
+
     std::string getEffName() const { return _effModelConf.name(); }
 
     std::string getRespName() const { return _respModelConf.name(); }
@@ -101,7 +124,8 @@ namespace roofitter {
 	  }
 
 	  // Create the formula itself
-	  ws->import(*( new RooFormulaVar(_effModelConf.name().c_str(), formulaConf.formula().c_str(), list)));
+	  RooFormulaVar eff_formula(_effModelConf.name().c_str(), formulaConf.formula().c_str(), list);
+	  ws->import(eff_formula);
 	}
       }
 
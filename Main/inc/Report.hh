@@ -0,0 +1,199 @@
+#ifndef Report_hh_
+#define Report_hh_
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+
+#include "TROOT.h"
+#include "TH1.h"
+#include "TTree.h"
+#include "TCanvas.h"
+#include "TPad.h"
+#include "TLegend.h"
+#include "TLatex.h"
+#include "TLine.h"
+
+namespace roofitter {
+
+  // Binned curves, pulls and a table of results for an analysis.
+  // Everything is filled from numbers that the Analysis calculates while its workspace is in memory,
+  // so writing and drawing the report never needs to evaluate the model again
+  class Report {
+  private:
+    struct Panel {
+      std::string label;
+      TH1D* data;
+      TH1D* model;
+      std::vector<TH1D*> components;
+      TH1D* pulls;
+    };
+
+    std::vector<Panel> _panels;
+    std::vector<std::string> _resultNames;
+    std::vector<double> _resultValues;
+    std::vector<double> _resultErrors;
+
+    static TH1D* makeHist(const std::string& name, const std::string& title, const std::vector<double>& edges, const std::vector<double>& contents) {
+      TH1D* hist = new TH1D(name.c_str(), title.c_str(), edges.size()-1, &edges[0]);
+      hist->SetDirectory(0);
+      for (size_t i_bin = 0; i_bin < contents.size(); ++i_bin) {
+	hist->SetBinContent(i_bin+1, contents[i_bin]);
+      }
+      return hist;
+    }
+
+  public:
+    Report() { }
+    Report(const Report&) = delete;
+    Report& operator=(const Report&) = delete;
+    ~Report() {
+      for (auto& i_panel : _panels) {
+	delete i_panel.data;
+	delete i_panel.model;
+	for (auto& i_comp : i_panel.components) {
+	  delete i_comp;
+	}
+	delete i_panel.pulls;
+      }
+    }
+
+    // Adds the data and the expected events of each component in the bins of one observable (or category)
+    void addObservable(const std::string& label, const std::vector<double>& edges, const std::vector<double>& data,
+		       const std::vector<std::string>& comp_names, const std::vector< std::vector<double> >& comp_contents) {
+      Panel panel;
+      panel.label = label;
+      panel.data = makeHist("report_" + label + "_data", label + ";" + label + ";events", edges, data);
+      for (int i_bin = 1; i_bin <= panel.data->GetNbinsX(); ++i_bin) {
+	panel.data->SetBinError(i_bin, std::sqrt(panel.data->GetBinContent(i_bin)));
+      }
+
+      std::vector<double> total(data.size(), 0.0);
+      for (size_t i_comp = 0; i_comp < comp_names.size(); ++i_comp) {
+	panel.components.push_back(makeHist("report_" + label + "_" + comp_names[i_comp], comp_names[i_comp], edges, comp_contents[i_comp]));
+	for (size_t i_bin = 0; i_bin < total.size(); ++i_bin) {
+	  total[i_bin] += comp_contents[i_comp][i_bin];
+	}
+      }
+      panel.model = makeHist("report_" + label + "_model", "model", edges, total);
+
+      // (data - expected) / sqrt(expected)
+      std::vector<double> pulls(data.size(), 0.0);
+      for (size_t i_bin = 0; i_bin < pulls.size(); ++i_bin) {
+	if (total[i_bin] > 0) {
+	  pulls[i_bin] = (data[i_bin] - total[i_bin]) / std::sqrt(total[i_bin]);
+	}
+      }
+      panel.pulls = makeHist("report_" + label + "_pulls", ";" + label + ";pull", edges, pulls);
+      _panels.push_back(panel);
+    }
+
+    void addResult(const std::string& name, double value, double error) {
+      _resultNames.push_back(name);
+      _resultValues.push_back(value);
+      _resultErrors.push_back(error);
+    }
+
+    // Writes the histograms and a "results" tree into the current directory
+    void Write() const {
+      for (const auto& i_panel : _panels) {
+	i_panel.data->Write();
+	i_panel.model->Write();
+	for (const auto& i_comp : i_panel.components) {
+	  i_comp->Write();
+	}
+	i_panel.pulls->Write();
+      }
+
+      std::string name;
+      double value, error;
+      TTree results("results", "Fitted, unfolded and calculated results");
+      results.SetDirectory(0);
+      results.Branch("name", &name);
+      results.Branch("value", &value, "value/D");
+      results.Branch("error", &error, "error/D");
+      for (size_t i_result = 0; i_result < _resultNames.size(); ++i_result) {
+	name = _resultNames[i_result];
+	value = _resultValues[i_result];
+	error = _resultErrors[i_result];
+	results.Fill();
+      }
+      results.Write();
+    }
+
+    // Draws each panel to <prefix>_<label>.<format> for each format (e.g. "pdf", "png")
+    void render(const std::string& prefix, const std::vector<std::string>& formats) const {
+      if (formats.empty()) {
+	return;
+      }
+      bool was_batch = gROOT->IsBatch();
+      gROOT->SetBatch(kTRUE);
+      const int colours[] = { kRed, kBlue, kGreen+2, kCyan+1, kMagenta, kOrange+1 };
+      const int n_colours = sizeof(colours)/sizeof(colours[0]);
+
+      for (const auto& i_panel : _panels) {
+	TCanvas canvas(("c_report_" + i_panel.label).c_str(), "", 800, 800);
+	TPad* pad1 = new TPad("pad1", "", 0.0, 0.3, 1.0, 1.0);
+	TPad* pad2 = new TPad("pad2", "", 0.0, 0.0, 1.0, 0.3);
+	pad1->Draw();
+	pad2->Draw();
+
+	pad1->cd();
+	pad1->SetLogy();
+	i_panel.data->SetStats(false);
+	i_panel.data->SetMarkerStyle(kFullCircle);
+	i_panel.data->SetMinimum(0.1);
+	i_panel.data->Draw("E");
+	i_panel.model->SetLineColor(kBlack);
+	i_panel.model->SetLineWidth(2);
+	i_panel.model->Draw("HIST SAME");
+	TLegend legend(0.15, 0.7, 0.45, 0.88);
+	legend.SetBorderSize(0);
+	legend.AddEntry(i_panel.data, "data", "pe");
+	legend.AddEntry(i_panel.model, "model", "l");
+	for (size_t i_comp = 0; i_comp < i_panel.components.size(); ++i_comp) {
+	  TH1D* comp = i_panel.components[i_comp];
+	  comp->SetLineColor(colours[i_comp % n_colours]);
+	  comp->SetLineStyle(kDashed);
+	  comp->Draw("HIST SAME");
+	  legend.AddEntry(comp, comp->GetTitle(), "l");
+	}
+	legend.Draw();
+
+	TLatex latex;
+	latex.SetTextSize(0.035);
+	std::stringstream text;
+	double ndc_y = 0.85;
+	for (size_t i_result = 0; i_result < _resultNames.size() && i_result < 8; ++i_result) {
+	  text.str("");
+	  text << std::setprecision(4) << _resultNames[i_result] << " = " << _resultValues[i_result];
+	  if (_resultErrors[i_result] > 0) {
+	    text << " #pm " << _resultErrors[i_result];
+	  }
+	  latex.DrawLatexNDC(0.6, ndc_y, text.str().c_str());
+	  ndc_y -= 0.05;
+	}
+
+	pad2->cd();
+	i_panel.pulls->SetStats(false);
+	i_panel.pulls->SetFillColor(kGray);
+	i_panel.pulls->GetYaxis()->SetTitleSize(0.08);
+	i_panel.pulls->GetYaxis()->SetLabelSize(0.08);
+	i_panel.pulls->GetXaxis()->SetTitleSize(0.08);
+	i_panel.pulls->GetXaxis()->SetLabelSize(0.08);
+	i_panel.pulls->Draw("HIST");
+	TLine zero(i_panel.pulls->GetXaxis()->GetXmin(), 0, i_panel.pulls->GetXaxis()->GetXmax(), 0);
+	zero.Draw();
+
+	for (const auto& i_format : formats) {
+	  canvas.SaveAs((prefix + "_" + i_panel.label + "." + i_format).c_str());
+	}
+      }
+      gROOT->SetBatch(was_batch);
+    }
+  };
+}
+
+#endif
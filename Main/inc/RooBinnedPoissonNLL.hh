@@ -0,0 +1,336 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * Extended binned Poisson likelihood for a RooAddPdf of yields*shapes       *
+ *****************************************************************************/
+
+#ifndef RooBinnedPoissonNLL_h_
+#define RooBinnedPoissonNLL_h_
+
+#include <memory>
+#include <string>
+#include <stdexcept>
+
+#include "RooAbsReal.h"
+#include "RooAbsPdf.h"
+#include "RooAddPdf.h"
+#include "RooAbsData.h"
+#include "RooRealVar.h"
+#include "RooListProxy.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooAbsBinning.h"
+
+#include "Main/inc/BinnedPoissonKernel.hh"
+
+// A RooAbsReal so that it can be handed to RooMinimizer (and so Minuit) like a RooNLLVar.
+// The data counts and each component's per-bin fractions are kept in a BinnedPoissonKernel
+// and a component's fractions are only recalculated when one of its shape parameters changes.
+// If any observable has a variable binning (e.g. after adaptive bin merging) then the fractions
+// are integrals over each bin, otherwise they are the value at the bin centre times the bin volume.
+// The yields and shape parameters are value servers but the component PDFs are only shape servers,
+// so that the observables are never seen as floating parameters. A copy makes its own component caches
+// (and integrals) from its own proxies, and remakes them if its servers are redirected. The observables are
+// found again by name among the variables of its own PDFs at the same time.
+class RooBinnedPoissonNLL : public RooAbsReal {
+public:
+  RooBinnedPoissonNLL() : _integrateBins(false), _componentsValid(false), _nEvaluations(0) {} ;
+  RooBinnedPoissonNLL(const char *name, const char *title,
+		      const RooAddPdf& model,
+		      const RooAbsData& data,
+		      const RooArgSet& observables,
+		      const char* rangeName) :
+    RooAbsReal(name,title),
+    _coefs("coefs","coefs",this),
+    _params("params","params",this),
+    _pdfs("pdfs","pdfs",this,kFALSE,kTRUE),
+    _rangeName(rangeName ? rangeName : ""),
+    _integrateBins(false),
+    _componentsValid(false),
+    _nEvaluations(0)
+  {
+    if (model.coefList().getSize() != model.pdfList().getSize()) {
+      throw std::invalid_argument(std::string("RooBinnedPoissonNLL: model ") + model.GetName() + " needs one yield per component");
+    }
+    _coefs.add(model.coefList());
+    _pdfs.add(model.pdfList());
+
+    RooArgList obs_list(observables);
+    for (int i_obs = 0; i_obs < obs_list.getSize(); ++i_obs) {
+      RooRealVar* obs = dynamic_cast<RooRealVar*>(obs_list.at(i_obs));
+      if (!obs) {
+	throw std::invalid_argument(std::string("RooBinnedPoissonNLL: observable ") + obs_list.at(i_obs)->GetName() + " is not a RooRealVar");
+      }
+      _obs.push_back(obs);
+      _obsNames.push_back(obs->GetName());
+      if (!obs->getBinning().isUniform()) {
+	_integrateBins = true;
+      }
+    }
+    _normSet.add(observables);
+
+    // Store the populated bins inside the range
+    std::vector<double> counts;
+    for (int i_entry = 0; i_entry < data.numEntries(); ++i_entry) {
+      const RooArgSet* row = data.get(i_entry);
+      double count = data.weight();
+      if (count <= 0) {
+	continue;
+      }
+      std::vector<double> centre, low, high;
+      double volume = 1;
+      bool in_range = true;
+      for (const auto& i_obs : _obs) {
+	double x = row->getRealValue(i_obs->GetName());
+	if (x < i_obs->getMin(rangeName) || x > i_obs->getMax(rangeName)) {
+	  in_range = false;
+	  break;
+	}
+	const RooAbsBinning& binning = i_obs->getBinning();
+	int i_bin = binning.binNumber(x);
+	volume *= binning.binWidth(i_bin);
+	centre.push_back(x);
+	low.push_back(binning.binLow(i_bin));
+	high.push_back(binning.binHigh(i_bin));
+      }
+      if (in_range) {
+	counts.push_back(count);
+	_binCentres.push_back(centre);
+	_binVolumes.push_back(volume);
+	_binLows.push_back(low);
+	_binHighs.push_back(high);
+      }
+    }
+    _kernel = roofitter::BinnedPoissonKernel(counts, model.pdfList().getSize());
+
+    // Each bin's range for the bin integrals
+    if (_integrateBins) {
+      for (size_t i_bin = 0; i_bin < _binCentres.size(); ++i_bin) {
+	std::string bin_range = std::string(GetName()) + "_bin" + std::to_string(i_bin);
+	for (size_t i_obs = 0; i_obs < _obs.size(); ++i_obs) {
+	  _obs[i_obs]->setRange(bin_range.c_str(), _binLows[i_bin][i_obs], _binHighs[i_bin][i_obs]);
+	}
+	_binRanges.push_back(bin_range);
+      }
+    }
+
+    // The shape parameters of every component (parameters can be shared between components)
+    for (int i_comp = 0; i_comp < _pdfs.getSize(); ++i_comp) {
+      std::unique_ptr<RooArgSet> param_set(_pdfs.at(i_comp)->getParameters(observables));
+      RooArgList params(*param_set);
+      for (int i_param = 0; i_param < params.getSize(); ++i_param) {
+	if (!_params.find(params.at(i_param)->GetName())) {
+	  _params.add(*params.at(i_param));
+	}
+      }
+    }
+    _yields.resize(_pdfs.getSize());
+  }
+
+  RooBinnedPoissonNLL(const RooBinnedPoissonNLL& other, const char* name=0) :
+    RooAbsReal(other,name),
+    _coefs("coefs",this,other._coefs),
+    _params("params",this,other._params),
+    _pdfs("pdfs",this,other._pdfs),
+    _rangeName(other._rangeName),
+    _binRanges(other._binRanges),
+    _obsNames(other._obsNames),
+    _binCentres(other._binCentres),
+    _binVolumes(other._binVolumes),
+    _binLows(other._binLows),
+    _binHighs(other._binHighs),
+    _integrateBins(other._integrateBins),
+    _kernel(other._kernel),
+    _componentsValid(false),
+    _yields(other._yields),
+    _nEvaluations(0)
+  { }
+
+  virtual TObject* clone(const char* newname) const { return new RooBinnedPoissonNLL(*this,newname); }
+  inline virtual ~RooBinnedPoissonNLL() { }
+
+  // This is a -log(L) so 0.5 is one sigma
+  virtual Double_t defaultErrorLevel() const { return 0.5; }
+
+  size_t nBins() const { return _kernel.nBins(); }
+  size_t nComponents() const { return _pdfs.getSize(); }
+
+  // True if the component has no floating shape parameters (so it can be treated as a fixed template)
+  bool hasFixedShape(size_t i_comp) const {
+    const RooArgList& params = components()[i_comp].params;
+    for (int i_param = 0; i_param < params.getSize(); ++i_param) {
+      if (!params.at(i_param)->isConstant()) {
+	return false;
+      }
+    }
+    return true;
+  }
+  bool hasFixedShapes() const {
+    for (size_t i_comp = 0; i_comp < nComponents(); ++i_comp) {
+      if (!hasFixedShape(i_comp)) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  // The same for the components of a model that doesn't have an NLL yet (so that one isn't made just to find out)
+  static bool hasFixedShapes(const RooAddPdf& model, const RooArgSet& observables) {
+    for (int i_comp = 0; i_comp < model.pdfList().getSize(); ++i_comp) {
+      std::unique_ptr<RooArgSet> param_set(model.pdfList().at(i_comp)->getParameters(observables));
+      RooArgList params(*param_set);
+      for (int i_param = 0; i_param < params.getSize(); ++i_param) {
+	if (!params.at(i_param)->isConstant()) {
+	  return false;
+	}
+      }
+    }
+    return true;
+  }
+
+  // The yield of each component
+  const RooArgList& coefList() const { return _coefs; }
+  size_t nEvaluations() const { return _nEvaluations; }
+
+  // The kernel with every component's fractions up-to-date for the current parameter values
+  const roofitter::BinnedPoissonKernel& kernel() const {
+    components();
+    for (size_t i_comp = 0; i_comp < _components.size(); ++i_comp) {
+      if (shapeChanged(i_comp)) {
+	fillFractions(i_comp);
+      }
+    }
+    return _kernel;
+  }
+
+protected:
+
+  RooListProxy _coefs ;
+  RooListProxy _params ;
+  RooListProxy _pdfs ;
+  std::string _rangeName ;
+  std::vector<std::string> _binRanges ;
+
+  Double_t evaluate() const {
+    ++_nEvaluations;
+    const roofitter::BinnedPoissonKernel& kernel = this->kernel();
+    for (size_t i_comp = 0; i_comp < _components.size(); ++i_comp) {
+      _yields[i_comp] = static_cast<RooAbsReal&>(_coefs[i_comp]).getVal();
+    }
+    return kernel.nll(&_yields[0]);
+  }
+
+  virtual Bool_t redirectServersHook(const RooAbsCollection& newServerList, Bool_t mustReplaceAll, Bool_t nameChange, Bool_t isRecursive) {
+    _componentsValid = false;
+    return RooAbsReal::redirectServersHook(newServerList, mustReplaceAll, nameChange, isRecursive);
+  }
+
+private:
+
+  struct ComponentCache {
+    RooAbsPdf* pdf;
+    RooArgList params;
+    std::vector<double> lastValues;
+    std::unique_ptr<RooAbsReal> fitIntegral; // fraction of the PDF inside the fit range
+    std::vector< std::unique_ptr<RooAbsReal> > binIntegrals; // fraction of the PDF inside each bin (variable binning only)
+    bool valid;
+  };
+
+  // Finds the observables by name among the variables of the PDFs in _pdfs
+  void findObservables() const {
+    _obs.clear();
+    _normSet.removeAll();
+    for (const auto& i_obs_name : _obsNames) {
+      RooRealVar* obs = 0;
+      for (int i_comp = 0; !obs && i_comp < _pdfs.getSize(); ++i_comp) {
+	std::unique_ptr<RooArgSet> vars(_pdfs.at(i_comp)->getVariables());
+	obs = dynamic_cast<RooRealVar*>(vars->find(i_obs_name.c_str()));
+      }
+      if (!obs) {
+	throw std::runtime_error(std::string("RooBinnedPoissonNLL: ") + GetName() + " has no PDF that depends on observable " + i_obs_name);
+      }
+      _obs.push_back(obs);
+      _normSet.add(*obs);
+    }
+  }
+
+  // (Re)makes the caches for the PDFs in _pdfs, with their own integrals
+  const std::vector<ComponentCache>& components() const {
+    if (_componentsValid) {
+      return _components;
+    }
+    findObservables();
+    _components.clear();
+    for (int i_comp = 0; i_comp < _pdfs.getSize(); ++i_comp) {
+      ComponentCache comp;
+      comp.pdf = static_cast<RooAbsPdf*>(_pdfs.at(i_comp));
+      std::unique_ptr<RooArgSet> params(comp.pdf->getParameters(_normSet));
+      comp.params.add(*params);
+      comp.fitIntegral.reset(comp.pdf->createIntegral(_normSet, RooFit::NormSet(_normSet), RooFit::Range(_rangeName.empty() ? 0 : _rangeName.c_str())));
+      for (const auto& i_bin_range : _binRanges) {
+	comp.binIntegrals.push_back(std::unique_ptr<RooAbsReal>(comp.pdf->createIntegral(_normSet, RooFit::NormSet(_normSet), RooFit::Range(i_bin_range.c_str()))));
+      }
+      comp.valid = false;
+      _components.push_back(std::move(comp));
+    }
+    _componentsValid = true;
+    return _components;
+  }
+
+  bool shapeChanged(size_t i_comp) const {
+    ComponentCache& comp = _components[i_comp];
+    if (!comp.valid) {
+      return true;
+    }
+    for (int i_param = 0; i_param < comp.params.getSize(); ++i_param) {
+      if (static_cast<RooAbsReal*>(comp.params.at(i_param))->getVal() != comp.lastValues[i_param]) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  // Evaluates the component at each bin centre (or integrates it over each bin), normalised to the fit range
+  void fillFractions(size_t i_comp) const {
+    ComponentCache& comp = _components[i_comp];
+    double fit_fraction = comp.fitIntegral->getVal();
+    double* fractions = _kernel.fractions(i_comp);
+    if (_integrateBins) {
+      for (size_t i_bin = 0; i_bin < comp.binIntegrals.size(); ++i_bin) {
+	fractions[i_bin] = comp.binIntegrals[i_bin]->getVal() / fit_fraction;
+      }
+    }
+    else {
+      for (size_t i_bin = 0; i_bin < _binCentres.size(); ++i_bin) {
+	for (size_t i_obs = 0; i_obs < _obs.size(); ++i_obs) {
+	  _obs[i_obs]->setVal(_binCentres[i_bin][i_obs]);
+	}
+	fractions[i_bin] = comp.pdf->getVal(&_normSet) * _binVolumes[i_bin] / fit_fraction;
+      }
+    }
+
+    comp.lastValues.clear();
+    for (int i_param = 0; i_param < comp.params.getSize(); ++i_param) {
+      comp.lastValues.push_back(static_cast<RooAbsReal*>(comp.params.at(i_param))->getVal());
+    }
+    comp.valid = true;
+  }
+
+  std::vector<std::string> _obsNames ;
+  mutable std::vector<RooRealVar*> _obs ; //! belong to the PDFs in _pdfs
+  mutable RooArgSet _normSet ; //!
+  std::vector< std::vector<double> > _binCentres ; //!
+  std::vector<double> _binVolumes ; //!
+  std::vector< std::vector<double> > _binLows ; //!
+  std::vector< std::vector<double> > _binHighs ; //!
+  bool _integrateBins ; //!
+  mutable roofitter::BinnedPoissonKernel _kernel ; //!
+  mutable bool _componentsValid ; //!
+  mutable std::vector<ComponentCache> _components ; //!
+  mutable std::vector<double> _yields ; //!
+  mutable size_t _nEvaluations ; //!
+
+  ClassDef(RooBinnedPoissonNLL,1) // Extended binned Poisson NLL for template-like fits
+};
+
+#endif
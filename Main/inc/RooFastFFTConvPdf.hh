@@ -0,0 +1,284 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * FFT convolution of a 1D PDF with a shared response model                  *
+ *****************************************************************************/
+
+#ifndef RooFastFFTConvPdf_h_
+#define RooFastFFTConvPdf_h_
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include <complex>
+#include <sstream>
+#include <algorithm>
+
+#include "RooAbsPdf.h"
+#include "RooRealProxy.h"
+#include "RooRealVar.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooAbsBinning.h"
+
+#include "Main/inc/FFTPlan.hh"
+#include "Main/inc/CubicTable.hh"
+
+// The convolution of a true PDF (pdf1) with a response model (pdf2) in x, like FCONV (RooFFTConvPdf),
+// for when several PDFs are convolved with the same response on the same grid (e.g. every component with dscb_tq08 in mom):
+//  - both PDFs are sampled on the nBins+1 edges of x's "cache" binning (or its default binning), extended on each
+//    side by bufferFraction/2 of the range so that the convolution doesn't wrap around
+//  - the TVirtualFFT plans for each grid size are shared by every convolution (FFTPlan), and FFTW can split
+//    each transform over nThreads threads
+//  - the transformed response is kept in a process-wide cache (FFTSpectrumCache) keyed by the response's parameter
+//    values and the grid, so it is only calculated once for all the PDFs that use it
+//  - the result is interpolated (and integrated) with a cubic between the grid points, as in RooTabulatedPdf
+// The convolution is recalculated whenever a parameter of either PDF changes (copies keep it until then).
+// The PDFs are sampled through private copies of their graphs that have their own copy of x (with a range that
+// covers the buffer) but share the PDFs' parameters, so x itself (and its other clients) are never touched
+class RooFastFFTConvPdf : public RooAbsPdf {
+public:
+  RooFastFFTConvPdf() : _nBins(0), _xlo(0), _xhi(0), _bufferFraction(0), _nThreads(1), _paramsFound(false), _trueX(0), _respX(0) {} ;
+  RooFastFFTConvPdf(const char *name, const char *title,
+		    RooRealVar& _x,
+		    RooAbsPdf& _pdf1,
+		    RooAbsPdf& _pdf2,
+		    Double_t bufferFraction,
+		    Int_t nThreads = 1) :
+    RooAbsPdf(name,title),
+    x("x","x",this,_x),
+    pdf1("pdf1","pdf1",this,_pdf1),
+    pdf2("pdf2","pdf2",this,_pdf2),
+    _nBins(std::max(_x.getBinning("cache", kFALSE).numBins(), 2)),
+    _xlo(_x.getMin()),
+    _xhi(_x.getMax()),
+    _bufferFraction(std::max(bufferFraction, 0.0)),
+    _nThreads(std::max(nThreads, 1)),
+    _paramsFound(false),
+    _trueX(0),
+    _respX(0)
+  { }
+
+  RooFastFFTConvPdf(const RooFastFFTConvPdf& other, const char* name=0) :
+    RooAbsPdf(other,name),
+    x("x",this,other.x),
+    pdf1("pdf1",this,other.pdf1),
+    pdf2("pdf2",this,other.pdf2),
+    _nBins(other._nBins),
+    _xlo(other._xlo),
+    _xhi(other._xhi),
+    _bufferFraction(other._bufferFraction),
+    _nThreads(other._nThreads),
+    _paramsFound(false),
+    _trueNames(other._trueNames),
+    _trueValues(other._trueValues),
+    _respNames(other._respNames),
+    _respValues(other._respValues),
+    _respSpectrum(other._respSpectrum),
+    _table(other._table),
+    _trueX(0),
+    _respX(0)
+  { }
+
+  virtual TObject* clone(const char* newname) const { return new RooFastFFTConvPdf(*this,newname); }
+  inline virtual ~RooFastFFTConvPdf() { }
+
+  Int_t getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* /*rangeName*/=0) const {
+    if (matchArgs(allVars, analVars, x)) {
+      return 1;
+    }
+    return 0;
+  }
+
+  Double_t analyticalIntegral(Int_t code, const char* rangeName=0) const {
+    R__ASSERT(code==1);
+    updateTable();
+    return _table.cumulative(x.max(rangeName)) - _table.cumulative(x.min(rangeName));
+  }
+
+  Double_t bufferFraction() const { return _bufferFraction; }
+  Int_t getNBins() const { return _nBins; }
+  Int_t getNThreads() const { return _nThreads; }
+
+  // The number of points that are transformed (the grid plus the buffer)
+  Int_t getGridSize() const { return _nBins + 1 + 2*nBuffer(); }
+
+protected:
+
+  RooRealProxy x ;
+  RooRealProxy pdf1 ;
+  RooRealProxy pdf2 ;
+  Int_t _nBins ;
+  Double_t _xlo ;
+  Double_t _xhi ;
+  Double_t _bufferFraction ;
+  Int_t _nThreads ;
+
+  Double_t evaluate() const {
+    if (x < _xlo || x > _xhi) {
+      return 0;
+    }
+    updateTable();
+    return _table.value(x);
+  }
+
+  // The parameters (and so the samplers) have to be found again if this is attached to different servers
+  virtual Bool_t redirectServersHook(const RooAbsCollection& newServerList, Bool_t mustReplaceAll, Bool_t nameChange, Bool_t isRecursive) {
+    _paramsFound = false;
+    _trueSampler.reset();
+    _respSampler.reset();
+    _trueX = 0;
+    _respX = 0;
+    return RooAbsPdf::redirectServersHook(newServerList, mustReplaceAll, nameChange, isRecursive);
+  }
+
+private:
+
+  Int_t nBuffer() const { return static_cast<Int_t>(std::ceil(_bufferFraction * _nBins / 2)); }
+
+  // Finds pdf's parameters in the same order as the names that their values were remembered with
+  // (or all of them, forgetting the values, if they aren't all there)
+  void findParams(const RooAbsArg& pdf, RooArgList& params, std::vector<std::string>& names, std::vector<double>& values) const {
+    RooArgSet* all_params = pdf.getParameters(RooArgSet(x.arg()));
+    params.removeAll();
+    bool found_all = static_cast<int>(names.size()) == all_params->getSize();
+    for (size_t i_name = 0; found_all && i_name < names.size(); ++i_name) {
+      RooAbsArg* param = all_params->find(names[i_name].c_str());
+      if (!param) {
+	found_all = false;
+	break;
+      }
+      params.add(*param);
+    }
+    if (!found_all) {
+      params.removeAll();
+      params.add(*all_params);
+      names.clear();
+      values.assign(params.getSize()+1, 0); // can't match
+    }
+    delete all_params;
+  }
+
+  // A copy of pdf's graph that uses pdf's parameters but its own copy of x (returned in private_x) over [lo, hi]
+  RooAbsPdf* makeSampler(const RooAbsPdf& pdf, double lo, double hi, RooRealVar*& private_x) const {
+    RooAbsPdf* sampler = static_cast<RooAbsPdf*>(pdf.cloneTree());
+    std::unique_ptr<RooArgSet> params(pdf.getParameters(RooArgSet(x.arg())));
+    sampler->recursiveRedirectServers(*params);
+    std::unique_ptr<RooArgSet> sampler_vars(sampler->getVariables());
+    private_x = dynamic_cast<RooRealVar*>(sampler_vars->find(x.arg().GetName()));
+    if (!private_x) {
+      delete sampler;
+      throw std::invalid_argument(std::string("RooFastFFTConvPdf: ") + pdf.GetName() + " does not depend on " + x.arg().GetName());
+    }
+    private_x->setRange(lo, hi);
+    return sampler;
+  }
+
+  static bool paramsChanged(const RooArgList& params, const std::vector<double>& values) {
+    if (static_cast<int>(values.size()) != params.getSize()) {
+      return true;
+    }
+    for (size_t i_param = 0; i_param < values.size(); ++i_param) {
+      if (static_cast<RooAbsReal*>(params.at(i_param))->getVal() != values[i_param]) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  static void rememberParams(const RooArgList& params, std::vector<std::string>& names, std::vector<double>& values) {
+    names.clear();
+    values.clear();
+    for (int i_param = 0; i_param < params.getSize(); ++i_param) {
+      names.push_back(params.at(i_param)->GetName());
+      values.push_back(static_cast<RooAbsReal*>(params.at(i_param))->getVal());
+    }
+  }
+
+  // Everything that the transformed response depends on
+  std::string responseKey(size_t n_grid, double step) const {
+    std::stringstream key;
+    key << std::hexfloat << pdf2.arg().ClassName() << " " << pdf2.arg().GetName() << " \"" << pdf2.arg().GetTitle() << "\" in "
+	<< x.arg().GetName() << ": " << n_grid << " points of " << step;
+    for (int i_param = 0; i_param < _respParams.getSize(); ++i_param) {
+      key << " " << _respParams.at(i_param)->GetName() << "=" << static_cast<RooAbsReal*>(_respParams.at(i_param))->getVal();
+    }
+    return key.str();
+  }
+
+  void updateTable() const {
+    if (!_paramsFound) {
+      findParams(pdf1.arg(), _trueParams, _trueNames, _trueValues);
+      findParams(pdf2.arg(), _respParams, _respNames, _respValues);
+      _paramsFound = true;
+    }
+    bool resp_changed = _respSpectrum.empty() || paramsChanged(_respParams, _respValues);
+    if (!resp_changed && !_table.values().empty() && !paramsChanged(_trueParams, _trueValues)) {
+      return;
+    }
+
+    // The grid points below _xlo (the rest of the buffer is above _xhi)
+    double step = (_xhi - _xlo) / _nBins;
+    size_t n_grid = getGridSize();
+    size_t n_below = nBuffer();
+    std::shared_ptr<const roofitter::FFTPlan> plan = roofitter::FFTPlan::get(n_grid, _nThreads);
+    if (!_trueSampler) {
+      _trueSampler.reset(makeSampler(static_cast<const RooAbsPdf&>(pdf1.arg()), _xlo - n_below*step, _xlo + (n_grid - n_below)*step, _trueX));
+      _respSampler.reset(makeSampler(static_cast<const RooAbsPdf&>(pdf2.arg()), -(n_grid/2 + 1.0)*step, (n_grid/2 + 1.0)*step, _respX));
+    }
+
+    std::vector<double> conv(n_grid);
+    for (size_t i_point = 0; i_point < n_grid; ++i_point) {
+      _trueX->setVal(_xlo + (static_cast<double>(i_point) - static_cast<double>(n_below))*step);
+      conv[i_point] = _trueSampler->getVal();
+    }
+    if (resp_changed) {
+      std::string key = responseKey(n_grid, step);
+      if (!roofitter::FFTSpectrumCache::instance().find(key, _respSpectrum)) {
+	// offsets of 0, 1, ..., n_grid/2 and then -(n_grid-1)/2, ..., -1 steps (i.e. wrapped around like the transform)
+	std::vector<double> resp(n_grid);
+	for (size_t i_point = 0; i_point < n_grid; ++i_point) {
+	  double offset = i_point <= n_grid/2 ? static_cast<double>(i_point) : static_cast<double>(i_point) - static_cast<double>(n_grid);
+	  _respX->setVal(offset*step);
+	  resp[i_point] = _respSampler->getVal() * step;
+	}
+	plan->forward(resp, _respSpectrum);
+	roofitter::FFTSpectrumCache::instance().store(key, _respSpectrum);
+      }
+      rememberParams(_respParams, _respNames, _respValues);
+    }
+
+    std::vector< std::complex<double> > spectrum;
+    plan->forward(conv, spectrum);
+    for (size_t i_point = 0; i_point < spectrum.size(); ++i_point) {
+      spectrum[i_point] *= _respSpectrum[i_point];
+    }
+    plan->inverse(spectrum, conv);
+
+    std::vector<double> values(_nBins+1);
+    for (Int_t i_point = 0; i_point <= _nBins; ++i_point) {
+      values[i_point] = std::max(conv[n_below + i_point], 0.0);
+    }
+    _table.set(_xlo, _xhi, values);
+    rememberParams(_trueParams, _trueNames, _trueValues);
+  }
+
+  mutable bool _paramsFound ; //!
+  mutable RooArgList _trueParams ; //!
+  mutable std::vector<std::string> _trueNames ; //!
+  mutable std::vector<double> _trueValues ; //!
+  mutable RooArgList _respParams ; //!
+  mutable std::vector<std::string> _respNames ; //!
+  mutable std::vector<double> _respValues ; //!
+  mutable std::vector< std::complex<double> > _respSpectrum ; //!
+  mutable roofitter::CubicTable _table ; //!
+  mutable std::unique_ptr<RooAbsPdf> _trueSampler ; //!
+  mutable std::unique_ptr<RooAbsPdf> _respSampler ; //!
+  mutable RooRealVar* _trueX ; //! belongs to _trueSampler
+  mutable RooRealVar* _respX ; //! belongs to _respSampler
+
+  ClassDef(RooFastFFTConvPdf,2) // FFT convolution with shared plans and response transforms
+};
+
+#endif
@@ -0,0 +1,78 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * Sum of terms that are each evaluated in their own forked process          *
+ *****************************************************************************/
+
+#ifndef RooForkedSum_h_
+#define RooForkedSum_h_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "RooAbsReal.h"
+#include "RooRealMPFE.h"
+#include "RooListProxy.h"
+#include "RooArgList.h"
+
+// The sum of some terms (e.g. the RooBinnedPoissonNLL of each category in a simultaneous fit) where each term is
+// evaluated in its own forked server process through a RooRealMPFE, as RooFit does for the NumCPU option of fitTo.
+// Each evaluation sends the changed parameter values to every server and starts all the calculations before waiting
+// for any of them, so the terms are evaluated in parallel. The servers are started when this is constructed (so the
+// terms have to be complete by then). Minuit sees the terms' parameters as usual
+class RooForkedSum : public RooAbsReal {
+public:
+  RooForkedSum() { }
+  RooForkedSum(const char *name, const char *title, const RooArgList& terms) :
+    RooAbsReal(name,title),
+    _mpfes("mpfes","mpfes",this)
+  {
+    for (int i_term = 0; i_term < terms.getSize(); ++i_term) {
+      RooAbsReal* term = static_cast<RooAbsReal*>(terms.at(i_term));
+      std::string mpfe_name = std::string(GetName()) + "_" + term->GetName();
+      _ownedMpfes.push_back(std::make_shared<RooRealMPFE>(mpfe_name.c_str(), mpfe_name.c_str(), *term, kFALSE));
+      _ownedMpfes.back()->initialize();
+      _mpfes.add(*_ownedMpfes.back());
+    }
+  }
+
+  // A copy shares the original's servers (which stop when the last of them is destroyed)
+  RooForkedSum(const RooForkedSum& other, const char* name=0) :
+    RooAbsReal(other,name),
+    _mpfes("mpfes",this,other._mpfes),
+    _ownedMpfes(other._ownedMpfes)
+  { }
+
+  virtual TObject* clone(const char* newname) const { return new RooForkedSum(*this,newname); }
+  inline virtual ~RooForkedSum() { }
+
+  // The terms are -log(L)s
+  virtual Double_t defaultErrorLevel() const { return 0.5; }
+
+protected:
+
+  RooListProxy _mpfes ;
+
+  Double_t evaluate() const {
+    for (int i_term = 0; i_term < _mpfes.getSize(); ++i_term) {
+      RooRealMPFE* mpfe = static_cast<RooRealMPFE*>(_mpfes.at(i_term));
+      if (mpfe->isValueDirty()) {
+	mpfe->calculate();
+      }
+    }
+    double sum = 0;
+    for (int i_term = 0; i_term < _mpfes.getSize(); ++i_term) {
+      sum += static_cast<RooRealMPFE*>(_mpfes.at(i_term))->getVal();
+    }
+    return sum;
+  }
+
+private:
+
+  std::vector< std::shared_ptr<RooRealMPFE> > _ownedMpfes ; //!
+
+  ClassDef(RooForkedSum,1) // Sum of terms evaluated in parallel forked processes
+};
+
+#endif
@@ -0,0 +1,347 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * Deterministic adaptive 7/15-point Gauss-Kronrod integrator                *
+ *****************************************************************************/
+
+#ifndef RooGKSingularIntegrator1D_h_
+#define RooGKSingularIntegrator1D_h_
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <list>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "RooAbsIntegrator.h"
+#include "RooAbsFunc.h"
+#include "RooAbsCategory.h"
+#include "RooNumIntConfig.h"
+#include "RooNumIntFactory.h"
+#include "RooRealVar.h"
+#include "RooArgSet.h"
+#include "RooArgList.h"
+#include "RooNumber.h"
+#include "RooMsgService.h"
+
+// A replacement for RooMCIntegrator for PDFs like RooCeMPdf that diverge inside the range (at eMax).
+// The range is split adaptively (always bisecting the panel with the largest error estimate) until
+// the total error is below the tolerance in the RooNumIntConfig or there are maxSeg panels. Panels stop
+// being split once they are smaller than minWidth (relative to the full range): such a panel is around a
+// singularity, so it is split at the node where the function was largest (or not finite) and each side is
+// integrated with the substitution x = p +/- w u^2, which puts the nodes close to (but never at) that point and
+// makes integrable singularities there finite. The result is always the same for the same function. If the
+// tolerance isn't met (e.g. for a singularity whose integral diverges, as 1/(eMax - E) does, so that the result
+// depends on minWidth and maxSeg) a warning with the estimated error is printed the first time it happens.
+//
+// Each integrator (i.e. each integral of one function) can memoize its results. Component registers the parameters
+// of each PDF that it gives this integrator (see memoParameters()) and passes their id in the "memoId" config value.
+// The key is then the value of every one of those parameters and the limits, so a normalisation integral that Minuit
+// (or the unfolding) asks for again with the same parameter values costs nothing. The least recently used results are
+// dropped once there are more than maxMemoSize(). Without a memoId nothing is memoized.
+class RooGKSingularIntegrator1D : public RooAbsIntegrator {
+public:
+  // The parameters registered for memoization, which are forgotten when the last copy of it goes
+  class MemoParams {
+  private:
+    int _id;
+  public:
+    MemoParams(const RooArgSet& params) : _id(++lastMemoId()) { memoRegistry()[_id].add(params); }
+    MemoParams(const MemoParams&) = delete;
+    MemoParams& operator=(const MemoParams&) = delete;
+    ~MemoParams() { memoRegistry().erase(_id); }
+    int id() const { return _id; }
+  };
+
+  // Registers params as everything that the integrals of a function depend on (apart from the integration variable)
+  static std::shared_ptr<MemoParams> memoParameters(const RooArgSet& params) {
+    return std::make_shared<MemoParams>(params);
+  }
+
+  RooGKSingularIntegrator1D() : _useIntegrandLimits(kTRUE), _xmin(0), _xmax(0), _epsAbs(1e-7), _epsRel(1e-7), _maxSeg(100), _minWidth(1e-10), _memoId(0), _warned(false) { }
+
+  RooGKSingularIntegrator1D(const RooAbsFunc& function, const RooNumIntConfig& config) :
+    RooAbsIntegrator(function),
+    _useIntegrandLimits(kTRUE),
+    _xmin(0),
+    _xmax(0),
+    _epsAbs(config.epsAbs()),
+    _epsRel(config.epsRel()),
+    _warned(false)
+  {
+    const RooArgSet& section = config.getConfigSection(IsA()->GetName());
+    _maxSeg = static_cast<Int_t>(section.getRealValue("maxSeg", 100));
+    _minWidth = section.getRealValue("minWidth", 1e-10);
+    _memoId = static_cast<int>(section.getRealValue("memoId", 0));
+    _x.resize(_function->getDimension(), 0.0);
+    _valid = checkLimits();
+  }
+
+  virtual RooAbsIntegrator* clone(const RooAbsFunc& function, const RooNumIntConfig& config) const {
+    return new RooGKSingularIntegrator1D(function, config);
+  }
+  virtual ~RooGKSingularIntegrator1D() { }
+
+  static void registerIntegrator(RooNumIntFactory& fact) {
+    if (fact.getProtoIntegrator("RooGKSingularIntegrator1D")) {
+      return;
+    }
+    RooRealVar maxSeg("maxSeg", "Maximum number of panels", 100);
+    RooRealVar minWidth("minWidth", "Smallest panel width (relative to the integration range)", 1e-10);
+    RooRealVar memoId("memoId", "Id of the parameters registered with memoParameters() (0 to not memoize)", 0);
+    fact.storeProtoIntegrator(new RooGKSingularIntegrator1D(), RooArgSet(maxSeg, minWidth, memoId));
+  }
+
+  virtual Bool_t checkLimits() const {
+    if (_useIntegrandLimits) {
+      _xmin = integrand()->getMinLimit(0);
+      _xmax = integrand()->getMaxLimit(0);
+    }
+    if (_xmax < _xmin) {
+      return kFALSE;
+    }
+    return !(RooNumber::isInfinite(_xmin) || RooNumber::isInfinite(_xmax));
+  }
+
+  virtual Bool_t setLimits(Double_t* xmin, Double_t* xmax) {
+    if (_useIntegrandLimits) {
+      return kFALSE;
+    }
+    _xmin = *xmin;
+    _xmax = *xmax;
+    return checkLimits();
+  }
+  virtual Bool_t setUseIntegrandLimits(Bool_t flag) { _useIntegrandLimits = flag; return kTRUE; }
+
+  virtual Double_t integral(const Double_t* yvec=0) {
+    if (!checkLimits()) {
+      return 0;
+    }
+    for (size_t i_dim = 1; i_dim < _x.size(); ++i_dim) {
+      _x[i_dim] = yvec ? yvec[i_dim-1] : 0;
+    }
+    if (_xmax == _xmin) {
+      return 0;
+    }
+
+    MemoKey key;
+    bool memoize = memoKey(key);
+    if (memoize) {
+      auto i_memo = _memo.find(key);
+      if (i_memo != _memo.end()) {
+	_memoOrder.splice(_memoOrder.end(), _memoOrder, i_memo->second.second); // now the most recently used
+	return i_memo->second.first;
+      }
+    }
+
+    double min_width = _minWidth*(_xmax - _xmin);
+    double settled_value = 0;
+    double settled_error = 0;
+    std::vector<Panel> panels;
+    auto add_panel = [&](const Panel& panel) {
+      if (panel.high - panel.low < min_width) {
+	// integrate up to the peak from either side
+	if (panel.peak > panel.low) {
+	  Panel below = evaluatePanel(panel.low, panel.peak, +1);
+	  settled_value += below.value;
+	  settled_error += below.error;
+	}
+	if (panel.peak < panel.high) {
+	  Panel above = evaluatePanel(panel.peak, panel.high, -1);
+	  settled_value += above.value;
+	  settled_error += above.error;
+	}
+      }
+      else {
+	panels.push_back(panel);
+	std::push_heap(panels.begin(), panels.end());
+      }
+    };
+    add_panel(evaluatePanel(_xmin, _xmax, 0));
+
+    Int_t n_panels = 1;
+    double value = 0;
+    double error = 0;
+    bool converged = false;
+    while (true) {
+      value = settled_value;
+      error = settled_error;
+      for (const auto& i_panel : panels) {
+	value += i_panel.value;
+	error += i_panel.error;
+      }
+      converged = (error <= std::max(_epsAbs, _epsRel*std::fabs(value)));
+      if (converged || panels.empty() || n_panels >= _maxSeg) {
+	break;
+      }
+
+      // Bisect the panel with the largest error
+      std::pop_heap(panels.begin(), panels.end());
+      Panel worst = panels.back();
+      panels.pop_back();
+      double mid = 0.5*(worst.low + worst.high);
+      add_panel(evaluatePanel(worst.low, mid, 0));
+      add_panel(evaluatePanel(mid, worst.high, 0));
+      ++n_panels;
+    }
+
+    if (!converged && !_warned) {
+      coutW(Integration) << "RooGKSingularIntegrator1D: integral of " << integrand()->getName() << " from " << _xmin << " to " << _xmax
+			 << " did not converge (" << value << " +/- " << error << " after " << n_panels << " panels)."
+			 << " If the function has a singularity whose integral diverges then the result depends on minWidth and maxSeg" << std::endl;
+      _warned = true;
+    }
+    double result = value;
+    if (memoize) {
+      _memo[key] = std::make_pair(result, _memoOrder.insert(_memoOrder.end(), key));
+      if (_memo.size() > maxMemoSize()) {
+	_memo.erase(_memoOrder.front());
+	_memoOrder.pop_front();
+      }
+    }
+    return result;
+  }
+
+  virtual Bool_t canIntegrate1D() const { return kTRUE; }
+  virtual Bool_t canIntegrate2D() const { return kFALSE; }
+  virtual Bool_t canIntegrateND() const { return kFALSE; }
+  virtual Bool_t canIntegrateOpenEnded() const { return kFALSE; }
+
+  static size_t maxMemoSize() { return 10000; }
+
+private:
+
+  struct Panel {
+    double low;
+    double high;
+    double value;
+    double error;
+    double peak; // where the function was largest (or not finite)
+    bool operator<(const Panel& other) const { return error < other.error; }
+  };
+
+  static int& lastMemoId() {
+    static int id = 0;
+    return id;
+  }
+  static std::map<int, RooArgList>& memoRegistry() {
+    static std::map<int, RooArgList> registry;
+    return registry;
+  }
+
+  typedef std::vector<double> MemoKey;
+
+  // The registered parameter values and the limits (false if no parameters have been registered for this integrator)
+  bool memoKey(MemoKey& key) const {
+    auto i_params = memoRegistry().find(_memoId);
+    if (i_params == memoRegistry().end()) {
+      return false;
+    }
+    const RooArgList& params = i_params->second;
+    key.clear();
+    for (int i_param = 0; i_param < params.getSize(); ++i_param) {
+      const RooAbsArg* param = params.at(i_param);
+      if (const RooAbsReal* real = dynamic_cast<const RooAbsReal*>(param)) {
+	key.push_back(real->getVal());
+      }
+      else if (const RooAbsCategory* cat = dynamic_cast<const RooAbsCategory*>(param)) {
+	key.push_back(cat->getIndex());
+      }
+    }
+    key.push_back(_xmin);
+    key.push_back(_xmax);
+    key.insert(key.end(), _x.begin()+1, _x.end());
+    return true;
+  }
+
+  double evaluate(double x) {
+    _x[0] = x;
+    return integrand(&_x[0]);
+  }
+
+  // Applies the 7-point Gauss and 15-point Kronrod rules to [low, high]. If pole_side is -1 (+1) then the nodes
+  // are spread out with x = low + w u^2 (x = high - w u^2) for u in [0, 1] to cope with a singularity at low (high)
+  Panel evaluatePanel(double low, double high, int pole_side) {
+    static const double xgk[8] = { 0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+				   0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+				   0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+				   0.207784955007898467600689403773245, 0.000000000000000000000000000000000 };
+    static const double wgk[8] = { 0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+				   0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+				   0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+				   0.204432940075298892414161999234649, 0.209482141084727828012999174891714 };
+    static const double wg[4] = { 0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+				  0.381830050505118944950369775488975, 0.417959183673469387755102040816327 };
+
+    double centre = 0.5*(low + high);
+    double half_width = 0.5*(high - low);
+    bool singular = false;
+    double peak = centre;
+    double peak_value = -1;
+    // The function times dx/dt at t in [-1, 1]
+    auto value_at = [&](double t) {
+      double x = centre + half_width*t;
+      double jacobian = half_width;
+      if (pole_side != 0) {
+	double u = 0.5*(1 + t);
+	x = (pole_side < 0) ? low + (high - low)*u*u : high - (high - low)*u*u;
+	jacobian = (high - low)*u;
+      }
+      double value = evaluate(x);
+      if (!std::isfinite(value)) {
+	singular = true;
+	peak = x;
+	peak_value = std::numeric_limits<double>::infinity();
+	return 0.0;
+      }
+      if (std::fabs(value) > peak_value) {
+	peak = x;
+	peak_value = std::fabs(value);
+      }
+      return value*jacobian;
+    };
+
+    double f_centre = value_at(0);
+    double kronrod = wgk[7]*f_centre;
+    double gauss = wg[3]*f_centre;
+    for (int i_node = 0; i_node < 7; ++i_node) {
+      double f_low = value_at(-xgk[i_node]);
+      double f_high = value_at(xgk[i_node]);
+      kronrod += wgk[i_node]*(f_low + f_high);
+      if (i_node % 2 == 1) {
+	gauss += wg[i_node/2]*(f_low + f_high);
+      }
+    }
+
+    Panel panel;
+    panel.low = low;
+    panel.high = high;
+    panel.value = kronrod;
+    panel.error = std::fabs(kronrod - gauss);
+    panel.peak = peak;
+    if (singular) { // make sure this panel gets split
+      panel.error = std::max(panel.error, std::fabs(panel.value)) + _epsAbs;
+    }
+    return panel;
+  }
+
+  Bool_t _useIntegrandLimits;
+  mutable Double_t _xmin;
+  mutable Double_t _xmax;
+  Double_t _epsAbs;
+  Double_t _epsRel;
+  Int_t _maxSeg;
+  Double_t _minWidth;
+  int _memoId;
+  bool _warned; //!
+  std::vector<double> _x; //!
+  std::map< MemoKey, std::pair< double, std::list<MemoKey>::iterator > > _memo; //!
+  std::list<MemoKey> _memoOrder; //! least recently used first
+
+  ClassDef(RooGKSingularIntegrator1D,0) // Deterministic adaptive Gauss-Kronrod integrator with memoization
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * Caches a 1D PDF on a grid and evaluates it by cubic interpolation         *
+ *****************************************************************************/
+
+#ifndef RooTabulatedPdf_h_
+#define RooTabulatedPdf_h_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "RooAbsPdf.h"
+#include "RooRealProxy.h"
+#include "RooRealVar.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+
+#include "Main/inc/CubicTable.hh"
+
+// Wraps an expensive 1D PDF (e.g. RooCeMPdf or RooRPCPdf) whose parameters rarely change.
+// The wrapped PDF is evaluated on a grid of nPoints+1 points across the range of x and then:
+//  - evaluate() uses a monotone cubic Hermite interpolation between the grid points (see CubicTable)
+//  - the integral over any range inside the grid comes from the cumulative integral of that same cubic,
+//    so normalisation and range integrals are exact for the interpolated shape
+// The table is rebuilt whenever one of the wrapped PDF's parameters changes (copies, e.g. the clones
+// RooFit makes for a fit, keep the table until then). It can also be filled from outside with setTable()
+// (e.g. from TemplateCache) so that the wrapped PDF is never evaluated if its parameters don't change.
+// Outside the tabulated range the wrapped PDF is evaluated directly (e.g. in the buffer of a response convolution),
+// so only integrals over ranges inside the grid are analytical and RooFit integrates any others numerically.
+class RooTabulatedPdf : public RooAbsPdf {
+public:
+  RooTabulatedPdf() : _nPoints(0), _xlo(0), _xhi(0), _valid(false), _paramsFound(false) {} ;
+  RooTabulatedPdf(const char *name, const char *title,
+		  RooRealVar& _x,
+		  RooAbsPdf& _pdf,
+		  Int_t nPoints) :
+    RooAbsPdf(name,title),
+    x("x","x",this,_x),
+    pdf("pdf","pdf",this,_pdf),
+    _nPoints(std::max(nPoints, 4)),
+    _xlo(_x.getMin()),
+    _xhi(_x.getMax()),
+    _valid(false),
+    _paramsFound(false)
+  { }
+
+  RooTabulatedPdf(const RooTabulatedPdf& other, const char* name=0) :
+    RooAbsPdf(other,name),
+    x("x",this,other.x),
+    pdf("pdf",this,other.pdf),
+    _nPoints(other._nPoints),
+    _xlo(other._xlo),
+    _xhi(other._xhi),
+    _valid(other._valid),
+    _paramsFound(false),
+    _paramNames(other._paramNames),
+    _paramValues(other._paramValues),
+    _table(other._table)
+  { }
+
+  virtual TObject* clone(const char* newname) const { return new RooTabulatedPdf(*this,newname); }
+  inline virtual ~RooTabulatedPdf() { }
+
+  Int_t getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* rangeName=0) const {
+    if (x.min(rangeName) >= _xlo && x.max(rangeName) <= _xhi && matchArgs(allVars, analVars, x)) {
+      return 1;
+    }
+    return 0;
+  }
+
+  Double_t analyticalIntegral(Int_t code, const char* rangeName=0) const {
+    R__ASSERT(code==1);
+    updateTable();
+    return _table.cumulative(x.max(rangeName)) - _table.cumulative(x.min(rangeName));
+  }
+
+  Int_t getNPoints() const { return _nPoints; }
+
+  // The values at the nPoints+1 grid points (tabulating the wrapped PDF first if needed)
+  const std::vector<double>& getTable() const {
+    updateTable();
+    return _table.values();
+  }
+
+  // Uses these values at the grid points for the current parameter values instead of evaluating the wrapped PDF
+  void setTable(const std::vector<double>& values) {
+    if (values.size() != static_cast<size_t>(_nPoints+1)) {
+      throw std::invalid_argument("RooTabulatedPdf::setTable(): wrong number of values");
+    }
+    findParams();
+    _table.set(_xlo, _xhi, values);
+    rememberParams();
+  }
+
+protected:
+
+  RooRealProxy x ;
+  RooRealProxy pdf ;
+  Int_t _nPoints ;
+  Double_t _xlo ;
+  Double_t _xhi ;
+
+  Double_t evaluate() const {
+    if (x < _xlo || x > _xhi) {
+      return pdf.arg().getVal(); // unnormalised like the table
+    }
+    updateTable();
+    return _table.value(x);
+  }
+
+private:
+
+  // Finds the wrapped PDF's parameters in the same order as the parameter values we were copied with
+  void findParams() const {
+    RooArgSet* params = pdf.arg().getParameters(RooArgSet(x.arg()));
+    _params.removeAll();
+    bool found_all = _valid;
+    for (size_t i_name = 0; found_all && i_name < _paramNames.size(); ++i_name) {
+      RooAbsArg* param = params->find(_paramNames[i_name].c_str());
+      if (!param) {
+	found_all = false;
+	break;
+      }
+      _params.add(*param);
+    }
+    if (!found_all) {
+      _valid = false;
+      _params.removeAll();
+      _params.add(*params);
+    }
+    delete params;
+    _paramsFound = true;
+  }
+
+  bool parametersChanged() const {
+    if (!_valid) {
+      return true;
+    }
+    for (size_t i_param = 0; i_param < _paramValues.size(); ++i_param) {
+      if (static_cast<RooAbsReal*>(_params.at(i_param))->getVal() != _paramValues[i_param]) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void updateTable() const {
+    if (!_paramsFound) {
+      findParams();
+    }
+    if (!parametersChanged()) {
+      return;
+    }
+
+    double step = (_xhi - _xlo) / _nPoints;
+    std::vector<double> values(_nPoints+1);
+    RooRealVar& x_var = const_cast<RooRealVar&>(static_cast<const RooRealVar&>(x.arg()));
+    double x_saved = x_var.getVal();
+    for (Int_t i_point = 0; i_point <= _nPoints; ++i_point) {
+      x_var.setVal(_xlo + i_point*step);
+      values[i_point] = pdf.arg().getVal();
+    }
+    x_var.setVal(x_saved);
+    _table.set(_xlo, _xhi, values);
+    rememberParams();
+  }
+
+  // Remembers the parameters that the table is for
+  void rememberParams() const {
+    _paramNames.clear();
+    _paramValues.clear();
+    for (int i_param = 0; i_param < _params.getSize(); ++i_param) {
+      _paramNames.push_back(_params.at(i_param)->GetName());
+      _paramValues.push_back(static_cast<RooAbsReal*>(_params.at(i_param))->getVal());
+    }
+    _valid = true;
+  }
+
+  mutable bool _valid ; //!
+  mutable bool _paramsFound ; //!
+  mutable RooArgList _params ; //!
+  mutable std::vector<std::string> _paramNames ; //!
+  mutable std::vector<double> _paramValues ; //!
+  mutable roofitter::CubicTable _table ; //!
+
+  ClassDef(RooTabulatedPdf,1) // Cubic interpolation of a tabulated 1D PDF
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef Service_hh_
+#define Service_hh_
+
+#include <cstdio>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Main/inc/Job.hh"
+#include "Main/inc/ForkPool.hh"
+#include "Main/inc/FileQueue.hh"
+
+namespace roofitter {
+
+  // Keeps one process alive (with the ROOT libraries and dictionaries loaded) and runs jobs
+  // that are dropped into a spool directory. A job is a file called <name>.job containing the
+  // same arguments as the command line (e.g. "-c my.fcl -i input.root -o output.root").
+  // The service renames it to <name>.running when it starts, writes the job's output to <name>.log
+  // and renames it to <name>.done or <name>.failed when it finishes. Creating a file called "stop"
+  // in the spool directory makes the service finish the running jobs and exit.
+  //
+  // The analyses are constructed in this process (and cached so that the same analysis config
+  // is only ever constructed once) and each job runs in a forked worker with its own copy of them
+  class Service {
+  private:
+    std::string _spoolDir;
+    ForkPool _pool;
+    AnalysisCache _cache;
+    size_t _nDone;
+    size_t _nFailed;
+
+    std::string path(const std::string& filename) const { return _spoolDir + "/" + filename; }
+
+    // The names (without ".job") of the waiting jobs in the order they should run
+    std::vector<std::string> findJobs() const { return listFiles(_spoolDir, ".job"); }
+
+    void finished(const std::string& name, bool ok) {
+      std::string new_name = path(name + (ok ? ".done" : ".failed"));
+      std::rename(path(name + ".running").c_str(), new_name.c_str());
+      ok ? ++_nDone : ++_nFailed;
+      std::cout << "roofitter service: job " << name << (ok ? " done" : " failed") << " (" << _nDone << " done, " << _nFailed << " failed, " << _cache.size() << " analyses cached)" << std::endl;
+    }
+
+    void start(const std::string& name) {
+      std::string running = path(name + ".running");
+      if (std::rename(path(name + ".job").c_str(), running.c_str()) != 0) {
+	return; // it has gone
+      }
+      std::string log = path(name + ".log");
+
+      Job job;
+      try {
+	InputArgs args;
+	ProcessArgs(splitArguments(readFile(running)), args);
+	if (args.need_help || args.cfg_filename.empty()) {
+	  throw cet::exception("Service::start()") << "Bad arguments in job " << name;
+	}
+	job = prepareJob(args, &_cache);
+      }
+      catch (const std::exception& e) {
+	std::ofstream log_file(log);
+	log_file << e.what() << std::endl;
+	finished(name, false);
+	return;
+      }
+
+      std::cout << "roofitter service: starting job " << name << std::endl;
+      _pool.submit([job, log]() mutable {
+	  int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	  if (fd >= 0) {
+	    dup2(fd, STDOUT_FILENO);
+	    dup2(fd, STDERR_FILENO);
+	    close(fd);
+	  }
+	  runJob(job);
+	  std::cout << "Done" << std::endl;
+	  return std::vector<double>();
+	},
+	[this, name](const std::vector<double>&, bool ok) { finished(name, ok); });
+    }
+
+  public:
+    Service(const std::string& spool_dir, size_t n_workers) : _spoolDir(spool_dir), _pool(n_workers), _nDone(0), _nFailed(0) { }
+
+    void run() {
+      std::cout << "roofitter service: watching " << _spoolDir << " with " << _pool.nWorkers() << " workers" << std::endl;
+      while (true) {
+	for (const auto& i_job : findJobs()) {
+	  start(i_job); // waits for a free worker
+	  _pool.poll(0);
+	}
+
+	if (fileExists(path("stop"))) {
+	  _pool.wait();
+	  std::remove(path("stop").c_str());
+	  break;
+	}
+
+	if (_pool.nRunning() > 0) {
+	  _pool.poll(500);
+	}
+	else {
+	  usleep(500000);
+	}
+      }
+      std::cout << "roofitter service: stopped after " << _nDone << " jobs done and " << _nFailed << " failed" << std::endl;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef TemplateCache_hh_
+#define TemplateCache_hh_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "RooAbsPdf.h"
+#include "RooRealVar.h"
+#include "RooArgList.h"
+#include "RooFFTConvPdf.h"
+
+#include "Main/inc/FileQueue.hh"
+#include "Main/inc/RooTabulatedPdf.hh"
+#include "Main/inc/RooFastFFTConvPdf.hh"
+
+namespace roofitter {
+
+  // A directory of tabulated PDFs (e.g. the response convolutions) that is shared between runs.
+  // Each table is stored under a hash of a description of the PDF's whole graph (every node's class,
+  // name and title, and every variable's value and range) so a PDF whose shape parameters have not changed
+  // is read back instead of being recalculated. The files are memory-mapped when they are read and contain
+  // the full description, so a hash collision can't return the wrong table
+  class TemplateCache {
+  private:
+    std::string _dir;
+    int _nPoints;
+    size_t _nHits;
+    size_t _nMisses;
+
+    // File layout: magic, key size, number of values, key, values
+    static const char* magic() { return "RFTTAB01"; }
+    static size_t headerSize() { return 8 + 2*sizeof(uint64_t); }
+
+    std::string path(const std::string& key) const {
+      std::stringstream filename;
+      filename << _dir << "/" << std::hex << std::setfill('0') << std::setw(16) << hashString(key) << ".tab";
+      return filename.str();
+    }
+
+    bool load(const std::string& key, size_t n_values, std::vector<double>& values) const {
+      int fd = open(path(key).c_str(), O_RDONLY);
+      if (fd < 0) {
+	return false;
+      }
+      struct stat info;
+      if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) != headerSize() + key.size() + n_values*sizeof(double)) {
+	close(fd);
+	return false;
+      }
+      void* mapped = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (mapped == MAP_FAILED) {
+	return false;
+      }
+
+      const char* data = static_cast<const char*>(mapped);
+      uint64_t key_size = 0, n_stored = 0;
+      std::memcpy(&key_size, data+8, sizeof(key_size));
+      std::memcpy(&n_stored, data+8+sizeof(key_size), sizeof(n_stored));
+      bool ok = std::memcmp(data, magic(), 8) == 0 && key_size == key.size() && n_stored == n_values
+	&& std::memcmp(data+headerSize(), key.data(), key.size()) == 0;
+      if (ok) {
+	values.resize(n_values);
+	std::memcpy(values.data(), data+headerSize()+key.size(), n_values*sizeof(double));
+      }
+      munmap(mapped, info.st_size);
+      return ok;
+    }
+
+    void store(const std::string& key, const std::vector<double>& values) const {
+      uint64_t key_size = key.size(), n_values = values.size();
+      std::string contents(magic(), 8);
+      contents.append(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+      contents.append(reinterpret_cast<const char*>(&n_values), sizeof(n_values));
+      contents.append(key);
+      contents.append(reinterpret_cast<const char*>(values.data()), values.size()*sizeof(double));
+      writeFileAtomically(path(key), contents); // so that other runs never read half a table
+    }
+
+  public:
+    TemplateCache(const std::string& dir, int n_points) : _dir(dir), _nPoints(n_points), _nHits(0), _nMisses(0) {
+      makeDirectory(_dir);
+    }
+    TemplateCache(const TemplateCache&) = delete;
+    TemplateCache& operator=(const TemplateCache&) = delete;
+
+    int nPoints() const { return _nPoints; }
+    size_t nHits() const { return _nHits; }
+    size_t nMisses() const { return _nMisses; }
+
+    // Everything that the tabulated values of pdf depend on
+    static std::string describe(const RooAbsPdf& pdf, const RooRealVar& x, int n_points) {
+      std::stringstream key;
+      key << std::hexfloat;
+      key << "roofitter template 1\n";
+      key << n_points << " " << x.GetName() << " " << x.getMin() << " " << x.getMax() << " " << x.getBinning("cache", kFALSE).numBins() << "\n";
+
+      RooArgList nodes;
+      pdf.treeNodeServerList(&nodes);
+      std::vector<std::string> lines;
+      for (int i_node = 0; i_node < nodes.getSize(); ++i_node) {
+	const RooAbsArg* node = nodes.at(i_node);
+	std::stringstream line;
+	line << std::hexfloat << node->ClassName() << " " << node->GetName() << " \"" << node->GetTitle() << "\"";
+	if (const RooRealVar* var = dynamic_cast<const RooRealVar*>(node)) {
+	  if (var != &x) {
+	    line << " " << var->getVal() << " [" << var->getMin() << ", " << var->getMax() << "]";
+	  }
+	}
+	else if (node->isFundamental()) {
+	  if (const RooAbsReal* real = dynamic_cast<const RooAbsReal*>(node)) {
+	    line << " " << real->getVal();
+	  }
+	}
+	if (const RooFastFFTConvPdf* conv = dynamic_cast<const RooFastFFTConvPdf*>(node)) {
+	  line << " buffer " << conv->bufferFraction() << " bins " << conv->getNBins();
+	}
+	else if (const RooFFTConvPdf* conv = dynamic_cast<const RooFFTConvPdf*>(node)) {
+	  line << " buffer " << conv->bufferFraction();
+	}
+	lines.push_back(line.str());
+      }
+      std::sort(lines.begin(), lines.end());
+      lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+      for (const auto& i_line : lines) {
+	key << i_line << "\n";
+      }
+      return key.str();
+    }
+
+    // Fills the table of tab_pdf (which wraps pdf) from the cache, or tabulates it and adds it to the cache
+    void apply(RooTabulatedPdf& tab_pdf, const RooAbsPdf& pdf, const RooRealVar& x) {
+      std::string key = describe(pdf, x, tab_pdf.getNPoints());
+      std::vector<double> values;
+      if (load(key, tab_pdf.getNPoints()+1, values)) {
+	tab_pdf.setTable(values);
+	++_nHits;
+	std::cout << tab_pdf.GetName() << ": read from template cache " << path(key) << std::endl;
+      }
+      else {
+	store(key, tab_pdf.getTable());
+	++_nMisses;
+	std::cout << tab_pdf.GetName() << ": added to template cache " << path(key) << std::endl;
+      }
+    }
+  };
+}
+
+#endif
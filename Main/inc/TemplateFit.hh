@@ -0,0 +1,193 @@
+#ifndef TemplateFit_hh_
+#define TemplateFit_hh_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Main/inc/BinnedPoissonKernel.hh"
+
+namespace roofitter {
+
+  // Solves for the yields of a binned Poisson likelihood whose component shapes are all fixed.
+  // The NLL is then convex in the yields:
+  //
+  //   dNLL/dN_c        = 1 - sum_i n_i f_ci / nu_i
+  //   d2NLL/dN_c dN_d  = sum_i n_i f_ci f_di / nu_i^2
+  //
+  // so we take a few EM steps (which keep the yields positive) and then Newton steps,
+  // keeping any yield that wants to leave its allowed range fixed at the boundary.
+  class TemplateFit {
+  private:
+    const BinnedPoissonKernel& _kernel;
+    size_t _nIterations;
+
+    void gradientAndHessian(const std::vector<double>& yields, std::vector<double>& grad, std::vector<double>& hess) const {
+      size_t n_comps = _kernel.nComponents();
+      const double* nu = _kernel.predict(&yields[0]);
+      grad.assign(n_comps, 1.0);
+      hess.assign(n_comps*n_comps, 0.0);
+      for (size_t i_bin = 0; i_bin < _kernel.nBins(); ++i_bin) {
+	double n_over_nu = _kernel.count(i_bin) / nu[i_bin];
+	double n_over_nu2 = n_over_nu / nu[i_bin];
+	for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	  double f_i = _kernel.fractions(i_comp)[i_bin];
+	  grad[i_comp] -= n_over_nu * f_i;
+	  for (size_t j_comp = 0; j_comp <= i_comp; ++j_comp) {
+	    hess[i_comp*n_comps + j_comp] += n_over_nu2 * f_i * _kernel.fractions(j_comp)[i_bin];
+	  }
+	}
+      }
+      for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	for (size_t j_comp = 0; j_comp < i_comp; ++j_comp) {
+	  hess[j_comp*n_comps + i_comp] = hess[i_comp*n_comps + j_comp];
+	}
+      }
+    }
+
+    // Solves hess*x = rhs for the free components with a Cholesky decomposition
+    // (returns false if the matrix is not positive definite)
+    static bool solveFree(const std::vector<double>& hess, const std::vector<double>& rhs, const std::vector<bool>& free, std::vector<double>& x) {
+      size_t n = rhs.size();
+      std::vector<size_t> index;
+      for (size_t i = 0; i < n; ++i) {
+	if (free[i]) {
+	  index.push_back(i);
+	}
+      }
+      size_t m = index.size();
+      std::vector<double> L(m*m, 0.0);
+      for (size_t i = 0; i < m; ++i) {
+	for (size_t j = 0; j <= i; ++j) {
+	  double sum = hess[index[i]*n + index[j]];
+	  for (size_t k = 0; k < j; ++k) {
+	    sum -= L[i*m + k]*L[j*m + k];
+	  }
+	  if (i == j) {
+	    if (sum <= 0) {
+	      return false;
+	    }
+	    L[i*m + i] = std::sqrt(sum);
+	  }
+	  else {
+	    L[i*m + j] = sum / L[j*m + j];
+	  }
+	}
+      }
+      std::vector<double> y(m);
+      for (size_t i = 0; i < m; ++i) {
+	double sum = rhs[index[i]];
+	for (size_t k = 0; k < i; ++k) {
+	  sum -= L[i*m + k]*y[k];
+	}
+	y[i] = sum / L[i*m + i];
+      }
+      x.assign(n, 0.0);
+      for (size_t i = m; i-- > 0; ) {
+	double sum = y[i];
+	for (size_t k = i+1; k < m; ++k) {
+	  sum -= L[k*m + i]*x[index[k]];
+	}
+	x[index[i]] = sum / L[i*m + i];
+      }
+      return true;
+    }
+
+  public:
+    TemplateFit(const BinnedPoissonKernel& kernel) : _kernel(kernel), _nIterations(0) { }
+
+    size_t nIterations() const { return _nIterations; }
+
+    // Moves yields to the minimum of the NLL within [mins, maxs].
+    // Returns true if it converged
+    bool solve(std::vector<double>& yields, const std::vector<double>& mins, const std::vector<double>& maxs,
+	       double tolerance = 1e-10, size_t max_iterations = 200) {
+      size_t n_comps = _kernel.nComponents();
+      auto clamp = [&](std::vector<double>& y) {
+	for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	  y[i_comp] = std::min(std::max(y[i_comp], mins[i_comp]), maxs[i_comp]);
+	}
+      };
+
+      // EM steps to get close to the minimum from whatever the initial values are
+      double total = 0;
+      for (size_t i_bin = 0; i_bin < _kernel.nBins(); ++i_bin) {
+	total += _kernel.count(i_bin);
+      }
+      for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	if (!(yields[i_comp] > 0)) {
+	  yields[i_comp] = std::max(total / n_comps, 1.0);
+	}
+      }
+      clamp(yields);
+      std::vector<double> grad, hess;
+      for (size_t i_em = 0; i_em < 10; ++i_em) {
+	gradientAndHessian(yields, grad, hess);
+	for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	  yields[i_comp] *= (1.0 - grad[i_comp]);
+	}
+	clamp(yields);
+      }
+
+      // Newton steps with a backtracking line search
+      _nIterations = 0;
+      std::vector<double> step, trial(n_comps);
+      std::vector<bool> free(n_comps);
+      double current_nll = _kernel.nll(&yields[0]);
+      while (_nIterations < max_iterations) {
+	++_nIterations;
+	gradientAndHessian(yields, grad, hess);
+	for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	  double epsilon = 1e-9*std::max(1.0, maxs[i_comp] - mins[i_comp]); // EM steps only approach a boundary
+	  bool at_min = (yields[i_comp] <= mins[i_comp] + epsilon && grad[i_comp] > 0);
+	  bool at_max = (yields[i_comp] >= maxs[i_comp] - epsilon && grad[i_comp] < 0);
+	  if (at_min) {
+	    yields[i_comp] = mins[i_comp];
+	  }
+	  else if (at_max) {
+	    yields[i_comp] = maxs[i_comp];
+	  }
+	  free[i_comp] = !(at_min || at_max);
+	}
+	std::vector<double> minus_grad(n_comps);
+	for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	  minus_grad[i_comp] = -grad[i_comp];
+	}
+	if (!solveFree(hess, minus_grad, free, step)) {
+	  return false;
+	}
+
+	double decrement = 0; // Newton decrement: the expected decrease in the NLL is half this
+	for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	  decrement -= grad[i_comp]*step[i_comp];
+	}
+	if (decrement < tolerance) {
+	  return true;
+	}
+
+	current_nll = _kernel.nll(&yields[0]);
+	double alpha = 1.0;
+	bool improved = false;
+	for (size_t i_search = 0; i_search < 30; ++i_search, alpha *= 0.5) {
+	  for (size_t i_comp = 0; i_comp < n_comps; ++i_comp) {
+	    trial[i_comp] = yields[i_comp] + alpha*step[i_comp];
+	  }
+	  clamp(trial);
+	  double trial_nll = _kernel.nll(&trial[0]);
+	  if (trial_nll <= current_nll) {
+	    yields = trial;
+	    current_nll = trial_nll;
+	    improved = true;
+	    break;
+	  }
+	}
+	if (!improved) {
+	  return decrement < std::sqrt(tolerance);
+	}
+      }
+      return false;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef TreeScan_hh_
+#define TreeScan_hh_
+
+#include <string>
+#include <vector>
+
+#include "TTree.h"
+#include "TTreeFormula.h"
+#include "TTreeFormulaManager.h"
+
+#include "cetlib_except/exception.h"
+
+namespace roofitter {
+
+  // Evaluates a list of expressions and cuts on every entry of a tree in a single pass.
+  // This is what TTree::Draw() does internally, but lets us fill more than one output
+  // (or outputs with more than three dimensions) without going over the tree again
+  class TreeScan {
+  private:
+    TTree* _tree;
+    std::vector<TTreeFormula*> _exprs;
+    std::vector<TTreeFormula*> _cuts;
+
+    TTreeFormula* compile(const std::string& expr) {
+      std::string formula_name = "roofitter_scan_" + std::to_string(_exprs.size() + _cuts.size());
+      TTreeFormula* formula = new TTreeFormula(formula_name.c_str(), expr.c_str(), _tree);
+      if (formula->GetNdim() == 0) {
+	delete formula;
+	throw cet::exception("TreeScan::compile()") << "Could not compile expression \"" << expr << "\" for tree " << _tree->GetName();
+      }
+      return formula;
+    }
+
+  public:
+    TreeScan(TTree* tree) : _tree(tree) { }
+    TreeScan(const TreeScan&) = delete;
+    TreeScan& operator=(const TreeScan&) = delete;
+
+    ~TreeScan() {
+      // the formula manager deletes itself when its last formula is removed
+      for (auto& i_formula : _exprs) {
+	delete i_formula;
+      }
+      for (auto& i_formula : _cuts) {
+	delete i_formula;
+      }
+    }
+
+    // Returns the index of this expression in the values passed to the callback
+    size_t addExpression(const std::string& expr) {
+      _exprs.push_back(compile(expr));
+      return _exprs.size()-1;
+    }
+
+    // Returns the index of this cut in the cut values passed to the callback
+    // (an empty cut always passes)
+    size_t addCut(const std::string& cut) {
+      _cuts.push_back(compile(cut.empty() ? "1" : cut));
+      return _cuts.size()-1;
+    }
+
+    // Calls callback(values, cut_values) for every instance of every entry in the tree. An instance passes a cut if
+    // its value is not zero, and (as in TTree::Draw) the value of the selection is the instance's weight
+    template <typename Callback>
+    void run(Callback callback) {
+      TTreeFormulaManager* manager = new TTreeFormulaManager();
+      for (auto& i_formula : _exprs) {
+	manager->Add(i_formula);
+      }
+      for (auto& i_formula : _cuts) {
+	manager->Add(i_formula);
+      }
+      manager->Sync();
+
+      std::vector<double> values(_exprs.size());
+      std::vector<double> cut_values(_cuts.size());
+      int tree_number = -1;
+      Long64_t n_entries = _tree->GetEntries();
+      for (Long64_t i_entry = 0; i_entry < n_entries; ++i_entry) {
+	if (_tree->LoadTree(i_entry) < 0) {
+	  break;
+	}
+	if (_tree->GetTreeNumber() != tree_number) { // a TChain has moved on to the next file
+	  tree_number = _tree->GetTreeNumber();
+	  for (auto& i_formula : _exprs) {
+	    i_formula->UpdateFormulaLeaves();
+	  }
+	  for (auto& i_formula : _cuts) {
+	    i_formula->UpdateFormulaLeaves();
+	  }
+	}
+
+	int n_data = manager->GetNdata();
+	for (int i_data = 0; i_data < n_data; ++i_data) {
+	  for (size_t i_cut = 0; i_cut < _cuts.size(); ++i_cut) {
+	    cut_values[i_cut] = _cuts[i_cut]->EvalInstance(i_data);
+	  }
+	  for (size_t i_expr = 0; i_expr < _exprs.size(); ++i_expr) {
+	    values[i_expr] = _exprs[i_expr]->EvalInstance(i_data);
+	  }
+	  callback(values, cut_values);
+	}
+      }
+    }
+  };
+}
+
+#endif
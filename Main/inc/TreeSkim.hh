@@ -0,0 +1,202 @@
+#ifndef TreeSkim_hh_
+#define TreeSkim_hh_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TList.h"
+#include "TNamed.h"
+#include "TBranch.h"
+#include "TTreeFormula.h"
+#include "Compression.h"
+
+#include "cetlib_except/exception.h"
+
+#include "Main/inc/FileQueue.hh"
+#include "Main/inc/TreeScan.hh"
+
+namespace roofitter {
+
+  // A slim copy of an input tree with only the columns that the analyses use, so that filling the data again
+  // (e.g. with different cuts or binning) doesn't have to read all the other branches. Every expression (observable
+  // leaves and cuts) is stored already evaluated, and every scalar leaf that they use is copied too so that new
+  // expressions of the same leaves can be evaluated on the skim. There is one row for each instance (as TreeScan sees them)
+  // of each entry that passes the optional preselection. A skim is kept in the skim directory under a hash of the input file,
+  // tree and preselection, and is remade if the input file has changed or an expression needs a leaf that the skim doesn't have
+  class TreeSkim {
+  private:
+    std::string _dir;
+    std::string _preselection;
+
+    std::string path(const std::string& filename, const std::string& treename) const {
+      std::stringstream skim_path;
+      skim_path << _dir << "/skim_" << std::hex << std::setfill('0') << std::setw(16) << hashString(filename + "\n" + treename + "\n" + _preselection) << ".root";
+      return skim_path.str();
+    }
+
+    // Identifies the input that the skim was made from (this is the skim tree's title)
+    std::string describe(const std::string& filename, TTree* tree) const {
+      std::stringstream description;
+      description << "roofitter skim 1: " << filename << " " << tree->GetName() << " " << modificationTime(filename) << " " << tree->GetEntries()
+		  << " preselection \"" << _preselection << "\"";
+      return description.str();
+    }
+
+    // The name that a leaf is used by in expressions (e.g. "deent.mom" for leaf "mom" of branch "deent")
+    static std::string leafName(const TLeaf* leaf) {
+      std::string branch_name = leaf->GetBranch()->GetName();
+      std::string name = leaf->GetName();
+      if (leaf->GetBranch()->GetListOfLeaves()->GetEntries() == 1 || name == branch_name) {
+	return branch_name;
+      }
+      if (!branch_name.empty() && branch_name.back() == '.') {
+	return branch_name + name;
+      }
+      return branch_name + "." + name;
+    }
+
+    // Only leaves with one value per entry can be copied into the skim as they are
+    static bool isScalar(TTree* tree, const std::string& leaf_name) {
+      TTreeFormula formula("roofitter_skim_leaf", leaf_name.c_str(), tree);
+      return formula.GetNdim() != 0 && formula.GetMultiplicity() == 0;
+    }
+
+    // True if expr can be evaluated on the skim: either it was stored or all its leaves were copied
+    static bool hasExpression(TTree* skim, const std::string& expr, const std::vector<std::string>& leaves) {
+      if (skim->GetUserInfo()->FindObject(expr.c_str())) {
+	return true;
+      }
+      for (const auto& i_leaf : leaves) {
+	if (i_leaf.empty() || !skim->GetBranch(i_leaf.c_str())) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+  public:
+    TreeSkim(const std::string& dir, const std::string& preselection) : _dir(dir), _preselection(preselection) {
+      makeDirectory(_dir);
+    }
+
+    // The column of tree to use for expr (the stored column if tree is a skim that evaluated expr, otherwise expr itself)
+    static std::string column(TTree* tree, const std::string& expr) {
+      if (tree && tree->GetUserInfo()) {
+	if (const TNamed* stored = dynamic_cast<const TNamed*>(tree->GetUserInfo()->FindObject(expr.c_str()))) {
+	  return stored->GetTitle();
+	}
+      }
+      return expr;
+    }
+
+    // Returns the skim of tree (from filename) for these expressions, making it first if there isn't a matching one.
+    // file should hold the input file, and is replaced by the skim file
+    TTree* open(const std::string& filename, TTree* tree, const std::vector<std::string>& exprs, std::unique_ptr<TFile>& file) {
+
+      // Find the leaves that each expression uses (an empty name for a leaf that can't be copied)
+      std::map< std::string, std::vector<std::string> > expr_leaves;
+      std::vector<std::string> leaves;
+      for (const auto& i_expr : exprs) {
+	if (expr_leaves.count(i_expr) != 0) {
+	  continue;
+	}
+	TTreeFormula formula("roofitter_skim_expr", i_expr.c_str(), tree);
+	if (formula.GetNdim() == 0) {
+	  throw cet::exception("TreeSkim::open()") << "Could not compile expression \"" << i_expr << "\" for tree " << tree->GetName();
+	}
+	auto& i_leaves = expr_leaves[i_expr];
+	for (int i_code = 0; i_code < formula.GetNcodes(); ++i_code) {
+	  const TLeaf* leaf = formula.GetLeaf(i_code);
+	  if (!leaf) {
+	    continue;
+	  }
+	  std::string leaf_name = leafName(leaf);
+	  if (!isScalar(tree, leaf_name)) {
+	    i_leaves.push_back("");
+	    continue;
+	  }
+	  i_leaves.push_back(leaf_name);
+	  if (std::find(leaves.begin(), leaves.end(), leaf_name) == leaves.end()) {
+	    leaves.push_back(leaf_name);
+	  }
+	}
+      }
+
+      std::string skim_path = path(filename, tree->GetName());
+      std::string description = describe(filename, tree);
+      if (fileExists(skim_path)) {
+	std::unique_ptr<TFile> skim_file(new TFile(skim_path.c_str(), "READ"));
+	TTree* skim = skim_file->IsZombie() ? 0 : (TTree*) skim_file->Get("skim");
+	bool matches = skim && description == skim->GetTitle();
+	for (const auto& i_expr_leaves : expr_leaves) {
+	  matches = matches && hasExpression(skim, i_expr_leaves.first, i_expr_leaves.second);
+	}
+	if (matches) {
+	  std::cout << "Reading skim " << skim_path << " (" << skim->GetEntries() << " rows, " << skim->GetNbranches() << " columns)" << std::endl;
+	  file = std::move(skim_file);
+	  return skim;
+	}
+	std::cout << "Skim " << skim_path << " doesn't match " << filename << " or the expressions, remaking it" << std::endl;
+      }
+
+      // The columns are the copied leaves and then any expressions that aren't just a copied leaf
+      std::vector<std::string> column_exprs(leaves);
+      std::vector<std::string> column_names(leaves);
+      for (const auto& i_expr_leaves : expr_leaves) {
+	if (std::find(leaves.begin(), leaves.end(), i_expr_leaves.first) == leaves.end()) {
+	  column_exprs.push_back(i_expr_leaves.first);
+	  column_names.push_back("roofitter_expr" + std::to_string(column_names.size() - leaves.size()));
+	}
+      }
+
+      std::string tmp_path = skim_path + ".tmp" + std::to_string(getpid());
+      Long64_t n_rows = 0;
+      {
+	TFile skim_file(tmp_path.c_str(), "RECREATE", "roofitter skim", ROOT::CompressionSettings(ROOT::kLZ4, 4));
+	if (skim_file.IsZombie()) {
+	  throw cet::exception("TreeSkim::open()") << "Can't write " << tmp_path;
+	}
+	TTree* skim = new TTree("skim", description.c_str()); // belongs to skim_file
+	std::vector<double> row(column_exprs.size());
+	TreeScan scan(tree);
+	for (size_t i_column = 0; i_column < column_exprs.size(); ++i_column) {
+	  skim->Branch(column_names[i_column].c_str(), &row[i_column], (column_names[i_column] + "/D").c_str());
+	  scan.addExpression(column_exprs[i_column]);
+	  if (i_column >= leaves.size()) {
+	    skim->GetUserInfo()->Add(new TNamed(column_exprs[i_column].c_str(), column_names[i_column].c_str()));
+	  }
+	}
+	scan.addCut(_preselection);
+	scan.run([&](const std::vector<double>& values, const std::vector<double>& cut_values) {
+	    if (cut_values[0] != 0) {
+	      std::copy(values.begin(), values.end(), row.begin());
+	      skim->Fill();
+	    }
+	  });
+	n_rows = skim->GetEntries();
+	skim_file.cd();
+	skim->Write();
+	skim_file.Close();
+      }
+      if (std::rename(tmp_path.c_str(), skim_path.c_str()) != 0) {
+	throw cet::exception("TreeSkim::open()") << "Can't rename " << tmp_path << " to " << skim_path;
+      }
+      std::cout << "Skimmed " << tree->GetEntries() << " entries of " << filename << " to " << skim_path << " (" << n_rows << " rows, "
+		<< leaves.size() << " leaves and " << column_exprs.size() - leaves.size() << " expressions)" << std::endl;
+
+      file.reset(new TFile(skim_path.c_str(), "READ"));
+      return (TTree*) file->Get("skim");
+    }
+  };
+}
+
+#endif
@@ -4,3 +4,8 @@
 #include "Main/inc/RooDSCB.hh"
 //added by S Middleton:
 #include "Main/inc/RooRPCPdf.hh"
+#include "Main/inc/RooBinnedPoissonNLL.hh"
+#include "Main/inc/RooForkedSum.hh"
+#include "Main/inc/RooTabulatedPdf.hh"
+#include "Main/inc/RooFastFFTConvPdf.hh"
+#include "Main/inc/RooGKSingularIntegrator1D.hh"
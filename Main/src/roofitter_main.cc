@@ -1,22 +1,11 @@
+#include <new>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 
-#include <getopt.h>
-
 #include "cetlib_except/exception.h"
 
-#include "fhiclcpp/intermediate_table.h"
-#include "fhiclcpp/parse.h"
-#include "fhiclcpp/ParameterSet.h"
-#include "fhiclcpp/make_ParameterSet.h"
-
-#include "fhiclcpp/types/Atom.h"
-#include "fhiclcpp/types/Table.h"
-#include "fhiclcpp/types/Sequence.h"
-
-#include "cetlib/filepath_maker.h"
-
 #include "TCanvas.h"
 #include "TFile.h"
 #include "TTree.h"
@@ -25,45 +14,13 @@
 
 #include "Main/inc/Configs.hh"
 #include "Main/inc/Analysis.hh"
+#include "Main/inc/Job.hh"
+#include "Main/inc/Service.hh"
+#include "Main/inc/Farm.hh"
+#include "Main/inc/MemoryStats.hh"
 
 namespace roofitter {
 
-  struct InputArgs {
-    InputArgs() : cfg_filename(""), need_help(false), debug_cfg(false), debug_cfg_filename("") { }
-
-    std::string cfg_filename;
-    bool need_help;
-    bool debug_cfg;
-    std::string debug_cfg_filename;
-    std::string input_filename;
-    std::string input_treename;
-    std::string output_filename;
-  };
-
-  struct InputConfig {
-    fhicl::Atom<std::string> filename{fhicl::Name("filename"), fhicl::Comment("Input file name")};
-    fhicl::Atom<std::string> treename{fhicl::Name("treename"), fhicl::Comment("Input tree name")};
-  };
-
-  struct OutputConfig {
-    fhicl::Atom<std::string> filename{fhicl::Name("filename"), fhicl::Comment("Output file name")};
-  };
-
-  struct Config {
-    fhicl::Table<InputConfig> input{fhicl::Name("input"), fhicl::Comment("Configuration of input file")};
-    fhicl::Table<OutputConfig> output{fhicl::Name("output"), fhicl::Comment("Configuration of output file")};
-    fhicl::Sequence< fhicl::Table<AnalysisConfig> > analyses{fhicl::Name("analyses"), fhicl::Comment("List of analyses")};
-  };
-
-
-  fhicl::Table<Config> retrieveConfiguration( fhicl::ParameterSet const & pset ) {
-    std::set<std::string> ignorable_keys {}; // keys that should be ignored by the validation system (can be empty)
-    
-    fhicl::Table<Config> const result { pset, ignorable_keys }; // performs validation and value setting
-    
-    return result;
-  }
-
   void PrintHelp() {
     std::cout << "Input Arguments:" << std::endl;
     std::cout << "\t-c, --config [cfg file]: input configuration file" << std::endl;
@@ -71,60 +28,17 @@ namespace roofitter {
     std::cout << "\t-t, --tree [tree name]: tree name (inc. directory) in the input file (overrides anything in cfg file)" << std::endl;
     std::cout << "\t-o, --output [root file]: output ROOT file that will be created (overrides anything in cfg file)" << std::endl;
     std::cout << "\t-d, --debug-config [filename]: print out the final config file to file" << std::endl;
+    std::cout << "\t-s, --service [spool dir]: run as a service that runs the jobs put in this directory (see README)" << std::endl;
+    std::cout << "\t-w, --workers [n]: number of processes to run at the same time (service jobs, farm tasks and systematics, default is the number of cores)" << std::endl;
+    std::cout << "\t-p, --parameter [name=value]: set a parameter before filling and fitting (can be given more than once)" << std::endl;
+    std::cout << "\t-f, --farm [campaign file]: run every combination of configs, inputs and variations in a campaign as a farm (see README)" << std::endl;
+    std::cout << "\t-j, --farm-worker [farm dir]: run tasks from a farm started elsewhere with -f" << std::endl;
+    std::cout << "\t-n, --dry-run: build and check every analysis without filling or fitting anything (this is also done before every run)" << std::endl;
+    std::cout << "\t-a, --asimov: fit the data expected from each model instead of the input tree and print the expected uncertainties and significance" << std::endl;
+    std::cout << "\t-k, --skim [skim dir]: only make a skim of the input tree with the columns that the analyses use in this directory (see README)" << std::endl;
     std::cout << "\t-h, --help: print this help message" << std::endl;
   }
 
-  void ProcessArgs(int argc, char** argv, InputArgs& args) {
-    const char* const short_opts = "c:i:t:o:d:h";
-
-    const option long_opts[] = {
-      {"config", required_argument, nullptr, 'c'},
-      {"input", required_argument, nullptr, 'i'},
-      {"tree", required_argument, nullptr, 't'},
-      {"output", required_argument, nullptr, 'o'},
-      {"debug-config", required_argument, nullptr, 'd'},
-      {"help", no_argument, nullptr, 'h'},
-      {nullptr, no_argument, nullptr, 0}
-    };
-
-    while (true) {
-      const auto opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
-
-      if (-1 == opt)
-	break;
-
-      switch (opt) {
-    
-      case 'c':
-	args.cfg_filename = std::string(optarg);
-	break;
-
-      case 'i':
-	args.input_filename = std::string(optarg);
-	break;
-
-      case 't':
-	args.input_treename = std::string(optarg);
-	break;
-
-      case 'o':
-	args.output_filename = std::string(optarg);
-	break;
-
-      case 'd':
-	args.debug_cfg = true;
-	args.debug_cfg_filename = std::string(optarg);
-	break;
-
-      case 'h': // -h or --help
-      case '?': // Unrecognized option
-      default:
-	args.need_help = true;
-	break;
-      }
-    }
-  }
-
   int main(int argc, char **argv) {
 
     InputArgs args;
@@ -134,88 +48,67 @@ namespace roofitter {
       return 0;
     }
 
-    // This defines the path to be used to resolve fcl #include directives
-    // The argument is the name of an environment variable
-    // This policy says that the the top level file may be in the local directory,
-    // but all other #include files must be relative to the path defined in the env variable.
-    // There are other policy choices that will exclude the local directory for the top file.
-    cet::filepath_lookup_after1 policy("FHICL_FILE_PATH");
-
-    // This is boilerplate: you need to make an intermediate object
-    // The intermediate object is editable; this is how art adds the command line arguments as overrides
-    fhicl::intermediate_table tbl;
-    fhicl::parse_document(args.cfg_filename, policy, tbl);
-
-    // Then turn that object into a fhicl table:
-    fhicl::ParameterSet pset;
-    fhicl::make_ParameterSet(tbl, pset);
-
-    auto config = retrieveConfiguration(pset);
-    /*    if (args.debug_cfg) {
-      std::ofstream fileout(args.debug_cfg_filename);
-      config.print(fileout);
-      std::cout << "Config written to " << args.debug_cfg_filename << std::endl;
+    if (!args.spool_dir.empty()) {
+      Service service(args.spool_dir, args.n_workers);
+      service.run();
       return 0;
-      }*/
-
-
-    std::string filename = config().input().filename();
-    if (!args.input_filename.empty()) { // override cfg file with
-      filename = args.input_filename;
-    }
-    if (filename.empty()) {
-      throw cet::exception("roofitter::main()") << "No filename specified";
-    }
-    TFile* file = new TFile(filename.c_str(), "READ");
-    if (file->IsZombie()) {
-      throw cet::exception("roofitter::main()") << "Input file " << filename << " is a zombie";
     }
 
-    std::string treename = config().input().treename();
-    if (!args.input_treename.empty()) { // override cfg tree with
-      treename = args.input_treename;
-    }
-    if (treename.empty()) {
-      throw cet::exception("roofitter::main()") << "No treename specified";
-    }
-    TTree* tree = (TTree*) file->Get(treename.c_str());
-    if (!tree) {
-      throw cet::exception("roofitter::main") << "Input tree " << treename << " is not in file";
+    if (!args.farm_cfg_filename.empty()) {
+      auto farm_cfg = retrieveFarmConfiguration(args.farm_cfg_filename);
+      FarmCoordinator coordinator(farm_cfg());
+      return coordinator.run(args.n_workers) > 0 ? 1 : 0;
     }
 
-    std::vector<AnalysisConfig> analysis_cfgs = config().analyses();
-    std::vector<Analysis> analyses;
-    for (auto& i_ana_cfg : analysis_cfgs) {
-      Analysis i_ana(i_ana_cfg);
-      i_ana.fillData(tree);
-      i_ana.fit();
-      i_ana.unfold();
-      i_ana.calculate();
-      analyses.push_back(i_ana);
-    }
-    
-    std::string outfilename = config().output().filename();
-    if (!args.output_filename.empty()) { // override cfg file with
-      outfilename = args.output_filename;
+    if (!args.farm_dir.empty()) {
+      FarmWorker worker(args.farm_dir, args.n_workers);
+      worker.run();
+      return 0;
     }
-    if (outfilename.empty()) {
-      throw cet::exception("roofitter::main()") << "No outfilename specified";
+
+    Job job = prepareJob(args);
+    if (args.dry_run) {
+      std::unique_ptr<TFile> input_file;
+      probeJob(job, args.asimov ? 0 : openInputTree(job, input_file), true);
+      std::cout << "Dry run OK" << std::endl;
+      return 0;
     }
-    TFile* outfile = new TFile(outfilename.c_str(), "RECREATE");
-    for (auto& i_ana : analyses) {
-      TDirectory* outdir = outfile->mkdir(i_ana.getConf().name().c_str());
-      outdir->cd();
-      i_ana.Write();
-      outfile->cd();
+    if (!args.skim_dir.empty()) {
+      std::unique_ptr<TFile> input_file;
+      TTree* tree = openInputTree(job, input_file);
+      probeJob(job, tree);
+      skimInputTree(job, tree, input_file);
+      std::cout << "Skim OK" << std::endl;
+      return 0;
     }
-    outfile->Write();
-    outfile->Close();
+    runJob(job);
     
     std::cout << "Done" << std::endl;
     return 0;
   }
 }
 
+// Count every heap allocation so that runJob() can report how many each stage of an analysis makes
+void* operator new(std::size_t n_bytes) {
+  void* ptr = std::malloc(n_bytes ? n_bytes : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  roofitter::countAllocation(n_bytes);
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  if (ptr) {
+    roofitter::countFree();
+  }
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  operator delete(ptr);
+}
+
 int main(int argc, char **argv) {
 
   roofitter::main(argc, argv);